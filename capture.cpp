@@ -0,0 +1,160 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <atomic>
+#include <thread>
+#include "device.h"
+#include "capture.h"
+#include "os.h"
+
+/*
+Disk capture runs in its own thread so requests to the adapter go out back-to-back no matter what
+the consumer is doing.  Packets land in a preallocated ring (locked in memory when allowed) and are
+handed over through a single-producer/single-consumer queue:  the capture thread only writes head,
+the consumer only writes tail.  Each capture has its own ring and thread, so threads that each read a
+disk on their own adapter don't share anything.
+*/
+
+struct capture {
+    capturePacket *ring;
+    std::atomic<uint32_t> head, tail;
+    std::atomic<bool> finished, stopRequest;
+    std::thread thread;
+    captureStats stats;
+    uint8_t nextSequence;
+    double intervalSum, intervalSumSq;
+    uint64_t periodSum;             //intervals of packets that followed one another, for capture_next
+    int periodCount;
+};
+
+static void capture_run(capture *c, devContext *owner, int maxBytes) {
+    int bytesIn=0;
+    uint64_t last, now;
+    uint32_t interval;
+    bool stalled=false;
+
+    dev_attach(owner);
+    int packetSize=dev_limits()->diskRead;
+    c->stats.realtime=os_setRealtime();
+    last=getMicros();
+    while(!c->stopRequest.load(std::memory_order_relaxed)) {
+        uint32_t h=c->head.load(std::memory_order_relaxed);
+        if(h-c->tail.load(std::memory_order_acquire) >= CAPTURE_RINGSIZE) {   //consumer is behind
+            if(!stalled)
+                c->stats.stalls++;
+            stalled=true;
+            std::this_thread::yield();
+            continue;
+        }
+        stalled=false;
+        capturePacket *pkt=&c->ring[h&(CAPTURE_RINGSIZE-1)];
+        pkt->size=dev_readPacket(pkt->data, &pkt->sequence);
+
+        now=getMicros();
+        interval=(uint32_t)(now-last);
+        last=now;
+        pkt->interval_us=interval;
+        c->intervalSum+=interval;
+        c->intervalSumSq+=(double)interval*interval;
+        if(interval>c->stats.maxInterval_us)
+            c->stats.maxInterval_us=interval;
+        c->stats.packets++;
+
+        c->head.store(h+1, std::memory_order_release);
+        if(pkt->size<packetSize)      //end of disk or read error
+            break;
+        bytesIn+=pkt->size;
+        if(bytesIn>=maxBytes-packetSize)
+            break;
+    }
+    c->finished.store(true, std::memory_order_release);
+}
+
+static void freeCapture(capture *c) {
+    if(c->stats.locked)
+        os_unlockMemory(c->ring, sizeof(capturePacket)*CAPTURE_RINGSIZE);
+    free(c->ring);
+    delete c;
+}
+
+//Start reading the disk (the current adapter) into a capture of its own.  maxBytes limits how much
+//gets read.  NULL if the read didn't start.
+capture *capture_start(int maxBytes) {
+    capture *c=new capture();
+    c->ring=(capturePacket*)malloc(sizeof(capturePacket)*CAPTURE_RINGSIZE);
+    if(!c->ring) {
+        delete c;
+        return NULL;
+    }
+    //touch every page up front so the capture thread never faults
+    memset(c->ring, 0, sizeof(capturePacket)*CAPTURE_RINGSIZE);
+    c->stats.locked=os_lockMemory(c->ring, sizeof(capturePacket)*CAPTURE_RINGSIZE);
+    c->nextSequence=1;      //adapter starts counting at 1
+    if(!dev_readStart()) {
+        freeCapture(c);
+        return NULL;
+    }
+    c->thread=std::thread(capture_run, c, dev_current(), maxBytes);
+    return c;
+}
+
+//Next packet in order, waits if needed.  NULL when the capture is over.
+capturePacket *capture_next(capture *c) {
+    uint32_t t=c->tail.load(std::memory_order_relaxed);
+    while(t==c->head.load(std::memory_order_acquire)) {
+        if(c->finished.load(std::memory_order_acquire) && t==c->head.load(std::memory_order_acquire))
+            return NULL;
+        std::this_thread::yield();
+    }
+    capturePacket *pkt=&c->ring[t&(CAPTURE_RINGSIZE-1)];
+    pkt->lost=0;
+    if(pkt->size>0) {
+        pkt->lost=(uint8_t)(pkt->sequence-c->nextSequence);
+        c->nextSequence=pkt->sequence+1;
+        if(!pkt->lost) {
+            c->periodSum+=pkt->interval_us;
+            c->periodCount++;
+        } else if(c->periodCount) {
+            //the 8-bit sequence wraps every 256 packets, the time the hole took says how many times
+            uint32_t period=(uint32_t)(c->periodSum/c->periodCount);
+            int estimate=period? (int)(pkt->interval_us/period)-1: 0;
+            if(estimate-pkt->lost>=128)
+                pkt->lost+=(estimate-pkt->lost+128)/256*256;
+        }
+        c->stats.dropped+=pkt->lost;
+    }
+    return pkt;
+}
+
+//Done with the packet returned by capture_next()
+void capture_release(capture *c) {
+    c->tail.store(c->tail.load(std::memory_order_relaxed)+1, std::memory_order_release);
+}
+
+//Stop the capture thread and free the capture
+void capture_stop(capture *c, captureStats *out) {
+    c->stopRequest=true;
+    if(c->thread.joinable())
+        c->thread.join();
+    if(c->stats.packets) {
+        double avg=c->intervalSum/c->stats.packets;
+        double var=c->intervalSumSq/c->stats.packets-avg*avg;
+        c->stats.avgInterval_us=(uint32_t)avg;
+        c->stats.jitter_us=(uint32_t)sqrt(var>0? var: 0);
+    }
+    if(out)
+        *out=c->stats;
+    freeCapture(c);
+}
+
+void capture_printStats(captureStats *s) {
+    printf("Capture: %d packets, %d dropped (%.2f%%), request interval avg %uus max %uus jitter %uus%s%s",
+        s->packets, s->dropped, s->packets? 100.0*s->dropped/(s->packets+s->dropped): 0.0,
+        s->avgInterval_us, s->maxInterval_us, s->jitter_us,
+        s->realtime? ", realtime": "", s->locked? ", locked": "");
+    if(s->stalls)
+        printf(", %d stalls", s->stalls);
+    printf("\n");
+}
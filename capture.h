@@ -0,0 +1,39 @@
+#pragma once
+#include "device.h"
+
+enum {
+    CAPTURE_RINGSIZE=1024,      //packets buffered between capture thread and consumer (power of 2)
+};
+
+struct capturePacket {
+    int size;                   //<0 on read error, short at end of disk
+    uint8_t sequence;           //adapter's packet counter
+    uint32_t interval_us;       //since the previous packet came in
+    int lost;                   //packets dropped just before this one (filled in by capture_next)
+    uint8_t data[REPORT_MAX];
+};
+
+//Hole in a capture left by dropped packets
+struct captureGap {
+    int pos;                    //offset into the capture where data went missing
+    int size;                   //estimated number of bytes lost
+};
+
+struct captureStats {
+    int packets;
+    int dropped;                //packets lost by the adapter (sequence gaps)
+    int stalls;                 //times the ring was full and the capture thread had to wait
+    bool realtime;              //capture thread got SCHED_FIFO / time critical priority
+    bool locked;                //ring is locked in memory
+    uint32_t avgInterval_us;    //time between back-to-back requests
+    uint32_t maxInterval_us;
+    uint32_t jitter_us;         //standard deviation of the request interval
+};
+
+struct capture;
+
+capture *capture_start(int maxBytes);
+capturePacket *capture_next(capture *c);
+void capture_release(capture *c);
+void capture_stop(capture *c, captureStats *stats);
+void capture_printStats(captureStats *stats);
@@ -0,0 +1,719 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "daemon.h"
+
+/*
+Daemon mode keeps the adapter open and takes jobs over a local socket, one JSON object per line:
+
+  {"id":"1", "cmd":"flash", "args":["game.fds","3"], "priority":5}
+
+cmd is any console command, by long name (flash, save, list, ...) or -x form.  Higher priority runs
+first, equal priority in arrival order.  Everything happens on one worker thread which owns the
+device, so jobs never interleave on the wire.  Each job answers with events, one per line:
+
+  {"id":"1","event":"queued","position":0}
+  {"id":"1","event":"started"}
+  {"id":"1","event":"progress","done":4096,"total":65536}
+  {"id":"1","event":"output","text":"..."}          console output of the command
+  {"id":"1","event":"done","ok":true,"ms":1234}
+
+Daemon commands:  status (device info and flash layout, answered from cache without waiting for the
+queue), queue, cancel (args = job ids still waiting), shutdown.  If the adapter is unplugged the
+daemon closes it, tells every client {"event":"device","connected":false} and reopens it when it
+comes back.
+
+One daemon drives one adapter (the first found) with one queue;  there are no per-adapter queues.
+Jobs can't use "-" for stdin/stdout (stdout is where their output events come from), and farm jobs
+are refused since they open every adapter, the daemon's own included.
+*/
+
+#if defined(_WIN32)
+
+bool daemon_run(const char *socketPath, daemonRunFunc run) {
+    printf("Daemon mode is not supported on Windows.\n");
+    return false;
+}
+
+#else
+
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include "device.h"
+#include "spi.h"
+#include "os.h"
+
+enum {
+    MAXLINE=0x10000,
+    MAXARGS=16,
+    RECONNECT_MS=2000,
+};
+
+struct client {
+    int fd;
+    bool closed;
+    std::mutex lock;        //one event at a time
+};
+
+struct job {
+    std::shared_ptr<client> owner;
+    std::string id;
+    std::vector<std::string> args;
+    int priority;
+    uint32_t seq;
+};
+
+//cached on the worker thread, read by client threads
+struct slotInfo {
+    int slot;
+    int sides;
+    std::string name;
+};
+
+static daemonRunFunc runFunc;
+static std::mutex queueLock;
+static std::condition_variable queueSignal;
+static std::vector<job> queue;
+static uint32_t nextSeq;
+static std::atomic<bool> quit;
+static std::string socketName;
+
+static std::mutex clientsLock;
+static std::vector<std::shared_ptr<client>> clients;
+
+static std::mutex cacheLock;
+static bool connected;
+static int cacheFlashSize, cacheFwVersion;
+static std::vector<slotInfo> cacheSlots;
+
+//console output of the running job goes to its owner
+static std::mutex outputLock;
+static std::condition_variable outputSignal;
+static std::shared_ptr<client> outputOwner;
+static std::string outputId;
+static bool outputDrained;
+static int outputPipe=-1;
+
+//---- JSON
+
+static std::string quote(const std::string &s) {
+    std::string out="\"";
+    for(size_t i=0; i<s.size(); i++) {
+        uint8_t c=s[i];
+        if(c=='"' || c=='\\') {
+            out+='\\';
+            out+=c;
+        } else if(c=='\n') {
+            out+="\\n";
+        } else if(c<0x20) {
+            char esc[8];
+            sprintf(esc, "\\u%04x", c);
+            out+=esc;
+        } else {
+            out+=c;
+        }
+    }
+    return out+"\"";
+}
+
+static void skipSpace(const char *&p) {
+    while(*p==' ' || *p=='\t' || *p=='\r' || *p=='\n')
+        p++;
+}
+
+static bool parseString(const char *&p, std::string &out) {
+    out.clear();
+    if(*p++!='"')
+        return false;
+    for(; *p && *p!='"'; p++) {
+        if(*p!='\\') {
+            out+=*p;
+            continue;
+        }
+        switch(*++p) {
+            case 'n': out+='\n'; break;
+            case 't': out+='\t'; break;
+            case 'r': out+='\r'; break;
+            case 'b': out+='\b'; break;
+            case 'f': out+='\f'; break;
+            case 'u': {         //names are passed through as bytes, keep it simple
+                unsigned int c=0;
+                if(sscanf(p+1, "%4x", &c)!=1)
+                    return false;
+                out+=c<0x80? (char)c: '?';
+                p+=4;
+                break;
+            }
+            case 0: return false;
+            default: out+=*p; break;
+        }
+    }
+    if(*p++!='"')
+        return false;
+    return true;
+}
+
+//strings and numbers come back as text, true/false/null as the word
+static bool parseScalar(const char *&p, std::string &out) {
+    if(*p=='"')
+        return parseString(p, out);
+    out.clear();
+    while(*p && !strchr(",]} \t\r\n", *p))
+        out+=*p++;
+    return !out.empty();
+}
+
+//Flat object:  string keys, scalar or array-of-scalar values
+static bool parseRequest(const char *p, job &req, std::string &cmd, std::string &error) {
+    std::string key, value;
+
+    req.priority=0;
+    skipSpace(p);
+    if(*p++!='{') {
+        error="expected an object";
+        return false;
+    }
+    skipSpace(p);
+    while(*p!='}') {
+        if(!parseString(p, key)) {
+            error="bad key";
+            return false;
+        }
+        skipSpace(p);
+        if(*p++!=':') {
+            error="expected ':'";
+            return false;
+        }
+        skipSpace(p);
+        if(*p=='[') {
+            p++;
+            skipSpace(p);
+            while(*p!=']') {
+                if(!parseScalar(p, value)) {
+                    error="bad array";
+                    return false;
+                }
+                if(key=="args")
+                    req.args.push_back(value);
+                skipSpace(p);
+                if(*p==',')
+                    p++;
+                else if(*p!=']') {
+                    error="bad array";
+                    return false;
+                }
+                skipSpace(p);
+            }
+            p++;
+        } else {
+            if(!parseScalar(p, value)) {
+                error="bad value for "+key;
+                return false;
+            }
+            if(key=="id")
+                req.id=value;
+            else if(key=="cmd")
+                cmd=value;
+            else if(key=="priority")
+                req.priority=atoi(value.c_str());
+        }
+        skipSpace(p);
+        if(*p==',')
+            p++;
+        else if(*p!='}') {
+            error="expected ',' or '}'";
+            return false;
+        }
+        skipSpace(p);
+    }
+    if(cmd.empty()) {
+        error="missing cmd";
+        return false;
+    }
+    return true;
+}
+
+//---- events
+
+static void sendLine(const std::shared_ptr<client> &c, const std::string &line) {
+    std::lock_guard<std::mutex> lock(c->lock);
+    if(c->closed)
+        return;
+    std::string buf=line+"\n";
+    for(size_t sent=0; sent<buf.size(); ) {
+        ssize_t n=write(c->fd, buf.data()+sent, buf.size()-sent);
+        if(n<0 && errno==EINTR)
+            continue;
+        if(n<=0) {          //client went away, the job keeps running
+            c->closed=true;
+            return;
+        }
+        sent+=n;
+    }
+}
+
+static void sendEvent(const std::shared_ptr<client> &c, const std::string &id, const char *event, const std::string &extra="") {
+    std::string line="{";
+    if(!id.empty())
+        line+="\"id\":"+quote(id)+",";
+    line+="\"event\":"+quote(event)+extra+"}";
+    sendLine(c, line);
+}
+
+static void broadcast(const char *event, const std::string &extra) {
+    std::lock_guard<std::mutex> lock(clientsLock);
+    for(size_t i=0; i<clients.size(); i++)
+        sendEvent(clients[i], "", event, extra);
+}
+
+static void onProgress(int done, int total) {
+    std::lock_guard<std::mutex> lock(outputLock);
+    if(outputOwner) {
+        char extra[64];
+        sprintf(extra, ",\"done\":%d,\"total\":%d", done, total);
+        sendEvent(outputOwner, outputId, "progress", extra);
+    }
+}
+
+//Reads everything printed to stdout and hands it out a line at a time.  A 0x01 byte marks the end
+//of a job's output.
+static void outputThread(int fd) {
+    std::string line;
+    char buf[4096];
+    ssize_t n;
+
+    while((n=read(fd, buf, sizeof(buf)))>0) {
+        std::lock_guard<std::mutex> lock(outputLock);
+        for(ssize_t i=0; i<n; i++) {
+            bool mark=(buf[i]==1);
+            if(!mark && buf[i]!='\n') {
+                if(line.size()<MAXLINE)
+                    line+=buf[i];
+                continue;
+            }
+            if(!line.empty() && outputOwner)
+                sendEvent(outputOwner, outputId, "output", ",\"text\":"+quote(line));
+            line.clear();
+            if(mark) {
+                outputDrained=true;
+                outputSignal.notify_all();
+            }
+        }
+    }
+}
+
+static void beginOutput(const job &j) {
+    std::lock_guard<std::mutex> lock(outputLock);
+    outputOwner=j.owner;
+    outputId=j.id;
+    outputDrained=false;
+}
+
+static void endOutput() {
+    static const char mark=1;
+    fflush(stdout);
+    if(write(outputPipe, &mark, 1)==1) {
+        std::unique_lock<std::mutex> lock(outputLock);
+        outputSignal.wait(lock, [] { return outputDrained; });
+    }
+    std::lock_guard<std::mutex> lock(outputLock);
+    outputOwner.reset();
+}
+
+//---- device
+
+static void refreshCache() {
+    std::vector<slotInfo> slots;
+    uint8_t buf[256];
+
+    for(int slot=1; slot<dev_slots; slot++) {
+        if(!spi_readFlash(slot*SLOTSIZE, buf, 256))
+            return;
+        if(buf[0]==0xff)
+            continue;
+        if(buf[0]!=0) {
+            buf[240]=0;
+            slotInfo info={slot, 1, (char*)buf};
+            slots.push_back(info);
+        } else if(!slots.empty() && slots.back().slot+slots.back().sides==slot) {
+            slots.back().sides++;
+        }
+    }
+    std::lock_guard<std::mutex> lock(cacheLock);
+    cacheSlots=slots;
+    cacheFlashSize=dev_flashSize;
+    cacheFwVersion=dev_fwVersion;
+}
+
+static void setConnected(bool state) {
+    {
+        std::lock_guard<std::mutex> lock(cacheLock);
+        if(connected==state)
+            return;
+        connected=state;
+        if(!state)
+            cacheSlots.clear();
+    }
+    fprintf(stderr, "daemon: device %s\n", state? "connected": "disconnected");
+    broadcast("device", state? ",\"connected\":true": ",\"connected\":false");
+}
+
+//A failed job may mean the adapter is gone.  Check, and drop the handle so it gets reopened.
+static void checkDevice() {
+    if(dev_flashSize && !spi_readFlashSize())
+        dev_close();
+    setConnected(dev_flashSize!=0);
+}
+
+static std::string statusJson() {
+    std::lock_guard<std::mutex> lock(cacheLock);
+    char num[96];
+    sprintf(num, ",\"connected\":%s,\"firmware\":%d,\"flashSize\":%d", connected? "true": "false", cacheFwVersion, cacheFlashSize);
+    std::string s=num;
+    s+=",\"slots\":[";
+    for(size_t i=0; i<cacheSlots.size(); i++) {
+        sprintf(num, "%s{\"slot\":%d,\"sides\":%d,\"name\":", i? ",": "", cacheSlots[i].slot, cacheSlots[i].sides);
+        s+=num+quote(cacheSlots[i].name)+"}";
+    }
+    return s+"]";
+}
+
+//---- worker
+
+//Can the job change what's in flash (so the cached layout needs reading again)?
+static bool changesFlash(const job &j) {
+    static const char *const writers[]={
+        "-f", "-W", "-L", "-e", "-S", "-d", "-Z", "-U",
+        "flash", "write", "loader", "erase", "sync", "defrag", "restore",
+    };
+    if(j.args.empty())
+        return false;
+    for(size_t i=1; i<j.args.size(); i++) {
+        if(j.args[i]=="-n")     //dry run
+            return false;
+    }
+    for(size_t i=0; i<sizeof(writers)/sizeof(writers[0]); i++) {
+        if(j.args[0]==writers[i])
+            return true;
+    }
+    return false;
+}
+
+static void runJob(job &j) {
+    char *argv[MAXARGS];
+    int argc=0;
+
+    for(size_t i=0; i<j.args.size() && argc<MAXARGS; i++)
+        argv[argc++]=(char*)j.args[i].c_str();
+
+    sendEvent(j.owner, j.id, "started");
+    fprintf(stderr, "daemon: job %s: %s\n", j.id.c_str(), argv[0]);
+    beginOutput(j);
+    uint32_t start=getTicks();
+    bool ok=runFunc(argc, argv);
+    uint32_t ms=getTicks()-start;
+    endOutput();
+    if(!ok)
+        checkDevice();
+    else
+        setConnected(dev_flashSize!=0);
+    if(dev_flashSize && changesFlash(j))
+        refreshCache();
+
+    char extra[64];
+    sprintf(extra, ",\"ok\":%s,\"ms\":%u", ok? "true": "false", ms);
+    sendEvent(j.owner, j.id, "done", extra);
+}
+
+static void worker() {
+    setConnected(dev_open());
+    if(dev_flashSize)
+        refreshCache();
+    while(!quit) {
+        job j;
+        {
+            std::unique_lock<std::mutex> lock(queueLock);
+            if(queue.empty()) {
+                queueSignal.wait_for(lock, std::chrono::milliseconds(RECONNECT_MS));
+                if(queue.empty()) {
+                    lock.unlock();
+                    if(!dev_flashSize && !quit) {   //try to get it back while idle
+                        if(dev_open())
+                            refreshCache();
+                        setConnected(dev_flashSize!=0);
+                    }
+                    continue;
+                }
+            }
+            size_t best=0;
+            for(size_t i=1; i<queue.size(); i++) {
+                if(queue[i].priority>queue[best].priority || (queue[i].priority==queue[best].priority && queue[i].seq<queue[best].seq))
+                    best=i;
+            }
+            j=queue[best];
+            queue.erase(queue.begin()+best);
+        }
+        runJob(j);
+    }
+    std::lock_guard<std::mutex> lock(queueLock);
+    for(size_t i=0; i<queue.size(); i++)
+        sendEvent(queue[i].owner, queue[i].id, "done", ",\"ok\":false,\"cancelled\":true");
+    queue.clear();
+}
+
+//---- clients
+
+static void wakeListener();
+
+static bool hasStdio(const std::vector<std::string> &args) {
+    for(size_t i=0; i<args.size(); i++) {
+        if(args[i]=="-")
+            return true;
+    }
+    return false;
+}
+
+static void handleRequest(const std::shared_ptr<client> &c, const char *line) {
+    job j;
+    std::string cmd, error;
+
+    if(!parseRequest(line, j, cmd, error)) {
+        sendEvent(c, j.id, "error", ",\"message\":"+quote(error));
+        return;
+    }
+    if(cmd=="status") {
+        sendEvent(c, j.id, "status", statusJson());
+    } else if(cmd=="queue") {
+        std::lock_guard<std::mutex> lock(queueLock);
+        std::string ids=",\"jobs\":[";
+        for(size_t i=0; i<queue.size(); i++)
+            ids+=(i? ",": "")+quote(queue[i].id);
+        sendEvent(c, j.id, "queue", ids+"]");
+    } else if(cmd=="cancel") {
+        int cancelled=0;
+        {
+            std::lock_guard<std::mutex> lock(queueLock);
+            for(size_t i=0; i<queue.size(); ) {
+                bool match=false;
+                for(size_t k=0; k<j.args.size(); k++)
+                    match|=(queue[i].id==j.args[k]);
+                if(match) {
+                    sendEvent(queue[i].owner, queue[i].id, "done", ",\"ok\":false,\"cancelled\":true");
+                    queue.erase(queue.begin()+i);
+                    cancelled++;
+                } else {
+                    i++;
+                }
+            }
+        }
+        char extra[32];
+        sprintf(extra, ",\"cancelled\":%d", cancelled);
+        sendEvent(c, j.id, "cancel", extra);
+    } else if(cmd=="shutdown") {
+        sendEvent(c, j.id, "shutdown");
+        quit=true;
+        queueSignal.notify_all();
+        wakeListener();
+    } else if(j.args.size()>=MAXARGS) {
+        sendEvent(c, j.id, "error", ",\"message\":\"too many args\"");
+    } else if(cmd=="b" || cmd=="-b" || cmd=="script") {
+        sendEvent(c, j.id, "error", ",\"message\":\"scripts aren't jobs, send each command\"");
+    } else if(cmd=="-M" || cmd=="farm") {
+        sendEvent(c, j.id, "error", ",\"message\":\"farm opens every adapter, run it without the daemon\"");
+    } else if(hasStdio(j.args)) {
+        sendEvent(c, j.id, "error", ",\"message\":\"'-' (stdin/stdout) isn't available to jobs, use a file\"");
+    } else {
+        j.owner=c;
+        j.args.insert(j.args.begin(), cmd);
+        std::lock_guard<std::mutex> lock(queueLock);
+        j.seq=nextSeq++;
+        int position=0;
+        for(size_t i=0; i<queue.size(); i++)
+            position+=(queue[i].priority>=j.priority);
+        queue.push_back(j);
+        char extra[32];
+        sprintf(extra, ",\"position\":%d", position);
+        sendEvent(c, j.id, "queued", extra);
+        queueSignal.notify_one();
+    }
+}
+
+static void clientThread(std::shared_ptr<client> c) {
+    std::string line;
+    char buf[4096];
+    ssize_t n;
+
+    while(!quit && (n=read(c->fd, buf, sizeof(buf)))>0) {
+        for(ssize_t i=0; i<n; i++) {
+            if(buf[i]!='\n') {
+                line+=buf[i];
+                continue;
+            }
+            if(line.find_first_not_of(" \t\r")!=std::string::npos)
+                handleRequest(c, line.c_str());
+            line.clear();
+        }
+        if(line.size()>MAXLINE) {
+            sendEvent(c, "", "error", ",\"message\":\"line too long\"");
+            break;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(c->lock);
+        c->closed=true;
+        close(c->fd);
+    }
+    std::lock_guard<std::mutex> lock(clientsLock);
+    for(size_t i=0; i<clients.size(); i++) {
+        if(clients[i]==c) {
+            clients.erase(clients.begin()+i);
+            break;
+        }
+    }
+}
+
+static void onSignal(int) {
+    quit=true;
+}
+
+//accept() only returns for a connection
+static void wakeListener() {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family=AF_UNIX;
+    strcpy(addr.sun_path, socketName.c_str());
+    int fd=socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd>=0) {
+        connect(fd, (sockaddr*)&addr, sizeof(addr));
+        close(fd);
+    }
+}
+
+//$XDG_RUNTIME_DIR/fdsemu.sock, or /tmp/fdsemu-<uid>.sock
+static std::string defaultPath() {
+    char path[256];
+    const char *dir=getenv("XDG_RUNTIME_DIR");
+    if(dir && *dir)
+        snprintf(path, sizeof(path), "%s/fdsemu.sock", dir);
+    else
+        snprintf(path, sizeof(path), "/tmp/fdsemu-%u.sock", (unsigned)getuid());
+    return path;
+}
+
+static int listenOn(const char *path) {
+    sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family=AF_UNIX;
+    if(strlen(path)>=sizeof(addr.sun_path)) {
+        printf("Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    //a leftover socket is removed, a live one means another daemon
+    fd=socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd>=0 && connect(fd, (sockaddr*)&addr, sizeof(addr))==0) {
+        printf("A daemon is already running on %s\n", path);
+        close(fd);
+        return -1;
+    }
+    if(fd>=0)
+        close(fd);
+    unlink(path);
+
+    fd=socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t mask=umask(0077);
+    bool ok=(fd>=0 && bind(fd, (sockaddr*)&addr, sizeof(addr))==0);
+    umask(mask);
+    if(!ok || listen(fd, 8)) {
+        printf("Can't listen on %s\n", path);
+        if(fd>=0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool daemon_run(const char *socketPath, daemonRunFunc run) {
+    const std::string &path=socketName=(socketPath? socketPath: defaultPath());
+    int fds[2];
+    sigset_t mask, oldMask;
+
+    runFunc=run;
+    int listenFd=listenOn(path.c_str());
+    if(listenFd<0)
+        return false;
+    printf("Listening on %s\n", path.c_str());
+    if(pipe(fds)) {
+        close(listenFd);
+        return false;
+    }
+
+    //signals go to this thread only, no SA_RESTART so accept() returns
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler=onSignal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, &oldMask);
+
+    //from here on stdout belongs to whichever job is running, the daemon's own log is stderr
+    fflush(stdout);
+    int savedStdout=dup(STDOUT_FILENO);
+    dup2(fds[1], STDOUT_FILENO);
+    outputPipe=fds[1];
+    std::thread(outputThread, fds[0]).detach();
+    os_setProgress(onProgress);
+
+    std::thread work(worker);
+    pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+    while(!quit) {
+        int fd=accept(listenFd, NULL, NULL);
+        if(fd<0) {
+            if(errno==EINTR || errno==ECONNABORTED)
+                continue;
+            break;
+        }
+        std::shared_ptr<client> c=std::make_shared<client>();
+        c->fd=fd;
+        c->closed=false;
+        {
+            std::lock_guard<std::mutex> lock(clientsLock);
+            clients.push_back(c);
+        }
+        std::thread(clientThread, c).detach();
+    }
+    quit=true;
+    queueSignal.notify_all();
+    work.join();                    //finishes the running job
+    os_setProgress(NULL);
+    fflush(stdout);
+    dup2(savedStdout, STDOUT_FILENO);
+    close(savedStdout);
+    close(listenFd);
+    unlink(path.c_str());
+    fprintf(stderr, "daemon: stopped\n");
+    return true;
+}
+
+#endif
@@ -0,0 +1,6 @@
+#pragma once
+
+//Runs a command line (argv[0] = command), same as the console app
+typedef bool (*daemonRunFunc)(int argc, char **argv);
+
+bool daemon_run(const char *socketPath, daemonRunFunc run);
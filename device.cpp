@@ -2,9 +2,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <memory.h>
+#include <string.h>
+#include <mutex>
+#include <atomic>
 #include "hidapi/hidapi.h"
 #include "device.h"
 #include "spi.h"
+#include "os.h"
+#include "report.h"
 
 
 //#define VID 0x16d0
@@ -17,34 +22,64 @@
 
 
 
-int dev_flashSize;
-int dev_slots;
-uint16_t dev_fwVersion;
+thread_local int dev_flashSize;
+thread_local int dev_slots;
+thread_local uint16_t dev_fwVersion;
+thread_local char dev_serial[64];
 
-static hid_device *handle=NULL;
-static uint8_t hidbuf[256];
+//Everything needed to talk to one adapter.  Each thread opens its own, so one process can drive
+//several;  helper threads (disk capture) attach to the one of the thread that started them.
+struct devContext {
+    hid_device *handle;
+    uint8_t hidbuf[REPORT_MAX+4];
+    uint8_t readSequence;
+    devLimits limits;
+    devStats stats;
+};
 
+static thread_local devContext ownContext;
+static thread_local devContext *dev=&ownContext;
+static std::mutex openLock;     //enumerate/open aren't thread safe in every hidapi backend
+static const devLimits defaultLimits={ SPI_WRITEMAX, SPI_READMAX, DISK_READMAX, DISK_WRITEMAX };
 
-bool dev_open() {
-    struct hid_device_info *devs, *cur_dev;
-	 char name[256];
+bool dev_verbose;
+enum { DEFAULT_TIMEOUT_MS=1000 };
+devPolicy dev_policy={ DEFAULT_TIMEOUT_MS, 3, 50 };
 
-    dev_close();
-    devs = hid_enumerate(VID, PID);
-    cur_dev = devs;
-    while (cur_dev) {
-//		 if (cur_dev->vendor_id == VID && cur_dev->product_id == PID && cur_dev->product_string && wcscmp(DEV_NAME, cur_dev->product_string) == 0)
-		 if (cur_dev->vendor_id == VID && cur_dev->product_id == PID)
-				 break;
-        cur_dev = cur_dev->next;
-    }
-	 if (cur_dev) {
-		 wcstombs(name, cur_dev->product_string, 256);
-//		 printf("opening device '%s':  %s\n", name,cur_dev->path);
-		 handle = hid_open_path(cur_dev->path);
-	 }
-    if(handle) {
+//Transfer sizes for the open adapter, today's constants for anything the descriptor doesn't give
+static void readLimits() {
+    uint8_t desc[4096];
+    int size;
+
+    dev->limits=defaultLimits;
+    size=hid_get_report_descriptor(dev->handle, desc, sizeof(desc));
+    if(size>0)
+        report_limits(desc, size, &dev->limits);
+    if(dev_verbose)
+        printf("Report payloads%s:  SPI write %d, SPI read %d, disk read %d, disk write %d\n", size>0? "": " (no descriptor, defaults)",
+               dev->limits.spiWrite, dev->limits.spiRead, dev->limits.diskRead, dev->limits.diskWrite);
+}
+
+//Per-open state:  transfer sizes, the policy's timeout, fresh retry counts
+static void setupOpened() {
+    static std::atomic<bool> warned;
+    //only the libusb backend has a timeout to set, the others use the system's
+    if(hid_set_transfer_timeout(dev->handle, dev_policy.timeoutMs)<0 && dev_policy.timeoutMs!=DEFAULT_TIMEOUT_MS && !warned.exchange(true))
+        printf("--timeout isn't supported by this HID backend, the system's timeout applies\n");
+    memset(&dev->stats, 0, sizeof(dev->stats));
+    readLimits();
+}
+
+//Open the adapter described by cur_dev on this thread
+static bool openInfo(struct hid_device_info *cur_dev) {
+    dev->handle = hid_open_path(cur_dev->path);
+    if(dev->handle) {
+        setupOpened();
         dev_fwVersion = cur_dev->release_number;
+        dev_serial[0] = 0;
+        if (cur_dev->serial_number)
+            wcstombs(dev_serial, cur_dev->serial_number, sizeof(dev_serial)-1);
+        dev_serial[sizeof(dev_serial)-1] = 0;
         dev_flashSize = spi_readFlashSize();
         dev_slots = dev_flashSize/SLOTSIZE;
         wprintf(L"Opened %s (%04X:%04X:%04X:%s:%dM)\n", cur_dev->product_string, cur_dev->vendor_id, cur_dev->product_id, cur_dev->release_number, cur_dev->serial_number, dev_flashSize/0x20000);
@@ -52,79 +87,361 @@ bool dev_open() {
             printf("Flash read failed.\n");
             dev_close();
         }
-    } else {
-//		 wcstombs(name, hid_error(cur_dev), 256);
-		 printf("Device not found\n");
-	 }
+    }
+    return !!dev->handle;
+}
+
+/*
+Last adapter opened, so the next start can skip enumeration (which opens every HID device on the
+bus and reads its strings) and the flash ID.  The cached path is only trusted if the device there
+reports the same serial number;  anything else falls back to a full scan, which rewrites the cache.
+The firmware version isn't cached, it's read from the opened device since an update changes it.
+*/
+struct devCache {
+    char magic[4];
+    char path[256];
+    char serial[64];
+    int flashSize;
+};
+
+static bool cachePath(char *path, size_t size) {
+    return os_dataPath("device.cache", path, size);
+}
+
+static bool loadCache(devCache *c) {
+    char path[1024];
+    if(!cachePath(path, sizeof(path)))
+        return false;
+    FILE *f=fopen(path, "rb");
+    if(!f)
+        return false;
+    bool ok=fread(c, sizeof(*c), 1, f)==1;
+    fclose(f);
+    return ok && !memcmp(c->magic, "FDC2", 4) && c->serial[0] && c->flashSize>0;
+}
+
+//Remember the open adapter (only rewritten when something changed)
+static void saveCache(const char *devPath) {
+    devCache c, old;
+    char path[1024], tmp[1040];
+
+    if(!dev_serial[0] || !cachePath(path, sizeof(path)))
+        return;
+    memset(&c, 0, sizeof(c));
+    memcpy(c.magic, "FDC2", 4);
+    snprintf(c.path, sizeof(c.path), "%s", devPath);
+    snprintf(c.serial, sizeof(c.serial), "%s", dev_serial);
+    c.flashSize=dev_flashSize;
+    if(loadCache(&old) && !memcmp(&c, &old, sizeof(c)))
+        return;
+    sprintf(tmp, "%s.tmp", path);
+    FILE *f=fopen(tmp, "wb");
+    if(!f)
+        return;
+    bool ok=fwrite(&c, sizeof(c), 1, f)==1;
+    ok&=!fclose(f);
+    remove(path);               //rename won't replace on Windows
+    if(ok)
+        rename(tmp, path);
+}
+
+//Open the cached path directly.  Costs one string descriptor read to check it's the same adapter,
+//and the device descriptor for the firmware version.
+static bool openCached() {
+    devCache c;
+    wchar_t serial[64];
+    char found[64]="";
+    int version;
+
+    if(!loadCache(&c))
+        return false;
+    std::lock_guard<std::mutex> lock(openLock);
+    dev->handle = hid_open_path(c.path);
+    if(!dev->handle)
+        return false;
+    if(hid_get_serial_number_string(dev->handle, serial, 64) >= 0) {
+        serial[63] = 0;
+        wcstombs(found, serial, sizeof(found)-1);
+    }
+    version = hid_get_release_number(dev->handle);
+    if(strcmp(found, c.serial) || version<0) {      //something else has that path now
+        dev_close();
+        return false;
+    }
+    setupOpened();
+    dev_fwVersion = version;
+    snprintf(dev_serial, sizeof(dev_serial), "%s", c.serial);
+    dev_flashSize = c.flashSize;
+    dev_slots = dev_flashSize/SLOTSIZE;
+    printf("Opened %04X:%04X:%04X:%s:%dM (cached)\n", VID, PID, dev_fwVersion, dev_serial, dev_flashSize/0x20000);
+    return true;
+}
+
+//Open the first adapter found by enumeration
+static bool openScan() {
+    struct hid_device_info *devs, *cur_dev;
+    char path[256] = "";
+
+    {
+        std::lock_guard<std::mutex> lock(openLock);
+        devs = hid_enumerate(VID, PID);
+        cur_dev = devs;
+        while (cur_dev) {
+//		     if (cur_dev->vendor_id == VID && cur_dev->product_id == PID && cur_dev->product_string && wcscmp(DEV_NAME, cur_dev->product_string) == 0)
+            if (cur_dev->vendor_id == VID && cur_dev->product_id == PID)
+                break;
+            cur_dev = cur_dev->next;
+        }
+        if (cur_dev && openInfo(cur_dev))
+            snprintf(path, sizeof(path), "%s", cur_dev->path);
+        hid_free_enumeration(devs);
+    }
+    if (dev->handle)
+        saveCache(path);
+    return !!dev->handle;
+}
+
+bool dev_open() {
+    dev_close();
+    if (openCached() || openScan())
+        return true;
+    printf("Device not found\n");
+    return false;
+}
+
+//Open a specific adapter (path from dev_enumerate) on this thread
+bool dev_openPath(const char *path) {
+    struct hid_device_info *devs, *cur_dev;
+
+    dev_close();
+    std::lock_guard<std::mutex> lock(openLock);
+    devs = hid_enumerate(VID, PID);
+    for (cur_dev = devs; cur_dev; cur_dev = cur_dev->next) {
+        if (!strcmp(cur_dev->path, path))
+            break;
+    }
+    if (!cur_dev || !openInfo(cur_dev))
+        printf("Device %s not found\n", path);
     hid_free_enumeration(devs);
-    return !!handle;
+    return !!dev->handle;
+}
+
+//Every attached adapter, returns how many (up to max)
+int dev_enumerate(devInfo *list, int max) {
+    struct hid_device_info *devs, *cur_dev;
+    int count = 0;
+
+    std::lock_guard<std::mutex> lock(openLock);
+    devs = hid_enumerate(VID, PID);
+    for (cur_dev = devs; cur_dev && count<max; cur_dev = cur_dev->next) {
+        if (cur_dev->vendor_id != VID || cur_dev->product_id != PID)
+            continue;
+        snprintf(list[count].path, sizeof(list[count].path), "%s", cur_dev->path);
+        list[count].serial[0] = 0;
+        if (cur_dev->serial_number)
+            wcstombs(list[count].serial, cur_dev->serial_number, sizeof(list[count].serial)-1);
+        list[count].serial[sizeof(list[count].serial)-1] = 0;
+        count++;
+    }
+    hid_free_enumeration(devs);
+    return count;
+}
+
+//Is an adapter (that one, if serial isn't empty) attached right now?
+static bool isPresent(const char *serial, char *path, size_t pathSize) {
+    struct hid_device_info *devs, *cur_dev;
+    bool found = false;
+
+    std::lock_guard<std::mutex> lock(openLock);
+    devs = hid_enumerate(VID, PID);
+    for (cur_dev = devs; cur_dev && !found; cur_dev = cur_dev->next) {
+        char curSerial[64] = "";
+        if (cur_dev->vendor_id != VID || cur_dev->product_id != PID)
+            continue;
+        if (cur_dev->serial_number)
+            wcstombs(curSerial, cur_dev->serial_number, sizeof(curSerial)-1);
+        curSerial[sizeof(curSerial)-1] = 0;
+        if (serial[0] && strcmp(serial, curSerial))
+            continue;
+        if (path)
+            snprintf(path, pathSize, "%s", cur_dev->path);
+        found = true;
+    }
+    hid_free_enumeration(devs);
+    return found;
+}
+
+//Poll enumeration until an adapter is (present) or isn't (!present) attached.  timeoutMs=0 waits forever.
+static bool waitFor(const char *serial, bool present, uint32_t timeoutMs, char *path, size_t pathSize) {
+    enum { POLL_MS=50 };
+    uint32_t start = getTicks();
+
+    for (;;) {
+        if (isPresent(serial, path, pathSize) == present)
+            return true;
+        if (timeoutMs && getTicks() - start >= timeoutMs)
+            return false;
+        sleep_ms(POLL_MS);
+    }
+}
+
+bool dev_waitFor(bool present, uint32_t timeoutMs) {
+    return waitFor("", present, timeoutMs, NULL, 0);
+}
+
+//For after a command that resets the adapter:  wait for it to drop off the bus and come back, then
+//open it again (the same one, by serial number).  No fixed delay, so it's as quick as the adapter.
+//newBuild = the reset installs different firmware:  if the adapter was never seen leaving, the one
+//found may not have reset yet, so it only counts once it reports another version.
+bool dev_reopen(uint32_t timeoutMs, bool newBuild) {
+    enum { GONE_MS=3000, RETRY_MS=100 };
+    char serial[64], path[256];
+    uint32_t start = getTicks();
+    uint16_t oldVersion = dev_fwVersion;
+    bool stale = false;
+
+    snprintf(serial, sizeof(serial), "%s", dev_serial);
+    dev_close();
+    //a quick reset can come and go between polls, so not seeing it leave isn't an error
+    bool left = waitFor(serial, false, GONE_MS, NULL, 0);
+    while (getTicks() - start < timeoutMs) {
+        if (!waitFor(serial, true, timeoutMs - (getTicks() - start), path, sizeof(path)))
+            break;
+        if (dev_openPath(path)) {
+            stale = newBuild && !left && dev_fwVersion == oldVersion;
+            if (!stale) {
+                saveCache(path);        //the path can change across a reset
+                printf("Device back after %u ms\n", getTicks() - start);
+                return true;
+            }
+            dev_close();        //still the adapter from before the reset
+        }
+        sleep_ms(RETRY_MS);     //enumerated but not answering yet
+    }
+    if (stale)
+        printf("Device still running build %d after %u ms\n", oldVersion, timeoutMs);
+    else
+        printf("Device didn't come back within %u ms\n", timeoutMs);
+    return false;
+}
+
+const devLimits *dev_limits() {
+    return dev->handle? &dev->limits: &defaultLimits;
+}
+
+devContext *dev_current() {
+    return dev;
+}
+
+//Use another thread's adapter from this thread.  Don't talk to it from both at once.
+void dev_attach(devContext *ctx) {
+    dev = ctx;
 }
 
 void dev_close() {
 	dev_flashSize = 0;
 	dev_slots = 0;
-	if (handle) {
-		hid_close(handle);
+	if (dev->handle) {
+		hid_close(dev->handle);
 	}
-	handle = NULL;
+	dev->handle = NULL;
+}
+
+//For callers that know how to redo what failed:  counts the retry and waits out the backoff, or
+//counts a failure once the policy's retries are used up.
+bool dev_retry(const char *what, int attempt) {
+    if(attempt>=dev_policy.retries) {
+        dev->stats.failures++;
+        printf("%s failed after %d attempt(s)\n", what, attempt+1);
+        return false;
+    }
+    dev->stats.retries++;
+    printf("%s failed, retrying (%d of %d)\n", what, attempt+1, dev_policy.retries);
+    sleep_ms(dev_policy.backoffMs<<(attempt<10? attempt: 10));
+    return true;
+}
+
+const devStats *dev_stats() {
+    return &dev->stats;
 }
 
 void dev_printLastError() {
-    const wchar_t *err=hid_error(handle);
+    const wchar_t *err=hid_error(dev->handle);
     if(err)
         printf("hidapi: %ls\n", err);
 }
 
 bool dev_reset() {
-    hidbuf[0]=ID_RESET;
-    hid_send_feature_report(handle, hidbuf, 2);    //reset will cause an error, ignore it
+    dev->hidbuf[0]=ID_RESET;
+    hid_send_feature_report(dev->handle, dev->hidbuf, 2);    //reset will cause an error, ignore it
     return true;
 }
 
 bool dev_writeStart() {
-    hidbuf[0]=ID_DISK_WRITE_START;
-    return hid_send_feature_report(handle, hidbuf, 2) >= 0;
+    dev->hidbuf[0]=ID_DISK_WRITE_START;
+    return hid_send_feature_report(dev->handle, dev->hidbuf, 2) >= 0;
+}
+
+//Only reads the drive lines, so it's safe to repeat
+int dev_readIO() {
+    for(int attempt=0; ; attempt++) {
+        dev->hidbuf[0]=ID_READ_IO;
+        if(hid_get_feature_report(dev->handle, dev->hidbuf, 2) >= 2)
+            return dev->hidbuf[1];
+        if(!dev_retry("I/O status read", attempt))
+            return -1;
+    }
 }
 
 bool dev_updateFirmware() {
-    hidbuf[0]=ID_UPDATEFIRMWARE;
-    hid_send_feature_report(handle, hidbuf, 2);    //reset after update will cause an error, ignore it
+    dev->hidbuf[0]=ID_UPDATEFIRMWARE;
+    hid_send_feature_report(dev->handle, dev->hidbuf, 2);    //reset after update will cause an error, ignore it
     return true;
 }
 
 void dev_selfTest() {
-    hidbuf[0]=ID_SELFTEST;
-    hid_send_feature_report(handle, hidbuf, 2);
+    dev->hidbuf[0]=ID_SELFTEST;
+    hid_send_feature_report(dev->handle, dev->hidbuf, 2);
 }
 
 bool dev_spiRead(uint8_t *buf, int size, bool holdCS) {
 	int ret;
 
-    if(size>SPI_READMAX)
+    if(size>dev->limits.spiRead)
         { printf("Read too big.\n"); return false; }
-    hidbuf[0]=holdCS? ID_SPI_READ: ID_SPI_READ_STOP;
-	 ret = hid_get_feature_report(handle, hidbuf, 64);
+    dev->hidbuf[0]=holdCS? ID_SPI_READ: ID_SPI_READ_STOP;
+	 ret = hid_get_feature_report(dev->handle, dev->hidbuf, dev->limits.spiRead+1);
 //	 printf("hid_get_feature_report returned %d\n", ret);
     if(ret < 0)
         return false;
-    memcpy(buf, hidbuf+1, size);
+    memcpy(buf, dev->hidbuf+1, size);
+    return true;
+}
+
+bool dev_sramRead(uint8_t *buf, int size, bool holdCS) {
+    if(size>dev->limits.spiRead)
+        { printf("Read too big.\n"); return false; }
+    dev->hidbuf[0]=holdCS? ID_SRAM_READ: ID_SRAM_READ_STOP;
+    if(hid_get_feature_report(dev->handle, dev->hidbuf, dev->limits.spiRead+1) < 0)
+        return false;
+    memcpy(buf, dev->hidbuf+1, size);
     return true;
 }
 
 bool dev_spiWrite(uint8_t *buf, int size, bool initCS, bool holdCS) {
 	int ret;
 
-	if (size>SPI_WRITEMAX)
+	if (size>dev->limits.spiWrite)
 	{
 		printf("Write too big.\n"); return false;
 	}
-	hidbuf[0] = ID_SPI_WRITE;
-	hidbuf[1] = size;
-	hidbuf[2] = initCS,
-		hidbuf[3] = holdCS;
+	dev->hidbuf[0] = ID_SPI_WRITE;
+	dev->hidbuf[1] = size;
+	dev->hidbuf[2] = initCS,
+		dev->hidbuf[3] = holdCS;
 	if (size)
-		memcpy(hidbuf + 4, buf, size);
-	ret = hid_send_feature_report(handle, hidbuf, 4 + size);
+		memcpy(dev->hidbuf + 4, buf, size);
+	ret = hid_send_feature_report(dev->handle, dev->hidbuf, 4 + size);
 	//	 printf("hid_send_feature_report returned %d\n", ret);
 	return ret >= 0;
 }
@@ -132,55 +449,60 @@ bool dev_spiWrite(uint8_t *buf, int size, bool initCS, bool holdCS) {
 bool dev_sramWrite(uint8_t *buf, int size, bool initCS, bool holdCS) {
 	int ret;
 
-	if (size>SPI_WRITEMAX)
+	if (size>dev->limits.spiWrite)
 	{
 		printf("Write too big.\n"); return false;
 	}
-	hidbuf[0] = ID_SRAM_WRITE;
-	hidbuf[1] = size;
-	hidbuf[2] = initCS,
-		hidbuf[3] = holdCS;
+	dev->hidbuf[0] = ID_SRAM_WRITE;
+	dev->hidbuf[1] = size;
+	dev->hidbuf[2] = initCS,
+		dev->hidbuf[3] = holdCS;
 	if (size)
-		memcpy(hidbuf + 4, buf, size);
-	ret = hid_send_feature_report(handle, hidbuf, 4 + size);
+		memcpy(dev->hidbuf + 4, buf, size);
+	ret = hid_send_feature_report(dev->handle, dev->hidbuf, 4 + size);
 	//	 printf("hid_send_feature_report returned %d\n", ret);
 	return ret >= 0;
 }
 
 //---------
 
-static uint8_t read_sequence;
-
 bool dev_readStart() {
-    hidbuf[0]=ID_DISK_READ_START;
-    read_sequence=1;
-    return hid_send_feature_report(handle, hidbuf, 2) >= 0;
+    dev->hidbuf[0]=ID_DISK_READ_START;
+    dev->readSequence=1;
+    return hid_send_feature_report(dev->handle, dev->hidbuf, 2) >= 0;
 }
 
-//Returns read size: <0 on error, <DISK_READMAX at end of disk.
+//Returns read size: <0 on error, <dev_limits()->diskRead at end of disk.
 int dev_readDisk(uint8_t *buf) {
-    hidbuf[0]=ID_DISK_READ;
-    int result=hid_get_feature_report(handle, hidbuf, DISK_READMAX+2);  // + reportID + sequence
+    uint8_t sequence;
+    int result=dev_readPacket(buf, &sequence);
+    if(result>0 && sequence!=dev->readSequence++)   //sequence out of order (data lost)
+        return -1;
+    return result;
+}
+
+//Same as dev_readDisk but hands back the adapter's sequence number instead of checking it.
+int dev_readPacket(uint8_t *buf, uint8_t *sequence) {
+    dev->hidbuf[0]=ID_DISK_READ;
+    int result=hid_get_feature_report(dev->handle, dev->hidbuf, dev->limits.diskRead+2);  // + reportID + sequence
     if(result<2) {
         return -1;      //timed out / bad read
-    } else if(result>2) {  //adapter will send incomplete/empty packets when it's out of data (end of disk)
-        memcpy(buf, hidbuf+2, result-2);
-        if(hidbuf[1]!=read_sequence++) {    //sequence out of order (data lost)
-            return -1;
-        } else {
-            return result-2;
-        }
+    }
+    *sequence=dev->hidbuf[1];
+    if(result>2) {  //adapter will send incomplete/empty packets when it's out of data (end of disk)
+        memcpy(buf, dev->hidbuf+2, result-2);
+        return result-2;
     } else {
         return 0;
     }
 }
 
 bool dev_writeDisk(uint8_t *buf, int size) {
-    if(size!=DISK_WRITEMAX)        //always max!
+    if(size!=dev->limits.diskWrite)        //always max!
         return false;
-    hidbuf[0]=ID_DISK_WRITE;
-    memcpy(hidbuf+1, buf, size);
-    return hid_write(handle, hidbuf, DISK_WRITEMAX+1) >= 0;     // WRITEMAX+reportID
+    dev->hidbuf[0]=ID_DISK_WRITE;
+    memcpy(dev->hidbuf+1, buf, size);
+    return hid_write(dev->handle, dev->hidbuf, size+1) >= 0;     // WRITEMAX+reportID
 }
 
 
@@ -189,12 +511,99 @@ bool dev_writeDisk(uint8_t *buf, int size) {
 bool dev_fwWrite(uint8_t *buf, int size, bool initCS, bool holdCS) {
 	int ret;
 
-	hidbuf[0] = ID_FIRMWARE_WRITE;
-	hidbuf[1] = size;
-	hidbuf[2] = initCS,
-	hidbuf[3] = holdCS;
+	if (size>SPI_LENGTHMAX)
+	{
+		printf("Write too big.\n"); return false;
+	}
+	dev->hidbuf[0] = ID_FIRMWARE_WRITE;
+	dev->hidbuf[1] = size;
+	dev->hidbuf[2] = initCS,
+	dev->hidbuf[3] = holdCS;
 	if (size)
-		memcpy(hidbuf + 4, buf, size);
-	ret = hid_send_feature_report(handle, hidbuf, 4 + size);
+		memcpy(dev->hidbuf + 4, buf, size);
+	ret = hid_send_feature_report(dev->handle, dev->hidbuf, 4 + size);
 	return ret >= 0;
 }
+
+//--------------------
+
+struct benchTimes {
+    uint64_t min, max, total;
+    int count;
+};
+
+static void benchAdd(benchTimes *t, uint64_t us) {
+    if(!t->count || us<t->min)
+        t->min=us;
+    if(us>t->max)
+        t->max=us;
+    t->total+=us;
+    t->count++;
+}
+
+static void benchPrint(const char *name, benchTimes *t) {
+    if(!t->count)
+        printf("%-24s failed\n", name);
+    else
+        printf("%-24s min %5u  avg %5u  max %5u us\n", name, (uint32_t)t->min, (uint32_t)(t->total/t->count), (uint32_t)t->max);
+}
+
+//Open time and report round trips, for comparing hidapi backends (make HIDAPI=hidraw on Linux).
+//Only harmless reports are used:  I/O status, an SPI read with nothing selected, an SRAM write.
+bool dev_benchmark(int count) {
+    struct hid_device_info *devs;
+    benchTimes enumTime={0}, openTime={0}, cachedTime={0}, getSmall={0}, getFull={0}, setFull={0};
+    uint8_t buf[REPORT_MAX];
+    char path[256]="";
+    uint64_t start;
+
+    for(int i=0; i<3; i++) {
+        start=getMicros();
+        {
+            std::lock_guard<std::mutex> lock(openLock);
+            devs=hid_enumerate(VID, PID);
+            if(devs)
+                snprintf(path, sizeof(path), "%s", devs->path);
+            hid_free_enumeration(devs);
+        }
+        benchAdd(&enumTime, getMicros()-start);
+
+        //startup to first transfer, both ways
+        dev_close();
+        start=getMicros();
+        if(!openScan() || dev_readIO()<0)
+            return false;
+        benchAdd(&openTime, getMicros()-start);
+        dev_close();
+        start=getMicros();
+        if(openCached() && dev_readIO()>=0)
+            benchAdd(&cachedTime, getMicros()-start);
+        else if(!dev_open())
+            return false;
+    }
+
+    memset(buf, 0, sizeof(buf));
+    for(int i=0; i<count; i++) {
+        start=getMicros();
+        if(dev_readIO()>=0)
+            benchAdd(&getSmall, getMicros()-start);
+        start=getMicros();
+        if(dev_spiRead(buf, dev->limits.spiRead, false))
+            benchAdd(&getFull, getMicros()-start);
+        start=getMicros();
+        if(dev_sramWrite(buf, dev->limits.spiWrite, false, false))
+            benchAdd(&setFull, getMicros()-start);
+    }
+
+    printf("Device %s, %d round trips each\n", path, count);
+    benchPrint("enumerate", &enumTime);
+    benchPrint("open, scan (+flash ID)", &openTime);
+    benchPrint("open, cached path", &cachedTime);
+    benchPrint("get feature, 2 bytes", &getSmall);
+    char name[64];
+    snprintf(name, sizeof(name), "get feature, %d bytes", dev->limits.spiRead+1);
+    benchPrint(name, &getFull);
+    snprintf(name, sizeof(name), "set feature, %d bytes", dev->limits.spiWrite+4);
+    benchPrint(name, &setFull);
+    return getSmall.count==count && getFull.count==count && setFull.count==count;
+}
@@ -1,55 +1,118 @@
-#pragma once
-#include "hidapi/hidapi.h"
-
-enum {
-    SPI_WRITEMAX=64-4,
-    SPI_READMAX=63,
-
-    DISK_READMAX=254,
-    DISK_WRITEMAX=255,
-
-    //HID reportIDs
-    ID_RESET=0xf0,
-    ID_UPDATEFIRMWARE=0xf1,
-	ID_SELFTEST = 0xf2,
-
-    ID_SPI_READ=1,
-    ID_SPI_READ_STOP,
-    ID_SPI_WRITE,
-	ID_SPI_VERIFY,
-	ID_SRAM_READ=5,
-	ID_SRAM_READ_STOP,
-	ID_SRAM_WRITE,
-
-    ID_READ_IO=0x10,
-    ID_DISK_READ_START,
-    ID_DISK_READ,
-    ID_DISK_WRITE_START,
-    ID_DISK_WRITE,
-
-	ID_FIRMWARE_READ = 0x40,
-	ID_FIRMWARE_WRITE,
-	ID_FIRMWARE_UPDATE,
-};
-
-//These get filled on dev_open()
-extern uint16_t dev_fwVersion;
-extern int dev_flashSize;           //in bytes
-extern int dev_slots;
-
-bool dev_open();
-void dev_close();
-void dev_printLastError();
-
-bool dev_reset();
-bool dev_updateFirmware();
-void dev_selfTest();
-bool dev_spiRead(uint8_t *buf, int size, bool holdCS);
-bool dev_spiWrite(uint8_t *buf, int size, bool initCS, bool holdCS);
-bool dev_sramWrite(uint8_t *buf, int size, bool initCS, bool holdCS);
-bool dev_readStart();
-int dev_readDisk(uint8_t *buf);
-bool dev_writeStart();
-bool dev_writeDisk(uint8_t *buf, int size);
-
-bool dev_fwWrite(uint8_t *buf, int size, bool initCS, bool holdCS);
+#pragma once
+#include "hidapi/hidapi.h"
+
+enum {
+    //payload per report when the report descriptor doesn't say (see dev_limits)
+    SPI_WRITEMAX=64-4,
+    SPI_READMAX=63,
+
+    DISK_READMAX=254,
+    DISK_WRITEMAX=255,
+
+    REPORT_MAX=1024,        //largest report the host side handles
+    SPI_LENGTHMAX=255,      //SPI, SRAM and firmware writes send their length in one byte
+
+    //HID reportIDs
+    ID_RESET=0xf0,
+    ID_UPDATEFIRMWARE=0xf1,
+	ID_SELFTEST = 0xf2,
+
+    ID_SPI_READ=1,
+    ID_SPI_READ_STOP,
+    ID_SPI_WRITE,
+	ID_SPI_VERIFY,
+	ID_SRAM_READ=5,
+	ID_SRAM_READ_STOP,
+	ID_SRAM_WRITE,
+
+    ID_READ_IO=0x10,
+    ID_DISK_READ_START,
+    ID_DISK_READ,
+    ID_DISK_WRITE_START,
+    ID_DISK_WRITE,
+
+	ID_FIRMWARE_READ = 0x40,
+	ID_FIRMWARE_WRITE,
+	ID_FIRMWARE_UPDATE,
+};
+
+/*
+ID_READ_IO status bits, byte 1 of the report.  This is the adapter firmware's layout, not the drive
+connector's:  on the connector /MEDIA_SET, /WRITABLE, /MOTOR_ON and /READY are all active low, and these
+values assume the firmware reports them inverted, 1 = asserted.  The firmware source isn't in this tree
+(firmware.inc is only the binary image), so the bit order and polarity here are unverified against it.
+Check them with --verbose (prints each change while -w --auto waits), a disk going in and out and a
+write protected one, before relying on --auto.
+*/
+enum {
+    MEDIA_SET=1,
+    WRITABLE=2,
+    MOTOR_ON=4,
+    READY=8,
+};
+
+//These get filled on dev_open(), per thread
+extern thread_local uint16_t dev_fwVersion;
+extern thread_local int dev_flashSize;           //in bytes
+extern thread_local int dev_slots;
+extern thread_local char dev_serial[64];
+
+//Largest payload per report, sized from the firmware's report descriptor at open
+struct devLimits {
+    int spiWrite, spiRead;      //SPI and SRAM
+    int diskRead, diskWrite;
+};
+
+extern bool dev_verbose;
+
+//What to do when a transfer fails.  Operations that can be redone (see dev_retry) get retries+1
+//attempts, waiting backoffMs before the first retry and twice as long before each one after that.
+struct devPolicy {
+    int timeoutMs;              //per control transfer (libusb backend)
+    int retries;
+    int backoffMs;
+};
+
+struct devStats {
+    int retries;                //attempts redone
+    int failures;               //operations that ran out of retries
+};
+
+extern devPolicy dev_policy;
+
+struct devInfo {
+    char path[256];
+    char serial[64];
+};
+
+struct devContext;
+
+bool dev_open();
+bool dev_openPath(const char *path);
+int dev_enumerate(devInfo *list, int max);
+bool dev_waitFor(bool present, uint32_t timeoutMs);      //timeoutMs=0: no limit
+bool dev_reopen(uint32_t timeoutMs, bool newBuild);     //after the adapter resets itself
+const devLimits *dev_limits();          //of the current (or attached) adapter
+devContext *dev_current();
+void dev_attach(devContext *ctx);
+void dev_close();
+void dev_printLastError();
+bool dev_retry(const char *what, int attempt);  //after a failed attempt (0 = first), true = try again
+const devStats *dev_stats();                    //of the current adapter, since it was opened
+
+bool dev_reset();
+bool dev_updateFirmware();
+void dev_selfTest();
+bool dev_benchmark(int count);
+bool dev_spiRead(uint8_t *buf, int size, bool holdCS);
+bool dev_spiWrite(uint8_t *buf, int size, bool initCS, bool holdCS);
+bool dev_sramWrite(uint8_t *buf, int size, bool initCS, bool holdCS);
+bool dev_sramRead(uint8_t *buf, int size, bool holdCS);
+bool dev_readStart();
+int dev_readDisk(uint8_t *buf);
+int dev_readPacket(uint8_t *buf, uint8_t *sequence);
+bool dev_writeStart();
+int dev_readIO();                   //status bits, -1 on error
+bool dev_writeDisk(uint8_t *buf, int size);
+
+bool dev_fwWrite(uint8_t *buf, int size, bool initCS, bool holdCS);
@@ -0,0 +1,118 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+#include "device.h"
+#include "spi.h"
+#include "fds.h"
+#include "os.h"
+#include "farm.h"
+
+/*
+Duplication farm:  the slot images are built once and shared read-only, then every attached adapter
+gets its own thread (and its own device context) to write and read back the whole library.  The
+adapters don't wait on each other, so the wall time is about that of the slowest one.
+*/
+
+enum { MAXDEVICES=64 };
+
+struct farmResult {
+    bool opened, written, verified;
+    int failedSlot;
+    int retries;
+    uint32_t writeMs, verifyMs;
+};
+
+static void farmWorker(const devInfo *info, const uint8_t *image, int slots, farmResult *result) {
+    uint8_t *actual=NULL;
+    uint32_t start;
+
+    do {
+        if(!(result->opened=dev_openPath(info->path)))
+            break;
+        if(slots+1>dev_slots) {
+            printf("%s: library needs %d slots, flash has %d\n", info->serial, slots, dev_slots-1);
+            break;
+        }
+
+        start=getTicks();
+        int slot;
+        for(slot=0; slot<slots; slot++) {
+            if(!spi_writeFlash(image+slot*SLOTSIZE, (slot+1)*SLOTSIZE, SLOTSIZE))
+                break;
+        }
+        result->writeMs=getTicks()-start;
+        if(slot<slots) {
+            result->failedSlot=slot+1;
+            break;
+        }
+        result->written=true;
+
+        start=getTicks();
+        actual=(uint8_t*)malloc(SLOTSIZE);
+        for(slot=0; slot<slots; slot++) {
+            if(!spi_readFlash((slot+1)*SLOTSIZE, actual, SLOTSIZE) || memcmp(actual, image+slot*SLOTSIZE, SLOTSIZE))
+                break;
+        }
+        result->verifyMs=getTicks()-start;
+        if(slot<slots) {
+            result->failedSlot=slot+1;
+            break;
+        }
+        result->verified=true;
+    } while(0);
+
+    free(actual);
+    result->retries=dev_stats()->retries;
+    dev_close();
+}
+
+bool farm_flash(char **files, int count) {
+    devInfo devices[MAXDEVICES];
+    farmResult results[MAXDEVICES];
+    uint8_t *image;
+    int slots, found;
+
+    if(!(slots=FDS_makeImage(files, count, &image)))
+        return false;
+    found=dev_enumerate(devices, MAXDEVICES);
+    if(!found) {
+        printf("Device not found\n");
+        free(image);
+        return false;
+    }
+    printf("Writing %d slot(s) to %d adapter(s)\n", slots, found);
+
+    memset(results, 0, sizeof(results));
+    std::vector<std::thread> workers;
+    uint32_t start=getTicks();
+    for(int i=0; i<found; i++)
+        workers.push_back(std::thread(farmWorker, &devices[i], image, slots, &results[i]));
+    for(size_t i=0; i<workers.size(); i++)
+        workers[i].join();
+    uint32_t wallMs=getTicks()-start;
+    free(image);
+
+    int good=0;
+    printf("\n");
+    for(int i=0; i<found; i++) {
+        farmResult *r=&results[i];
+        printf("%2d: %-20s write %6u ms  verify %6u ms  ", i+1, devices[i].serial[0]? devices[i].serial: devices[i].path, r->writeMs, r->verifyMs);
+        if(r->retries)
+            printf("(%d retries) ", r->retries);
+        if(r->verified) {
+            printf("Ok\n");
+            good++;
+        } else if(!r->opened) {
+            printf("open failed\n");
+        } else if(r->failedSlot) {
+            printf("%s failed at slot %d\n", r->written? "verify": "write", r->failedSlot);
+        } else {
+            printf("failed\n");
+        }
+    }
+    printf("%d of %d adapter(s) ok, %u ms total\n", good, found, wallMs);
+    return good==found;
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+bool farm_flash(char **files, int count);
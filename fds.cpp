@@ -1,1251 +1,2537 @@
-#include <stdint.h>
-#include <stdio.h>
-#include <string.h>
-#include <stdlib.h>
-#include "device.h"
-#include "fds.h"
-#include "spi.h"
-#include "os.h"
-
-/*
-Disk format in flash:
-struct {
-    uint16_t filename[120];  //null terminated unicode string.  filename[0]: 0xFFFF=empty, 0x0000=multi-disk image (continued from previous)
-    uint8_t reserved[14];   //set to 0
-    uint16_t lead_in;       //lead-in length (#bits), 0=default
-    uint8_t data[0xff00];   //disk data, beginning with gap end mark (0x80) of first block
-}
-*/
-
-enum {
-    DEFAULT_LEAD_IN=28300,      //#bits (~25620 min)
-    GAP=976/8-1,                //(~750 min)
-    MIN_GAP_SIZE=0x300,         //bits
-    FDSSIZE=65500,              //size of .fds disk side, excluding header
-    FLASHHEADERSIZE=0x100,
-};
-
-
-static void raw03_to_bin(uint8_t *raw, int rawSize, uint8_t **_bin, int *_binSize);
-
-// allocate buffer and read whole file
-bool loadFile(char *filename, uint8_t **buf, int *filesize) {
-	FILE *f=NULL;
-    int size;
-    bool result=false;
-    do {
-        if(!buf || !filesize)
-            break;
-        f=fopen(filename,"rb");
-        if(!f)
-            break;
-        fseek(f,0,SEEK_END);
-        size=ftell(f);
-        if(size>0x100000)       //sanity check
-            break;
-        fseek(f,0,SEEK_SET);
-        if( !(*buf=(uint8_t*)malloc(size)) )
-            break;
-        *filesize = fread(*buf, 1, size, f);
-        result=true;
-    } while(0);
-    if(f)
-        fclose(f);
-    return result;
-}
-
-//don't include gap end
-uint16_t calc_crc(uint8_t *buf, int size) {
-    uint32_t crc=0x8000;
-    int i;
-    while(size--) {
-        crc |= (*buf++)<<16;
-        for(i=0;i<8;i++) {
-            if(crc & 1) crc ^= 0x10810;
-            crc>>=1;
-        }
-    }
-    return crc;
-}
-
-void copy_block(uint8_t *dst, uint8_t *src, int size) {
-    dst[0] = 0x80;
-    memcpy(dst+1, src, size);
-    uint32_t crc = calc_crc(dst+1, size+2);
-    dst[size+1]=crc;
-    dst[size+2]=crc>>8;
-}
-
-//Adds GAP + GAP end (0x80) + CRCs to .FDS image
-//Returns size (0=error)
-int fds_to_bin(uint8_t *dst, uint8_t *src, int dstSize) {
-	int i=0, o=0;
-
-    //check *NINTENDO-HVC* header
-    if(src[0]!=0x01 || src[1]!=0x2a || src[2]!=0x4e) {
-        printf("Not an FDS file.\n");
-        return 0;
-    }
-    memset(dst, 0, dstSize);
-
-    //block type 1
-    copy_block(dst+o, src+i, 0x38);
-    i+=0x38;
-    o+=0x38+3+GAP;
-
-    //block type 2
-    copy_block(dst+o, src+i, 2);
-    i+=2;
-    o+=2+3+GAP;
-
-    //block type 3+4...
-    while(src[i]==3) {
-        int size = (src[i+13] | (src[i+14]<<8))+1;
-        if(o + 16+3 + GAP + size+3 > dstSize) {    //end + block3 + crc + gap + end + block4 + crc
-            printf("Out of space (%d bytes short), adjust GAP size?\n",(o + 16+3 + GAP + size+3)-dstSize);
-            return 0;
-        }
-        copy_block(dst+o, src+i, 16);
-        i+=16;
-        o+=16+3+GAP;
-
-        copy_block(dst+o, src+i, size);
-        i+=size;
-        o+=size+3+GAP;
-    }
-    return o;
-}
-
-/*
-Adds GAP + GAP end (0x80) + CRCs to Game Doctor image.  Returns size (0=error)
-
-GD format:
-    0x??, 0x??, 0x8N      3rd byte seems to be # of files on disk, same as block 2.
-    repeat to end of disk {
-        N bytes (block contents, same as .fds)
-        2 dummy CRC bytes (0x00 0x00)
-    }
-*/
-int gameDoctor_to_bin(uint8_t *dst, uint8_t *src, int dstSize) {
-    //check for *NINTENDO-HVC* at 0x03 and second block following CRC
-    if(src[3]!=0x01 || src[4]!=0x2a || src[5]!=0x4e || src[0x3d]!=0x02) {
-        printf("Not GD format.\n");
-        return 0;
-    }
-    memset(dst, 0, dstSize);
-
-    //block type 1
-    int i=3, o=0;
-    copy_block(dst+o, src+i, 0x38);
-    i += 0x38+2;        //block + dummy crc
-    o += 0x38+3+GAP;    //gap end + block + crc + gap
-
-    //block type 2
-    copy_block(dst+o, src+i, 2);
-    i += 2+2;
-    o += 2+3+GAP;
-
-    //block type 3+4...
-    while(src[i]==3) {
-        int size = (src[i+13] | (src[i+14]<<8))+1;
-        if(o + 16+3 + GAP + size+3 > dstSize) {    //end + block3 + crc + gap + end + block4 + crc
-            printf("Out of space (%d bytes short), adjust GAP size?\n",(o + 16+3 + GAP + size+3)-dstSize);
-            return 0;
-        }
-        copy_block(dst+o, src+i, 16);
-        i+=16+2;
-        o+=16+3+GAP;
-
-        copy_block(dst+o, src+i, size);
-        i+=size+2;
-        o+=size+3+GAP;
-    }
-    return o;
-}
-
-//look for pattern of bits matching block 1
-static int findFirstBlock(uint8_t *raw) {
-    static const uint8_t dat[]={1,0,1,0,0,0,0,0, 0,1,2,2,1,0,1,0, 0,1,1,2,1,1,1,1, 1,1,0,0,1,1,1,0};
-    int i,len;
-    for(i=0, len=0; i<0x2000*8; i++) {
-        if(raw[i]==dat[len]) {
-            if(len==sizeof(dat)-1)
-                return i-len;
-            len++;
-        } else {
-            i-=len;
-            len=0;
-        }
-    }
-    return -1;
-}
-
-bool block_decode(uint8_t *dst, uint8_t *src, int *inP, int *outP, int srcSize, int dstSize, int blockSize, char blockType) {
-    if(*outP+blockSize+2 > dstSize) {
-        printf("Out of space\n");
-        return false;
-    }
-
-    int in=*inP;
-    int outEnd=(*outP+blockSize+2)*8;
-    int out=(*outP)*8;
-    int start;
-
-    //scan for gap end
-    for(int zeros=0; src[in]!=1 || zeros<MIN_GAP_SIZE; in++) {
-        if(src[in]==0) {
-            zeros++;
-        } else {
-            zeros=0;
-        }
-        if(in>=srcSize-2)
-            return false;
-    }
-    start=in;
-
-    char bitval=1;
-    in++;
-    do {
-        if(in>=srcSize) {   //not necessarily an error, probably garbage at end of disk
-            //printf("Disk end\n"); 
-            return false;
-        }
-        switch(src[in]|(bitval<<4)) {
-            case 0x11:
-                out++;
-            case 0x00:
-                out++;
-                bitval=0;
-                break;
-            case 0x12:
-                out++;
-            case 0x01:
-            case 0x10:
-                dst[out/8] |= 1<<(out&7);
-                out++;
-                bitval=1;
-                break;
-            default: //Unexpected value.  Keep going, we'll probably get a CRC warning
-                //printf("glitch(%d) @ %X(%X.%d)\n", src[in], in, out/8, out%8);
-                out++;
-                bitval=0;
-                break;
-        }
-        in++;
-    } while(out<outEnd);
-    if(dst[*outP] !=blockType) {
-        printf("Wrong block type %X(%X)-%X(%X) (found %d, expected %d)\n", start, *outP, in, out-1, dst[*outP], blockType);
-        return false;
-    }
-    out=out/8-2;
-
-    //printf("Out%d %X(%X)-%X(%X)\n", blockType, start, *outP, in, out-1);
-
-    if(calc_crc(dst+*outP,blockSize+2)) {
-        uint16_t crc1=(dst[out+1]<<8)|dst[out];
-        dst[out]=0;
-        dst[out+1]=0;
-        uint16_t crc2=calc_crc(dst+*outP,blockSize+2);
-        printf("Bad CRC (%04X!=%04X)\n", crc1, crc2);
-    }
-
-    dst[out]=0;     //clear CRC
-    dst[out+1]=0;
-    dst[out+2]=0;   //+spare bit
-    *inP=in;
-    *outP=out;
-    return true;
-}
-
-__inline uint8_t raw_to_raw03_byte(uint8_t raw)
-{
-	if (raw < 0x48)
-		return(3);
-	else if (raw < 0x70)
-		return(0);
-	else if (raw < 0xA0)
-		return(1);
-	else if (raw < 0xD0)
-		return(2);
-	return(3);
-}
-
-//Turn raw data from adapter to pulse widths (0..3)
-//Input capture clock is 6MHz.  At 96.4kHz (FDS bitrate), 1 bit ~= 62 clocks
-//We could be clever about this and account for drive speed fluctuations, etc. but this will do for now
-static void raw_to_raw03(uint8_t *raw, int rawSize) {
-    for(int i=0; i<rawSize; ++i) {
-		 raw[i] = raw_to_raw03_byte(raw[i]);
-    }
-}
-
-//Simplified disk decoding.  This assumes disk will follow standard FDS file structure
-static bool raw03_to_fds(uint8_t *raw, uint8_t *fds, int rawsize) {
-    int in,out;
-
-    memset(fds,0,FDSSIZE);
-
-    //lead-in can vary a lot depending on drive, scan for first block to get our bearings
-    in=findFirstBlock(raw)-MIN_GAP_SIZE;
-    if(in<0)
-        return false;
-
-    out=0;
-    if(!block_decode(fds, raw, &in, &out, rawsize, FDSSIZE+2, 0x38, 1))
-        return false;
-    if(!block_decode(fds, raw, &in, &out, rawsize, FDSSIZE+2, 2, 2))
-        return false;
-    do {
-        if(!block_decode(fds, raw, &in, &out, rawsize, FDSSIZE+2, 16, 3))
-            return true;
-        if(!block_decode(fds, raw, &in, &out, rawsize, FDSSIZE+2, 1+(fds[out-16+13] | (fds[out-16+14]<<8)), 4))
-            return true;
-    } while(in<rawsize);
-    return true;
-}
-
-// TODO - only handles one side, files will need to be joined manually
-bool FDS_readDisk(char *filename_raw, char *filename_bin, char *filename_fds) {
-    enum { READBUFSIZE=0x90000 };
-
-    FILE *f;
-    uint8_t *readBuf=NULL;
-    int result;
-    int bytesIn=0;
-
-    //if(!(dev_readIO()&MEDIA_SET)) {
-    //    printf("Warning - Disk not inserted?\n");
-    //}
-    if(!dev_readStart())
-        return false;
-
-    readBuf=(uint8_t*)malloc(READBUFSIZE);
-    do {
-        result=dev_readDisk(readBuf+bytesIn);
-        bytesIn+=result;
-        if(!(bytesIn%((DISK_READMAX)*32)))
-            printf(".");
-    } while(result==DISK_READMAX && bytesIn<READBUFSIZE-DISK_READMAX);
-    printf("\n");
-    if(result<0) {
-        printf("Read error.\n");
-        return false;
-    }
-
-    if(filename_raw) {
-        if( (f=fopen(filename_raw,"wb")) ) {
-            fwrite(readBuf, 1, bytesIn, f);
-            fclose(f);
-            printf("Wrote %s\n",filename_raw);
-        }
-    }
-
-    raw_to_raw03(readBuf, bytesIn);
-
-    //decode to .fds
-    if(filename_fds) {
-        uint8_t *fds=(uint8_t*)malloc(FDSSIZE+16);   //extra room for CRC junk
-        raw03_to_fds(readBuf, fds, bytesIn);
-        if( (f=fopen(filename_fds,"wb")) ) {
-            fwrite(fds, 1, FDSSIZE, f);
-            fclose(f);
-            printf("Wrote %s\n",filename_fds);
-        }
-        free(fds);
-
-    //decode to .bin
-    } else if(filename_bin) {
-        uint8_t *binBuf;
-        int binSize;
-
-        raw03_to_bin(readBuf, bytesIn, &binBuf, &binSize);
-        if( (f=fopen(filename_bin, "wb")) ) {
-            fwrite(binBuf, 1, binSize, f);
-            fclose(f);
-            printf("Wrote %s\n", filename_bin);
-        }
-        free(binBuf);
-    }
-
-    free(readBuf);
-    return true;
-}
-
-static bool writeDisk(uint8_t *bin, int binSize) {
-    static const uint8_t expand[]={ 0xaa, 0xa9, 0xa6, 0xa5, 0x9a, 0x99, 0x96, 0x95, 0x6a, 0x69, 0x66, 0x65, 0x5a, 0x59, 0x56, 0x55 };
-    int bytesOut;
-    bool fail=false;
-
-    //if(!(readIO()&MEDIA_SET)) {
-    //    printf("Disk not inserted.\n");
-    //}
-    if(!dev_writeStart())
-        return false;
-
-    //expand to mfm for writing
-    uint8_t *mfm=(uint8_t*)malloc(binSize*2 + DISK_WRITEMAX);
-    for(int i=0; i<binSize; i++) {
-        mfm[i*2 + 0]=expand[bin[i]&0x0f];
-        mfm[i*2 + 1]=expand[(bin[i]>>4)&0x0f];
-    }
-    memset(mfm+binSize*2, 0xAA, DISK_WRITEMAX); //zero out last packet
-
-    for(bytesOut=0; bytesOut<binSize*2; bytesOut+=DISK_WRITEMAX) {
-        if(!dev_writeDisk(mfm+bytesOut, DISK_WRITEMAX)) {
-            printf("Write error (disk full?)\n");
-            fail=true;
-            break;
-        }
-        if(!(bytesOut%(DISK_WRITEMAX*16)))
-            printf("#");
-    }
-
-    if(!fail) {
-        //Fill remainder with empty space.   Keep writing until we can't, EP0 will stall at end of disk
-        memset(mfm, 0xaa, DISK_WRITEMAX);
-        for(bytesOut=0; bytesOut<0x20000; bytesOut+=DISK_WRITEMAX) {
-            if(!dev_writeDisk(mfm, DISK_WRITEMAX))
-                break;
-            if(!(bytesOut%(DISK_WRITEMAX*16)))
-                printf(".");
-        }
-    }
-
-    free(mfm);
-    return !fail;
-}
-
-void hexdump(char*, void*, int);
-
-static bool writeDisk2(uint8_t *bin, int binSize) {
-//	printf("writeDisk2: sending bin image to adaptor, size = %d\n", binSize);
-
-//	hexdump("bin", bin+ 3537, 256);
-
-	spi_writeSram(bin, 0, binSize);
-
-	if (!dev_writeStart())
-		return false;
-
-	return(true);
-
-}
-
-bool FDS_writeDisk(char *filename) {
-	enum {
-		LEAD_IN = DEFAULT_LEAD_IN / 8,
-		DISKSIZE = 0x11000,               //whole disk contents including lead-in
-	};
-
-	uint8_t *inbuf = 0;       //.FDS buffer
-	uint8_t *bin = 0;         //.FDS with gaps/CRC
-	uint8_t *zero = 0;
-	int filesize;
-	int binSize;
-
-	if (!loadFile(filename, &inbuf, &filesize))
-	{
-		printf("Can't read %s\n", filename); return false;
-	}
-
-	bin = (uint8_t*)malloc(DISKSIZE);
-	zero = (uint8_t*)malloc(0x10000);
-	memset(zero, 0, 0x10000);
-
-	int inpos = 0, side = 0;
-	if (inbuf[0] == 'F')
-		inpos = 16;      //skip fwNES header
-
-	filesize -= (filesize - inpos) % FDSSIZE;  //truncate down to whole disk
-
-	char prompt;
-	do {
-		printf("Side %d\n", side + 1);
-
-		spi_writeSram(zero, 0, 0x10000);
-		memset(bin, 0, LEAD_IN);
-		binSize = fds_to_bin(bin + LEAD_IN, inbuf + inpos, DISKSIZE - LEAD_IN);
-		if (!binSize)
-			break;
-		if (!writeDisk2(bin, binSize + LEAD_IN))
-			break;
-		inpos += FDSSIZE;
-		side++;
-
-//		printf("finished write, inpos = %d, filesize = %d, inbuf[inpos] = %X", inpos, filesize, inbuf[inpos]);
-		//prompt for disk change
-		prompt = 0;
-		if (inpos<filesize && inbuf[inpos] == 0x01) {
-			printf("\nPlease wait for disk activity to stop before pressing ENTER to write the next disk side.\n");
-			prompt = readKb();
-		}
-		else {
-			printf("\nDisk image sent to SRAM on device and is currently writing.\nPlease wait for disk activity to stop before removing disk.\n");
-		}
-	} while (prompt == 0x0d);
-
-	free(bin);
-	free(zero);
-	free(inbuf);
-	return true;
-}
-
-/*bool FDS_writeDisk(char *filename) {
-	enum {
-		LEAD_IN = DEFAULT_LEAD_IN / 8,
-		DISKSIZE = 0x11000,               //whole disk contents including lead-in
-	};
-
-	uint8_t *inbuf = 0;       //.FDS buffer
-	uint8_t *bin = 0;         //.FDS with gaps/CRC
-	int filesize;
-	int binSize;
-
-	if (!loadFile(filename, &inbuf, &filesize))
-	{
-		printf("Can't read %s\n", filename); return false;
-	}
-
-	bin = (uint8_t*)malloc(DISKSIZE);
-
-	int inpos = 0, side = 0;
-	if (inbuf[0] == 'F')
-		inpos = 16;      //skip fwNES header
-
-	filesize -= (filesize - inpos) % FDSSIZE;  //truncate down to whole disk
-
-	char prompt;
-	do {
-		printf("Side %d\n", side + 1);
-
-		memset(bin, 0, LEAD_IN);
-		binSize = fds_to_bin(bin + LEAD_IN, inbuf + inpos, DISKSIZE - LEAD_IN);
-		if (!binSize)
-			break;
-		if (!writeDisk(bin, binSize + LEAD_IN))
-			break;
-		inpos += FDSSIZE;
-		side++;
-
-		//prompt for disk change
-		prompt = 0;
-		if (inpos<filesize && inbuf[inpos] == 0x01) {
-			printf("Push ENTER for next disk side\n");
-			prompt = readKb();
-		}
-	} while (prompt == 0x0d);
-
-	free(bin);
-	free(inbuf);
-	return true;
-}*/
-
-uint32_t chksum_calc(uint8_t *buf, int size)
-{
-	uint32_t ret = 0;
-	uint32_t *data = (uint32_t*)buf;
-	int i;
-
-	for (i = 0; i < size / 4; i++) {
-		ret ^= buf[i];
-	}
-	return(ret);
-}
-
-//slot 1..n
-bool FDS_writeFlash(char *filename, int slot) {
-    enum { FILENAMELENGTH=120, };   //number of characters including null
-
-    uint8_t *inbuf=0;
-    uint8_t *outbuf=0;
-    int filesize;
-
-    if(!loadFile(filename, &inbuf, &filesize))
-        { printf("Can't read %s\n",filename); return false; }
-
-    outbuf=(uint8_t*)malloc(SLOTSIZE);
-
-    int pos=0, side=0;
-    if(inbuf[0]=='F')
-        pos=16;      //skip fwNES header
-
-    filesize -= (filesize-pos)%FDSSIZE;  //truncate down to whole disks
-
-    while(pos<filesize && inbuf[pos]==0x01) {
-        printf("Side %d\n", side+1);
-        if(fds_to_bin(outbuf+FLASHHEADERSIZE, inbuf+pos, SLOTSIZE-FLASHHEADERSIZE)) {
-            memset(outbuf,0,FLASHHEADERSIZE);
-				uint32_t chksum = chksum_calc(outbuf + FLASHHEADERSIZE, SLOTSIZE - FLASHHEADERSIZE);
-				outbuf[240] = (uint8_t)(chksum >> 0);
-				outbuf[241] = (uint8_t)(chksum >> 8);
-				outbuf[242] = (uint8_t)(chksum >> 16);
-				outbuf[243] = (uint8_t)(chksum >> 24);
-				outbuf[244] = DEFAULT_LEAD_IN & 0xff;
-            outbuf[245] = DEFAULT_LEAD_IN / 256;
-
-            if(side==0) {
-                //strip path from filename
-                char *shortName=strrchr(filename,'/');      // ...dir/file.fds
-#ifdef _WIN32
-                if(!shortName)
-                    shortName=strrchr(filename,'\\');        // ...dir\file.fds
-                if(!shortName)
-                    shortName=strchr(filename,':');         // C:file.fds
-#endif
-                if(!shortName)
-                    shortName=filename;
-                else
-                    shortName++;
-//                utf8_to_utf16((uint16_t*)outbuf, shortName, FILENAMELENGTH*2);
-//                ((uint16_t*)outbuf)[FILENAMELENGTH-1]=0;
-					 strncpy((char*)outbuf, shortName, 240);
-            }
-            spi_writeFlash(outbuf, (slot+side)*SLOTSIZE, SLOTSIZE);
-        }
-        pos+=FDSSIZE;
-        side++;
-    }
-    free(inbuf);
-    free(outbuf);
-    return true;
-}
-
-void hexdump(char *desc, void *addr, int len)
-{
-	int i;
-	unsigned char buff[17];
-	unsigned char *pc = (unsigned char *)addr;
-
-	// Output description if given.
-	if (desc != NULL)
-		printf("%s:\r\n", desc);
-
-	// Process every byte in the data.
-	for (i = 0; i < len; i++) {
-		// Multiple of 16 means new line (with line offset).
-
-		if ((i % 16) == 0) {
-			// Just don't print ASCII for the zeroth line.
-			if (i != 0)
-				printf("  %s\r\n", buff);
-
-			// Output the offset.
-			printf("  %04x ", i);
-		}
-		// Now the hex code for the specific character.
-		printf(" %02x", pc[i]);
-
-		// And store a printable ASCII character for later.
-		if ((pc[i] < 0x20) || (pc[i] > 0x7e))
-			buff[i % 16] = '.';
-		else
-			buff[i % 16] = pc[i];
-		buff[(i % 16) + 1] = '\0';
-	}
-
-	// Pad out last line if not exactly 16 characters.
-	while ((i % 16) != 0) {
-		printf("   ");
-		i++;
-	}
-
-	// And print the final ASCII bit.
-	printf("  %s\r\n", buff);
-}
-
-bool FDS_list() {
-    uint8_t buf[256];
-    int side=0;
-	 printf("\n");
-    for(int slot=1;slot<dev_slots;slot++) {
-        if(!spi_readFlash((slot)*SLOTSIZE,buf,256))
-            return false;
-
-        if(buf[0]==0xff) {          //empty
-            printf("%d:\n",slot);
-            side=0;
-        } else if(buf[0]!=0) {      //filename present
-            printf("%d: %s\n", slot, buf);
-            side=1;
-        } else if(!side) {          //first side is missing
-            printf("%d: ?\n", slot);
-        } else {                    //next side
-            printf("%d:    Side %d\n", slot, ++side);
-        }
-    }
-    return true;
-}
-
-//===============================
-
-//check for gap at EOF
-bool looks_like_file_end(uint8_t *raw, int start, int rawSize) {
-    enum {
-        MIN_GAP=976-100,
-        MAX_GAP=976+100,
-    };
-    int zeros=0;
-    int in=start;
-    for(; in<start+MAX_GAP && in<rawSize; in++) {
-        if(raw[in]==1 && zeros>MIN_GAP) {
-            return true;
-        } else if(raw[in]==0) {
-            zeros++;
-        }
-        if(raw[in]!=0)
-            zeros=0;
-    }
-    return in>=rawSize;  //end of disk = end of file!
-}
-
-//detect EOF by looking for good CRC.  in=start of file
-//returns 0 if nothing found
-int crc_detect(uint8_t *raw, int in, int rawSize) {
-    static uint32_t crc;
-    static uint8_t bitval;
-    static int out;
-    static bool match;
-
-    //local function ;)
-    struct { void shift(uint8_t bit) {
-        crc|=bit<<16;
-        if(crc & 1) crc ^= 0x10810;
-        crc>>=1;
-        bitval=bit;
-        out++;
-        if(crc==0 && !(out&7))  //on a byte bounary and CRC is valid
-            match=true;
-    }} f;
-
-    crc=0x8000;
-    bitval=1;
-    out=0;
-    do {
-        match=false;
-        switch(raw[in]|(bitval<<4)) {
-            case 0x11:
-                f.shift(0);
-            case 0x00:
-                f.shift(0);
-                break;
-            case 0x12:
-                f.shift(0);
-            case 0x01:
-            case 0x10:
-                f.shift(1);
-                break;
-            default:    //garbage / bad encoding
-                return 0;
-        }
-        in++;
-    } while(in<rawSize && !(match && looks_like_file_end(raw,in,rawSize)));
-    return match? in: 0;
-}
-
-//gap end is known, backtrack and mark the start.  !! this assumes junk data exists between EOF and gap start
-static void mark_gap_start(uint8_t *raw, int gapEnd) {
-    int i;
-    for(i=gapEnd-1; i>=0 && raw[i]==0; --i)
-        { }
-    raw[i+1]=3;
-    printf("mark gap %X-%X\n", i+1, gapEnd);
-}
-
-//For information only for now.  This checks for standard file format
-static void verify_block(uint8_t *bin, int start, int *reverse) {
-    enum { MAX_GAP=(976+100)/8, MIN_GAP=(976-100)/8 };
-    static const uint8_t next[]={0,2,3,4,3};
-    static int last = 0;
-    static int lastLen = 0;
-    static int blockCount = 0;
-
-    int len=0;
-    uint8_t type=bin[start];
-
-    printf("%d:%X", ++blockCount, type);
-
-    switch(type) {
-        case 1:
-            len=0x38;
-            break;
-        case 2:
-            len=2;
-            break;
-        case 3:
-            len=16;
-            break;
-        case 4:
-            len=1+(bin[last+13] | (bin[last+14]<<8));
-            break;
-        default:
-            printf(" bad block (%X)\n",start);
-            return;
-    }
-    printf(" %X-%X / %X-%X(%X)", reverse[start], reverse[start+len], start, start+len, len);
-
-    if((!last && type!=1) || (last && type!=next[bin[last]]))
-        printf(", wrong filetype");
-    if(calc_crc(bin+start, len+2)!=0)
-        printf(", bad CRC");
-    if(last && (last+lastLen+MAX_GAP)<start)
-        printf(", lost block?");
-    if(last+lastLen+MIN_GAP>start)
-        printf(", block overlap?");
-    //if(type==3 && ...)    //check other fields in file header?
-
-    printf("\n");
-    last=start;
-    lastLen=len;
-}
-
-//find gap + gap end.  returns bit following gap end, >=rawSize if not found.
-int nextGapEnd(uint8_t *raw, int in, int rawSize) {
-    enum { MIN_GAP=976-100, };
-    int zeros=0;
-    for(; (raw[in]!=1 || zeros<MIN_GAP) && in<rawSize; in++) {
-        if(raw[in]==0) {
-            zeros++;
-        } else {
-            zeros=0;
-        }
-    }
-    return in+1;
-}
-
-/*
-Try to create byte-for-byte, unadulterated representation of disk.  Use hints from the disk structure, given
-that it's probably a standard FDS game image but this should still make a best attempt regardless of the disk content.  
-
-_bin and _binSize are updated on exit.  alloc'd buffer is returned in _bin, caller is responsible for freeing it.
-*/
-static void raw03_to_bin(uint8_t *raw, int rawSize, uint8_t **_bin, int *_binSize) {
-    enum {
-        BINSIZE=0xa0000,
-        POST_GLITCH_GARBAGE=16,
-        LONG_POST_GLITCH_GARBAGE=64,
-        LONG_GAP=900,   //976 typ.
-        SHORT_GAP=16,
-    };
-    int in, out;
-    uint8_t *bin;
-    int *reverse;
-    int glitch;
-    int zeros;
-
-    bin=(uint8_t*)malloc(BINSIZE);
-    reverse=(int*)malloc(BINSIZE*sizeof(int));
-    memset(bin,0,BINSIZE);
-
-    //--- assume any glitch is OOB, mark a run of zeros near a glitch as a gap start.
-
-    int junk=0;
-    glitch=0;
-    zeros=0;
-    junk=0;
-    for(in=0; in<rawSize; in++) {
-        if(raw[in]==3) {
-            glitch=in;
-            junk=0;
-        } else if(raw[in]==1 || raw[in]==2) {
-            junk=in;
-        } else if(raw[in]==0) {
-            zeros++;
-            if(glitch && junk && zeros>SHORT_GAP && (junk-glitch)<POST_GLITCH_GARBAGE) {
-                mark_gap_start(raw,in);
-                glitch=0;
-            }
-        }
-        if(raw[in]!=0)
-            zeros=0;
-    }
-
-    //--- Walk filesystem, mark blocks where something looks like a valid file
-
-    in=findFirstBlock(raw);
-    if(in>0) {
-        printf("header at %X\n",in);
-        mark_gap_start(raw, in-1);
-    }
-/*
-    do {
-        if(block_decode(..)) {
-            raw[head]=0xff;
-            raw[tail]=3;
-        }
-        next_gap(..);
-    } while(..);
-*/
-    //--- Identify files by CRC. If data looks like it's surrounded by gaps and it has a valid CRC where we
-    //    expect one to be, assume it's a file and mark its start/end.
-
-    in=findFirstBlock(raw)+1;
-    if(in>0) do {
-        out=crc_detect(raw,in,rawSize);
-        if(out) {
-            printf("crc found %X-%X\n",in,out);
-            raw[out]=3;     //mark glitch (gap start)
-            //raw[in-1]=0xff;   //mark gap end 
-        }
-        in=nextGapEnd(raw, out? out: in, rawSize);
-    } while(in<rawSize);
-
-    //--- mark gap start/end using glitches to find gap start
-
-    for(glitch=0, zeros=0, in=0; in<rawSize; in++) {
-        if(raw[in]==3) {
-            glitch=in;
-        } else if(raw[in]==1) {
-            if(zeros>LONG_GAP && (in-zeros-LONG_POST_GLITCH_GARBAGE)<glitch) {
-                mark_gap_start(raw,in);
-                raw[in]=0xff;
-            }
-        } else if(raw[in]==0) {
-            zeros++;
-        }
-        if(raw[in]!=0)
-            zeros=0;
-    }
-
-    //--- output
-
-    /*
-    FILE *f=fopen("raw03.bin","wb");
-    fwrite(raw,1,rawSize,f);
-    fclose(f);
-    */
-
-    char bitval=0;
-    int lastBlockStart=0;
-    for(in=0, out=0; in<rawSize; in++) {
-        switch(raw[in]|(bitval<<4)) {
-            case 0x11:
-                out++;
-            case 0x00:
-                out++;
-                bitval=0;
-                break;
-            case 0x12:
-                out++;
-            case 0x01:
-            case 0x10:
-                bin[out/8] |= 1<<(out&7);
-                out++;
-                bitval=1;
-                break;
-            case 0xff:  //block end
-                if(lastBlockStart)
-                    verify_block(bin, lastBlockStart, reverse);
-                bin[out/8] = 0x80;
-                out=(out|7)+1;      //byte-align for readability
-                lastBlockStart=out/8;
-                bitval=1;
-                break;
-            case 0x02:
-                //printf("Encoding error @ %X(%X)\n",in,out/8);
-            default: //anything else (glitch)
-                out++;
-                bitval=0;
-                break;
-        }
-        reverse[out/8]=in;
-    }
-    //last block
-    verify_block(bin, lastBlockStart, reverse);
-
-    *_bin=bin;
-    *_binSize=out/8+1;
-    free(reverse);
-}
-
-/*
-bool FDS_rawToBin(char *filename_raw, char *filename_bin) {
-    FILE *f;
-    uint8_t *rawBuf=NULL;
-    uint8_t *binBuf=NULL;
-    int rawSize=0;
-    int binSize=0;
-
-    if(!loadFile(filename_raw, &rawBuf, &rawSize))
-        return false;
-    raw_to_raw03(rawBuf, rawSize);
-    raw03_to_bin(rawBuf, rawSize, &binBuf, &binSize);
-
-    f=fopen(filename_bin, "wb");
-    fwrite(binBuf, 1, binSize, f);
-    fclose(f);
-    printf("Wrote %s\n", filename_bin);
-
-    free(binBuf);
-    free(rawBuf);
-    return true;
-}
-*/
-
-// =========================================
-
-//make raw0-3 from flash image (sans header)
-static void bin_to_raw03(uint8_t *bin, uint8_t *raw, int binSize, int rawSize) {
-    int in, out;
-    uint8_t bit, data;
-
-    memset(raw,0xff,rawSize);
-    for(bit=1, out=0, in=0; in<binSize*8; in++) {
-		 if ((in & 7) == 0) {
-			 data = *bin;
-			 bin++;
-		 }
-		 bit = (bit << 7) | (1 & (data >> (in & 7)));   //LSB first
-//     bit = (bit<<7) | (1 & (bin[in/8]>>(in%8)));   //LSB first
-        switch(bit) {
-            case 0x00:  //10 10
-					 out++;
-                raw[out]++;
-                break;
-            case 0x01:  //10 01
-            case 0x81:  //01 01
-                raw[out]++;
-					 out++;
-                break;
-            case 0x80:  //01 10
-                raw[out] += 2;
-                break;
-        }
-    }
-    memset(raw+out,3,rawSize-out);  //fill remainder with (undefined)
-}
-
-//Going directly to .FDS is messy, flash image isn't byte aligned and has gaps+CRCs.
-//Just convert to raw and use disk dumping functions.
-bool FDS_readFlashToFDS(char *filename_fds, int slot) {  //slot 1..N
-    enum {
-		 RAWSIZE = SLOTSIZE * 8,
-	 };
-
-    static uint8_t fwnesHdr[16]={0x46, 0x44, 0x53, 0x1a, };
-
-    FILE *f;
-    uint8_t *bin, *raw, *fds;
-    bool result=true;
-
-    f=fopen(filename_fds, "wb");
-    if(!f) {
-        printf("Can't create %s\n",filename_fds);
-        return false;
-    }
-
-    printf("Writing %s\n",filename_fds);
-    fwnesHdr[4]=0;
-    fwrite(fwnesHdr,1,sizeof(fwnesHdr),f);
-
-    bin=(uint8_t*)malloc(SLOTSIZE);     //single side from flash
-	 raw=(uint8_t*)malloc(RAWSIZE);      //..to raw03
-	 fds=(uint8_t*)malloc(FDSSIZE);      //..to FDS
-
-    int side=0;
-    for(; side+slot<=dev_slots; side++) {
-        if(!spi_readFlash((slot+side)*SLOTSIZE, bin, SLOTSIZE)) {
-            result=false;
-            break;
-        }
-
-        if(bin[0]==0xff || (bin[0]!=0 && side!=0)) {    //stop on empty slot or next game
-            break;
-        } else if(bin[0]==0 && side==0) {
-            printf("Warning! Not first side of game\n");
-        }
-
-        printf("Side %d\n",side+1);
-        memset(bin,0,FLASHHEADERSIZE);  //clear header, use it as lead-in
-		  bin_to_raw03(bin, raw, SLOTSIZE, RAWSIZE);
-		  if(!raw03_to_fds(raw, fds, RAWSIZE)) {
-            result=false;
-            break;
-        }
-        fwrite(fds,1,FDSSIZE,f);
-        fwnesHdr[4]++;  //count sides written
-    }
-
-    fseek(f,0,SEEK_SET);
-    fwrite(fwnesHdr,1,sizeof(fwnesHdr),f);      //update disk side count
-
-    free(fds);
-    free(raw);
-    free(bin);
-    fclose(f);
-    return result;
-}
-
-int writeBin(char *fn, uint8_t *bin, int binsize)
-{
-	FILE *fp;
-
-	if ((fp = fopen(fn, "wb")) == 0) {
-		printf("error opening '%s'\n", fn);
-		return(0);
-	}
-
-	fwrite(bin, binsize, 1, fp);
-
-	fclose(fp);
-	return(1);
-}
-
-bool FDS_convertDiskraw03(char *filename, char *out) {
-	enum {
-		LEAD_IN = DEFAULT_LEAD_IN / 8,
-		DISKSIZE = 0x11000,               //whole disk contents including lead-in
-		RAWSIZE = SLOTSIZE * 8,
-	};
-
-	uint8_t *inbuf = 0;       //.FDS buffer
-	uint8_t *bin = 0;         //.FDS with gaps/CRC
-	uint8_t *raw = 0;         //.FDS with gaps/CRC
-	int filesize;
-	int binSize;
-
-	if (!loadFile(filename, &inbuf, &filesize))
-	{
-		printf("Can't read %s\n", filename); return false;
-	}
-
-	bin = (uint8_t*)malloc(DISKSIZE);
-	raw = (uint8_t*)malloc(RAWSIZE);      //..to raw03
-
-
-	int inpos = 0, side = 0;
-	if (inbuf[0] == 'F')
-		inpos = 16;      //skip fwNES header
-
-	filesize -= (filesize - inpos) % FDSSIZE;  //truncate down to whole disk
-
-	char prompt;
-	do {
-		printf("Side %d\n", side + 1);
-
-		memset(bin, 0, LEAD_IN);
-		binSize = fds_to_bin(bin + LEAD_IN, inbuf + inpos, DISKSIZE - LEAD_IN);
-		if (!binSize)
-			break;
-		printf("writing output\n");
-		bin_to_raw03(bin, raw, SLOTSIZE, RAWSIZE);
-		if (!writeBin(out, raw, RAWSIZE))
-			break;
-		inpos += FDSSIZE;
-		side++;
-
-		//prompt for disk change
-		prompt = 0;
-		if (inpos<filesize && inbuf[inpos] == 0x01) {
-			printf("Push ENTER for next disk side\n");
-			prompt = readKb();
-		}
-	} while (prompt == 0x0d);
-
-	printf("done\n");
-
-	free(bin);
-	free(inbuf);
-	return true;
-}
-
-bool FDS_convertDisk(char *filename, char *out) {
-	enum {
-		LEAD_IN = DEFAULT_LEAD_IN / 8,
-		DISKSIZE = 0x11000,               //whole disk contents including lead-in
-	};
-
-	uint8_t *inbuf = 0;       //.FDS buffer
-	uint8_t *bin = 0;         //.FDS with gaps/CRC
-	int filesize;
-	int binSize;
-
-	if (!loadFile(filename, &inbuf, &filesize))
-	{
-		printf("Can't read %s\n", filename); return false;
-	}
-
-	bin = (uint8_t*)malloc(DISKSIZE);
-
-	int inpos = 0, side = 0;
-	if (inbuf[0] == 'F')
-		inpos = 16;      //skip fwNES header
-
-	filesize -= (filesize - inpos) % FDSSIZE;  //truncate down to whole disk
-
-	char prompt;
-	do {
-		printf("Side %d\n", side + 1);
-
-		memset(bin, 0, LEAD_IN);
-		binSize = fds_to_bin(bin + LEAD_IN, inbuf + inpos, DISKSIZE - LEAD_IN);
-		if (!binSize)
-			break;
-		printf("writing output\n");
-		if (!writeBin(out, bin, binSize + LEAD_IN))
-			break;
-		inpos += FDSSIZE;
-		side++;
-
-		//prompt for disk change
-		prompt = 0;
-		if (inpos<filesize && inbuf[inpos] == 0x01) {
-			printf("Push ENTER for next disk side\n");
-			prompt = readKb();
-		}
-	} while (prompt == 0x0d);
-
-	printf("done\n");
-
-	free(bin);
-	free(inbuf);
-	return true;
-}
-
-
-bool FDS_bintofds(char *filename, char *out)
-{
-	enum {
-		RAWSIZE = SLOTSIZE * 8,
-	};
-
-	static uint8_t fwnesHdr[16] = { 0x46, 0x44, 0x53, 0x1a, };
-
-	FILE *f;
-	uint8_t *bin, *raw, *fds;
-	bool result = true;
-	int filesize;
-
-	if (!loadFile(filename, &bin, &filesize))
-	{
-		printf("Can't read %s\n", filename);
-		return false;
-	}
-
-	f = fopen(out, "wb");
-	if (!f) {
-		printf("Can't create %s\n", out);
-		return false;
-	}
-
-	printf("Writing %s\n", out);
-	fwnesHdr[4] = 0;
-	fwrite(fwnesHdr, 1, sizeof(fwnesHdr), f);
-
-	raw = (uint8_t*)malloc(RAWSIZE);      //..to raw03
-	fds = (uint8_t*)malloc(FDSSIZE);      //..to FDS
-
-	bin_to_raw03(bin, raw, SLOTSIZE, RAWSIZE);
-	if (!raw03_to_fds(raw, fds, RAWSIZE)) {
-		result = false;
-	}
-
-	fseek(f, 0, SEEK_SET);
-	fwrite(fwnesHdr, 1, sizeof(fwnesHdr), f);      //update disk side count
-	fwrite(fds, 1, 65500, f); 
-
-	free(fds);
-	free(raw);
-	free(bin);
-	fclose(f);
-	return result;
-}
\ No newline at end of file
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include "device.h"
+#include "fds.h"
+#include "spi.h"
+#include "os.h"
+#include "capture.h"
+#include "raw03.h"
+
+/*
+Disk format in flash:
+struct {
+    char filename[240];     //null terminated.  filename[0]: 0xFF=empty, 0x00=multi-disk image (continued from previous)
+    uint32_t checksum;      //of data
+    uint16_t lead_in;       //lead-in length (#bits), 0=default
+    uint8_t reserved[2];    //set to 0
+    uint32_t hash;          //FNV-1a of data, 0=not present (see slotHash)
+    uint8_t reserved2[4];   //set to 0
+    uint8_t data[0xff00];   //disk data, beginning with gap end mark (0x80) of first block
+}
+The hash lets a slot be compared without reading all of it.  Older versions wrote the same layout
+but left 248-255 zero, so their slots have no hash (sync rewrites them once).
+*/
+
+enum {
+    DEFAULT_LEAD_IN=28300,      //#bits (~25620 min)
+    GAP=976/8-1,                //(~750 min)
+    MIN_GAP_SIZE=0x300,         //bits
+    FDSSIZE=65500,              //size of .fds disk side, excluding header
+    FLASHHEADERSIZE=0x100,
+    HEADER_HASH=248,
+};
+
+
+static void raw03_to_bin(uint8_t *raw, int rawSize, uint8_t **_bin, int *_binSize);
+
+//don't include gap end
+uint16_t calc_crc(uint8_t *buf, int size) {
+    uint32_t crc=0x8000;
+    int i;
+    while(size--) {
+        crc |= (*buf++)<<16;
+        for(i=0;i<8;i++) {
+            if(crc & 1) crc ^= 0x10810;
+            crc>>=1;
+        }
+    }
+    return crc;
+}
+
+void copy_block(uint8_t *dst, const uint8_t *src, int size) {
+    dst[0] = 0x80;
+    memcpy(dst+1, src, size);
+    uint32_t crc = calc_crc(dst+1, size+2);
+    dst[size+1]=crc;
+    dst[size+2]=crc>>8;
+}
+
+//Adds GAP + GAP end (0x80) + CRCs to .FDS image
+//Returns size (0=error)
+int fds_to_bin(uint8_t *dst, const uint8_t *src, int dstSize) {
+	int i=0, o=0;
+
+    //check *NINTENDO-HVC* header
+    if(src[0]!=0x01 || src[1]!=0x2a || src[2]!=0x4e) {
+        printf("Not an FDS file.\n");
+        return 0;
+    }
+    memset(dst, 0, dstSize);
+
+    //block type 1
+    copy_block(dst+o, src+i, 0x38);
+    i+=0x38;
+    o+=0x38+3+GAP;
+
+    //block type 2
+    copy_block(dst+o, src+i, 2);
+    i+=2;
+    o+=2+3+GAP;
+
+    //block type 3+4...
+    while(i+16<FDSSIZE && src[i]==3) {
+        int size = (src[i+13] | (src[i+14]<<8))+1;
+        if(o + 16+3 + GAP + size+3 > dstSize) {    //end + block3 + crc + gap + end + block4 + crc
+            printf("Out of space (%d bytes short), adjust GAP size?\n",(o + 16+3 + GAP + size+3)-dstSize);
+            return 0;
+        }
+        if(i+16+size > FDSSIZE) {
+            printf("File runs past end of disk side.\n");
+            return 0;
+        }
+        copy_block(dst+o, src+i, 16);
+        i+=16;
+        o+=16+3+GAP;
+
+        copy_block(dst+o, src+i, size);
+        i+=size;
+        o+=size+3+GAP;
+    }
+    return o;
+}
+
+/*
+Adds GAP + GAP end (0x80) + CRCs to Game Doctor image.  Returns size (0=error)
+
+GD format:
+    0x??, 0x??, 0x8N      3rd byte seems to be # of files on disk, same as block 2.
+    repeat to end of disk {
+        N bytes (block contents, same as .fds)
+        2 dummy CRC bytes (0x00 0x00)
+    }
+*/
+int gameDoctor_to_bin(uint8_t *dst, const uint8_t *src, int dstSize) {
+    //check for *NINTENDO-HVC* at 0x03 and second block following CRC
+    if(src[3]!=0x01 || src[4]!=0x2a || src[5]!=0x4e || src[0x3d]!=0x02) {
+        printf("Not GD format.\n");
+        return 0;
+    }
+    memset(dst, 0, dstSize);
+
+    //block type 1
+    int i=3, o=0;
+    copy_block(dst+o, src+i, 0x38);
+    i += 0x38+2;        //block + dummy crc
+    o += 0x38+3+GAP;    //gap end + block + crc + gap
+
+    //block type 2
+    copy_block(dst+o, src+i, 2);
+    i += 2+2;
+    o += 2+3+GAP;
+
+    //block type 3+4...
+    while(src[i]==3) {
+        int size = (src[i+13] | (src[i+14]<<8))+1;
+        if(o + 16+3 + GAP + size+3 > dstSize) {    //end + block3 + crc + gap + end + block4 + crc
+            printf("Out of space (%d bytes short), adjust GAP size?\n",(o + 16+3 + GAP + size+3)-dstSize);
+            return 0;
+        }
+        copy_block(dst+o, src+i, 16);
+        i+=16+2;
+        o+=16+3+GAP;
+
+        copy_block(dst+o, src+i, size);
+        i+=size+2;
+        o+=size+3+GAP;
+    }
+    return o;
+}
+
+//look for pattern of bits matching block 1, in the first 0x2000*8 pulses of rawSize
+template<class RAW> static int findFirstBlock(RAW raw, int rawSize) {
+    static const uint8_t dat[]={1,0,1,0,0,0,0,0, 0,1,2,2,1,0,1,0, 0,1,1,2,1,1,1,1, 1,1,0,0,1,1,1,0};
+    int i,len;
+    int limit=rawSize<0x2000*8? rawSize: 0x2000*8;
+    for(i=0, len=0; i<limit; i++) {
+        if(raw[i]==dat[len]) {
+            if(len==sizeof(dat)-1)
+                return i-len;
+            len++;
+        } else {
+            i-=len;
+            len=0;
+        }
+    }
+    return -1;
+}
+
+//src is a raw03 byte array or a packedRaw03
+//badCrc (optional) is set when the block decoded but its CRC didn't match
+template<class RAW> bool block_decode(uint8_t *dst, RAW src, int *inP, int *outP, int srcSize, int dstSize, int blockSize, char blockType, bool *badCrc=NULL) {
+    if(*outP+blockSize+2 > dstSize) {
+        printf("Out of space\n");
+        return false;
+    }
+
+    int in=*inP;
+    int outEnd=(*outP+blockSize+2)*8;
+    int out=(*outP)*8;
+    int start;
+
+    //scan for gap end
+    for(int zeros=0; src[in]!=1 || zeros<MIN_GAP_SIZE; in++) {
+        if(src[in]==0) {
+            zeros++;
+        } else {
+            zeros=0;
+        }
+        if(in>=srcSize-2)
+            return false;
+    }
+    start=in;
+
+    char bitval=1;
+    in++;
+    do {
+        if(in>=srcSize) {   //not necessarily an error, probably garbage at end of disk
+            //printf("Disk end\n"); 
+            return false;
+        }
+        switch(src[in]|(bitval<<4)) {
+            case 0x11:
+                out++;
+            case 0x00:
+                out++;
+                bitval=0;
+                break;
+            case 0x12:
+                out++;
+            case 0x01:
+            case 0x10:
+                dst[out/8] |= 1<<(out&7);
+                out++;
+                bitval=1;
+                break;
+            default: //Unexpected value.  Keep going, we'll probably get a CRC warning
+                //printf("glitch(%d) @ %X(%X.%d)\n", src[in], in, out/8, out%8);
+                out++;
+                bitval=0;
+                break;
+        }
+        in++;
+    } while(out<outEnd);
+    if(dst[*outP] !=blockType) {
+        printf("Wrong block type %X(%X)-%X(%X) (found %d, expected %d)\n", start, *outP, in, out-1, dst[*outP], blockType);
+        return false;
+    }
+    out=out/8-2;
+
+    //printf("Out%d %X(%X)-%X(%X)\n", blockType, start, *outP, in, out-1);
+
+    if(calc_crc(dst+*outP,blockSize+2)) {
+        uint16_t crc1=(dst[out+1]<<8)|dst[out];
+        dst[out]=0;
+        dst[out+1]=0;
+        uint16_t crc2=calc_crc(dst+*outP,blockSize+2);
+        printf("Bad CRC (%04X!=%04X)\n", crc1, crc2);
+        if(badCrc)
+            *badCrc=true;
+    }
+
+    dst[out]=0;     //clear CRC
+    dst[out+1]=0;
+    dst[out+2]=0;   //+spare bit
+    *inP=in;
+    *outP=out;
+    return true;
+}
+
+__inline uint8_t raw_to_raw03_byte(uint8_t raw)
+{
+	if (raw < RAW03_T0)
+		return(3);
+	else if (raw < RAW03_T1)
+		return(0);
+	else if (raw < RAW03_T2)
+		return(1);
+	else if (raw < RAW03_T3)
+		return(2);
+	return(3);
+}
+
+//Turn raw data from adapter to pulse widths (0..3)
+//Input capture clock is 6MHz.  At 96.4kHz (FDS bitrate), 1 bit ~= 62 clocks
+//We could be clever about this and account for drive speed fluctuations, etc. but this will do for now
+static void raw_to_raw03(uint8_t *raw, int rawSize) {
+    for(int i=0; i<rawSize; ++i) {
+		 raw[i] = raw_to_raw03_byte(raw[i]);
+    }
+}
+
+//block_decode, plus a check against the capture's gap list.  A block that was read across lost
+//data is reported and counted in *bad, the caller decides what to do with its contents.
+template<class RAW> static bool gap_block_decode(uint8_t *fds, RAW raw, int *in, int *out, int rawsize, int blockSize, char blockType,
+                             const captureGap *gaps, int gapCount, int *bad, bool *badCrc=NULL) {
+    int start=*in;
+    bool ok=block_decode(fds, raw, in, out, rawsize, FDSSIZE+2, blockSize, blockType, badCrc);
+    //a failed block has no known end, assume the longest it could have been (every bit a pulse)
+    int end=ok? *in: start+(GAP+blockSize+3)*8*2;
+    for(int i=0; i<gapCount; i++) {
+        if(gaps[i].pos<end && gaps[i].pos+gaps[i].size>start) {
+            printf("Block type %d at %X overlaps lost data (%X, ~%d bytes)\n", blockType, start, gaps[i].pos, gaps[i].size);
+            (*bad)++;
+            break;
+        }
+    }
+    return ok;
+}
+
+//Simplified disk decoding.  This assumes disk will follow standard FDS file structure
+//gaps: holes in the capture (see FDS_readDisk), blocks overlapping them are counted in *badBlocks
+template<class RAW> static bool raw03_to_fds(RAW raw, uint8_t *fds, int rawsize, const captureGap *gaps=NULL, int gapCount=0, int *badBlocks=NULL) {
+    int in,out;
+    int bad=0;
+
+    if(!badBlocks)
+        badBlocks=&bad;
+    memset(fds,0,FDSSIZE);
+
+    //lead-in can vary a lot depending on drive, scan for first block to get our bearings
+    in=findFirstBlock(raw, rawsize)-MIN_GAP_SIZE;
+    if(in<0)
+        return false;
+
+    out=0;
+    if(!gap_block_decode(fds, raw, &in, &out, rawsize, 0x38, 1, gaps, gapCount, badBlocks))
+        return false;
+    if(!gap_block_decode(fds, raw, &in, &out, rawsize, 2, 2, gaps, gapCount, badBlocks))
+        return false;
+    do {
+        if(!gap_block_decode(fds, raw, &in, &out, rawsize, 16, 3, gaps, gapCount, badBlocks))
+            return true;
+        if(!gap_block_decode(fds, raw, &in, &out, rawsize, 1+(fds[out-16+13] | (fds[out-16+14]<<8)), 4, gaps, gapCount, badBlocks))
+            return true;
+    } while(in<rawsize);
+    return true;
+}
+
+typedef void (*captureFunc)(uint8_t *buf, int from, int to, void *arg);
+
+//Capture one disk side into buf.  Lost packets don't end the read:  each hole is padded with filler
+//of about the same size (raw 0, decodes as a glitch) and recorded so the decoder can fail just the
+//blocks that overlap it.  fresh (optional) sees every new range as it comes in.
+//Returns the number of bytes captured, -1 on a read error.
+static int captureSide(uint8_t *buf, int bufSize, captureGap *gaps, int *gapCount, int maxGaps, captureStats *stats,
+                       captureFunc fresh, void *arg) {
+    capturePacket *pkt;
+    bool readError=false;
+    int bytesIn=0;
+    int packetSize=dev_limits()->diskRead;
+
+    *gapCount=0;
+    capture *cap=capture_start(bufSize);
+    if(!cap)
+        return -1;
+    while((pkt=capture_next(cap))) {
+        int from=bytesIn;
+        if(pkt->size<0) {
+            readError=true;
+            capture_release(cap);
+            break;
+        }
+        if(pkt->lost) {
+            int size=pkt->lost*packetSize;
+            if(size>bufSize-packetSize-bytesIn)
+                size=bufSize-packetSize-bytesIn;
+            if(*gapCount<maxGaps) {
+                gaps[*gapCount].pos=bytesIn;
+                gaps[*gapCount].size=size;
+                (*gapCount)++;
+            } else if(*gapCount) {      //out of room, stretch the last hole over this one (and the data between)
+                captureGap *last=&gaps[*gapCount-1];
+                last->size=bytesIn+size-last->pos;
+            }
+            memset(buf+bytesIn, 0, size);
+            bytesIn+=size;
+        }
+        memcpy(buf+bytesIn, pkt->data, pkt->size);
+        bytesIn+=pkt->size;
+        capture_release(cap);
+        if(fresh)
+            fresh(buf, from, bytesIn, arg);
+        if(!(bytesIn%(packetSize*32))) {
+            printf(".");
+            os_progress(bytesIn, bufSize);
+        }
+        if(bytesIn>=bufSize-packetSize)
+            break;
+    }
+    printf("\n");
+    capture_stop(cap, stats);
+    capture_printStats(stats);
+    if(readError) {
+        printf("Read error.\n");
+        return -1;
+    }
+    for(int i=0; i<*gapCount; i++)
+        printf("Lost data at %X (~%d bytes)\n", gaps[i].pos, gaps[i].size);
+    return bytesIn;
+}
+
+// TODO - only handles one side, files will need to be joined manually
+bool FDS_readDisk(char *filename_raw, char *filename_bin, char *filename_fds) {
+    enum { READBUFSIZE=0x90000, MAXGAPS=64 };
+
+    FILE *f;
+    uint8_t *readBuf=NULL;
+    captureStats stats;
+    captureGap gaps[MAXGAPS];
+    int gapCount=0;
+    bool ok=true;
+    int bytesIn;
+
+    int io=dev_readIO();
+    if(io>=0 && !(io&MEDIA_SET)) {
+        printf("Warning - Disk not inserted?\n");
+    }
+    readBuf=(uint8_t*)malloc(READBUFSIZE);
+    bytesIn=captureSide(readBuf, READBUFSIZE, gaps, &gapCount, MAXGAPS, &stats, NULL, NULL);
+    if(bytesIn<0) {
+        free(readBuf);
+        return false;
+    }
+
+    if(filename_raw && !raw03_isPacked(filename_raw)) {
+        if( (f=os_openOutput(filename_raw)) ) {
+            fwrite(readBuf, 1, bytesIn, f);
+            os_closeOutput(f);
+            printf("Wrote %s\n",filename_raw);
+        }
+    }
+
+    raw_to_raw03(readBuf, bytesIn);
+
+    //.r03 is stored after classification
+    if(filename_raw && raw03_isPacked(filename_raw))
+        raw03_save(filename_raw, readBuf, bytesIn, gaps, gapCount, stats.dropped, true);
+
+    //decode to .fds
+    if(filename_fds) {
+        int badBlocks=0;
+        uint8_t *fds=(uint8_t*)malloc(FDSSIZE+16);   //extra room for CRC junk
+        raw03_to_fds(readBuf, fds, bytesIn, gaps, gapCount, &badBlocks);
+        if( (f=os_openOutput(filename_fds)) ) {
+            fwrite(fds, 1, FDSSIZE, f);
+            os_closeOutput(f);
+            printf("Wrote %s\n",filename_fds);
+        }
+        free(fds);
+        if(badBlocks) {
+            printf("%d block(s) overlap lost data, re-read the disk to recover them.\n", badBlocks);
+            ok=false;
+        }
+
+    //decode to .bin
+    } else if(filename_bin) {
+        uint8_t *binBuf;
+        int binSize;
+
+        raw03_to_bin(readBuf, bytesIn, &binBuf, &binSize);
+        if( (f=os_openOutput(filename_bin)) ) {
+            fwrite(binBuf, 1, binSize, f);
+            os_closeOutput(f);
+            printf("Wrote %s\n", filename_bin);
+        }
+        free(binBuf);
+        if(gapCount) {      //no per-block check here, anything could be in the holes
+            printf("Capture has %d hole(s) of lost data, re-read the disk.\n", gapCount);
+            ok=false;
+        }
+    }
+
+    free(readBuf);
+    return ok;
+}
+
+//---- read-after-write check
+
+enum { MAXVERIFYBLOCKS=2+2*256 };
+
+struct verifyBlock {
+    int pos, size;              //in the .fds side (decoded blocks land at the same place)
+    char type;
+    bool decoded, badCrc;
+};
+
+//Decodes a side while it's being captured and compares it with the source, block by block
+struct sideCheck {
+    const uint8_t *src;
+    uint8_t *fds;
+    verifyBlock blocks[MAXVERIFYBLOCKS];
+    int count;
+    int next;                   //block to decode next
+    int in, out;
+    bool started, failed;
+    const captureGap *gaps;
+    const int *gapCount;
+    int badBlocks;
+};
+
+//Block list of a .fds side:  disk info, file count, then header+data for each file
+static int listBlocks(const uint8_t *src, verifyBlock *blocks) {
+    int count=0, pos=0x38+2;
+
+    blocks[count++]={ 0, 0x38, 1 };
+    blocks[count++]={ 0x38, 2, 2 };
+    while(count+2<=MAXVERIFYBLOCKS && pos+16+1<=FDSSIZE && src[pos]==3 && src[pos+16]==4) {
+        int size=src[pos+13] | (src[pos+14]<<8);
+        if(pos+16+1+size>FDSSIZE)
+            break;
+        blocks[count++]={ pos, 16, 3 };
+        blocks[count++]={ pos+16, 1+size, 4 };
+        pos+=16+1+size;
+    }
+    for(int i=0; i<count; i++)
+        blocks[i].decoded=blocks[i].badCrc=false;
+    return count;
+}
+
+//Decode whatever blocks are complete in raw[0..avail).  A block isn't tried until the capture is past
+//the furthest it could end, so a decode never fails for lack of data until the read is over.
+static void checkBlocks(sideCheck *c, uint8_t *raw, int avail, bool final) {
+    if(c->failed)
+        return;
+    if(!c->started) {
+        if(!final && avail<0x2000*8+dev_limits()->diskRead)     //findFirstBlock's search range
+            return;
+        c->in=findFirstBlock(raw, avail)-MIN_GAP_SIZE;
+        if(c->in<0) {
+            printf("Disk header not found\n");
+            c->failed=true;
+            return;
+        }
+        c->out=0;
+        c->started=true;
+    }
+    while(c->next<c->count) {
+        verifyBlock *b=&c->blocks[c->next];
+        if(!final && c->in+(2*GAP+b->size+3)*8*2>avail)
+            break;
+        if(c->out!=b->pos || !gap_block_decode(c->fds, raw, &c->in, &c->out, avail, b->size, b->type, c->gaps, *c->gapCount, &c->badBlocks, &b->badCrc)) {
+            c->failed=true;
+            break;
+        }
+        b->decoded=true;
+        c->next++;
+    }
+}
+
+static void checkFresh(uint8_t *buf, int from, int to, void *arg) {
+    raw_to_raw03(buf+from, to-from);
+    checkBlocks((sideCheck*)arg, buf, to, false);
+}
+
+static bool blockMatches(const sideCheck *c, const verifyBlock *b) {
+    return b->decoded && !b->badCrc && !memcmp(c->fds+b->pos, c->src+b->pos, b->size);
+}
+
+//Read back a side that was just written and compare it with the .fds side it came from
+static bool verifyDiskSide(const uint8_t *src, int side) {
+    enum { READBUFSIZE=0x90000, MAXGAPS=64 };
+
+    captureStats stats;
+    captureGap gaps[MAXGAPS];
+    int gapCount=0;
+    sideCheck *c=(sideCheck*)calloc(1, sizeof(sideCheck));
+    uint8_t *readBuf=(uint8_t*)calloc(1, READBUFSIZE);     //findFirstBlock can look past a short capture
+
+    c->src=src;
+    c->fds=(uint8_t*)calloc(1, FDSSIZE+16);                 //extra room for CRC junk
+    c->count=listBlocks(src, c->blocks);
+    c->gaps=gaps;
+    c->gapCount=&gapCount;
+
+    printf("Verifying side %d\n", side);
+    uint32_t start=getTicks();
+    int bytesIn=captureSide(readBuf, READBUFSIZE, gaps, &gapCount, MAXGAPS, &stats, checkFresh, c);
+    uint32_t captureMs=getTicks()-start;
+    bool ok=bytesIn>=0;
+    if(ok) {
+        checkBlocks(c, readBuf, bytesIn, true);
+
+        int files=(c->count-2)/2, goodFiles=0;
+        bool header=blockMatches(c, &c->blocks[0]) && blockMatches(c, &c->blocks[1]);
+        printf("  disk info   %s\n", header? "ok": c->blocks[0].badCrc || c->blocks[1].badCrc? "bad CRC":
+                                          c->blocks[1].decoded? "MISMATCH": "not found");
+        for(int i=0; i<files; i++) {
+            const verifyBlock *h=&c->blocks[2+i*2], *d=h+1;
+            bool good=blockMatches(c, h) && blockMatches(c, d);
+            printf("  file %3d %-8.8s  %s\n", i, (const char*)src+h->pos+3, good? "ok":
+                   h->badCrc || d->badCrc? "bad CRC": d->decoded? "MISMATCH": "not found");
+            goodFiles+=good;
+        }
+        ok=header && goodFiles==files;
+        printf("Side %d %s:  %d of %d file(s) ok, read %u ms, decode after read %u ms\n", side, ok? "verified": "FAILED",
+               goodFiles, files, captureMs, getTicks()-start-captureMs);
+        if(c->badBlocks)
+            printf("%d block(s) overlap lost data, the read may be at fault rather than the disk.\n", c->badBlocks);
+    }
+
+    free(c->fds);
+    free(c);
+    free(readBuf);
+    return ok;
+}
+
+static bool writeDisk(uint8_t *bin, int binSize) {
+    static const uint8_t expand[]={ 0xaa, 0xa9, 0xa6, 0xa5, 0x9a, 0x99, 0x96, 0x95, 0x6a, 0x69, 0x66, 0x65, 0x5a, 0x59, 0x56, 0x55 };
+    int bytesOut;
+    bool fail=false;
+
+    //if(!(readIO()&MEDIA_SET)) {
+    //    printf("Disk not inserted.\n");
+    //}
+    if(!dev_writeStart())
+        return false;
+
+    //expand to mfm for writing
+    int packetSize=dev_limits()->diskWrite;
+    uint8_t *mfm=(uint8_t*)malloc(binSize*2 + packetSize);
+    for(int i=0; i<binSize; i++) {
+        mfm[i*2 + 0]=expand[bin[i]&0x0f];
+        mfm[i*2 + 1]=expand[(bin[i]>>4)&0x0f];
+    }
+    memset(mfm+binSize*2, 0xAA, packetSize); //zero out last packet
+
+    for(bytesOut=0; bytesOut<binSize*2; bytesOut+=packetSize) {
+        if(!dev_writeDisk(mfm+bytesOut, packetSize)) {
+            printf("Write error (disk full?)\n");
+            fail=true;
+            break;
+        }
+        if(!(bytesOut%(packetSize*16))) {
+            printf("#");
+            os_progress(bytesOut, binSize*2);
+        }
+    }
+
+    if(!fail) {
+        //Fill remainder with empty space.   Keep writing until we can't, EP0 will stall at end of disk
+        memset(mfm, 0xaa, packetSize);
+        for(bytesOut=0; bytesOut<0x20000; bytesOut+=packetSize) {
+            if(!dev_writeDisk(mfm, packetSize))
+                break;
+            if(!(bytesOut%(packetSize*16)))
+                printf(".");
+        }
+    }
+
+    free(mfm);
+    return !fail;
+}
+
+void hexdump(char*, void*, int);
+
+//Stage a side in the adapter's SRAM and start the disk write from it
+static bool writeDisk2(sramShadow *shadow, uint8_t *bin, int binSize, uint32_t *sent) {
+	if (!spi_stageSram(shadow, bin, binSize, sent))
+		return false;
+
+	if (!dev_writeStart())
+		return false;
+
+	return(true);
+
+}
+
+//Drive status polling for unattended writes.  Returns false on timeout or a device error.
+static bool waitIO(int mask, int want, uint32_t timeoutMs) {
+	enum { POLL_MS = 50 };
+	uint32_t start = getTicks();
+	int io, last = -1;
+
+	while ((io = dev_readIO()) >= 0) {
+		if (dev_verbose && io != last)		//to check the bit layout in device.h against the drive
+			printf("Drive lines %02X\n", io);
+		last = io;
+		if ((io & mask) == want)
+			return true;
+		if (getTicks() - start >= timeoutMs)
+			return false;
+		sleep_ms(POLL_MS);
+	}
+	return false;
+}
+
+//The drive raises READY once the head reaches the start of the disk and drops it at the end of the pass
+static bool waitWriteDone() {
+	enum { START_TIMEOUT = 10000, WRITE_TIMEOUT = 30000 };
+
+	if (!waitIO(READY, READY, START_TIMEOUT)) {
+		printf("Drive didn't start writing\n");
+		return false;
+	}
+	if (!waitIO(READY, 0, WRITE_TIMEOUT)) {
+		printf("Drive didn't finish writing\n");
+		return false;
+	}
+	return true;
+}
+
+//Waits for the current disk to come out (if one is in) and the next one to go in
+static bool waitDiskSwap(bool eject) {
+	enum { SWAP_TIMEOUT = 300000, SETTLE_MS = 1000 };
+
+	if (eject && !waitIO(MEDIA_SET, 0, SWAP_TIMEOUT)) {
+		printf("Disk wasn't removed\n");
+		return false;
+	}
+	if (!waitIO(MEDIA_SET, MEDIA_SET, SWAP_TIMEOUT)) {
+		printf("No disk inserted\n");
+		return false;
+	}
+	sleep_ms(SETTLE_MS);      //let the drive spin up before the write starts
+	int io = dev_readIO();
+	if (io >= 0 && !(io & WRITABLE)) {
+		printf("Disk is write protected\n");
+		return false;
+	}
+	return io >= 0;
+}
+
+//autoSwap:  don't prompt between sides, follow the drive's status lines instead (unattended)
+//verify:  read each side back once the drive is done with it and compare it with the source
+bool FDS_writeDisk(char *filename, bool autoSwap, bool verify) {
+	enum {
+		LEAD_IN = DEFAULT_LEAD_IN / 8,
+		DISKSIZE = 0x11000,               //whole disk contents including lead-in
+	};
+
+	mappedFile in;
+	const uint8_t *inbuf;     //.FDS file
+	uint8_t *bin = 0;         //.FDS with gaps/CRC
+	sramShadow *shadow = 0;   //what's in SRAM, only changes are uploaded
+	int filesize;
+	int binSize;
+	int badSides = 0;
+	bool ok = false;
+
+	if (!os_mapFile(filename, &in))
+	{
+		printf("Can't read %s\n", filename); return false;
+	}
+	inbuf = in.data;
+	filesize = (int)in.size;
+
+	bin = (uint8_t*)malloc(DISKSIZE);
+	shadow = (sramShadow*)malloc(sizeof(sramShadow));
+	shadow->valid = false;
+
+	int inpos = 0, side = 0;
+	if (inbuf[0] == 'F')
+		inpos = 16;      //skip fwNES header
+
+	filesize -= (filesize - inpos) % FDSSIZE;  //truncate down to whole disk
+	if (filesize <= inpos) {
+		printf("%s is too small for a disk side\n", filename);
+		free(bin);
+		free(shadow);
+		os_unmapFile(&in);
+		return false;
+	}
+
+	uint32_t start = getTicks(), swapMs = 0;
+	if (autoSwap) {
+		int io = dev_readIO();
+		if (io < 0) {
+			printf("Can't read drive status\n");
+		}
+		else if (!(io & MEDIA_SET)) {
+			printf("Insert disk\n");
+			ok = waitDiskSwap(false);
+		}
+		else if (!(io & WRITABLE)) {
+			printf("Disk is write protected\n");
+		}
+		else {
+			ok = true;
+		}
+		swapMs = getTicks() - start;
+		if (!ok) {
+			free(bin);
+			free(shadow);
+			os_unmapFile(&in);
+			return false;
+		}
+	}
+
+	char prompt;
+	do {
+		uint32_t sideStart = getTicks(), uploadMs, writeMs, sent;
+
+		ok = false;
+		printf("Side %d\n", side + 1);
+
+		memset(bin, 0, LEAD_IN);
+		binSize = fds_to_bin(bin + LEAD_IN, inbuf + inpos, DISKSIZE - LEAD_IN);
+		if (!binSize)
+			break;
+		if (!writeDisk2(shadow, bin, binSize + LEAD_IN, &sent))
+			break;
+		uploadMs = getTicks() - sideStart;
+		inpos += FDSSIZE;
+		side++;
+
+//		printf("finished write, inpos = %d, filesize = %d, inbuf[inpos] = %X", inpos, filesize, inbuf[inpos]);
+		prompt = 0;
+		if (autoSwap || verify) {
+			if (!waitWriteDone())
+				break;
+			writeMs = getTicks() - sideStart - uploadMs;
+			printf("Side %d: upload %u ms (%u bytes), write %u ms", side, uploadMs, sent, writeMs);
+			if (swapMs)
+				printf(", disk change %u ms", swapMs);
+			printf("\n");
+			if (verify && !verifyDiskSide(inbuf + inpos - FDSSIZE, side))
+				badSides++;
+		}
+		ok = true;
+		if (autoSwap) {
+			if (inpos<filesize && inbuf[inpos] == 0x01) {
+				printf("Eject the disk and insert side %d\n", side + 1);
+				uint32_t swapStart = getTicks();
+				if (!waitDiskSwap(true)) {
+					ok = false;
+					break;
+				}
+				swapMs = getTicks() - swapStart;
+				prompt = 0x0d;
+			}
+			continue;
+		}
+
+		if (!verify)
+			printf("Side %d: upload %u ms (%u bytes)\n", side, uploadMs, sent);
+		//prompt for disk change
+		if (inpos<filesize && inbuf[inpos] == 0x01) {
+			if (verify)
+				printf("\nInsert the next disk side and press ENTER.\n");
+			else
+				printf("\nPlease wait for disk activity to stop before pressing ENTER to write the next disk side.\n");
+			prompt = readKb();
+		}
+		else if (!verify) {
+			printf("\nDisk image sent to SRAM on device and is currently writing.\nPlease wait for disk activity to stop before removing disk.\n");
+		}
+	} while (prompt == 0x0d);
+	if ((autoSwap || verify) && ok)
+		printf("%d side(s) written in %u ms\n", side, getTicks() - start);
+	if (badSides)
+		printf("%d side(s) failed verification\n", badSides);
+
+	free(bin);
+	free(shadow);
+	os_unmapFile(&in);
+	return ok && !badSides;
+}
+
+/*bool FDS_writeDisk(char *filename) {
+	enum {
+		LEAD_IN = DEFAULT_LEAD_IN / 8,
+		DISKSIZE = 0x11000,               //whole disk contents including lead-in
+	};
+
+	uint8_t *inbuf = 0;       //.FDS buffer
+	uint8_t *bin = 0;         //.FDS with gaps/CRC
+	int filesize;
+	int binSize;
+
+	if (!loadFile(filename, &inbuf, &filesize))
+	{
+		printf("Can't read %s\n", filename); return false;
+	}
+
+	bin = (uint8_t*)malloc(DISKSIZE);
+
+	int inpos = 0, side = 0;
+	if (inbuf[0] == 'F')
+		inpos = 16;      //skip fwNES header
+
+	filesize -= (filesize - inpos) % FDSSIZE;  //truncate down to whole disk
+
+	char prompt;
+	do {
+		printf("Side %d\n", side + 1);
+
+		memset(bin, 0, LEAD_IN);
+		binSize = fds_to_bin(bin + LEAD_IN, inbuf + inpos, DISKSIZE - LEAD_IN);
+		if (!binSize)
+			break;
+		if (!writeDisk(bin, binSize + LEAD_IN))
+			break;
+		inpos += FDSSIZE;
+		side++;
+
+		//prompt for disk change
+		prompt = 0;
+		if (inpos<filesize && inbuf[inpos] == 0x01) {
+			printf("Push ENTER for next disk side\n");
+			prompt = readKb();
+		}
+	} while (prompt == 0x0d);
+
+	free(bin);
+	free(inbuf);
+	return true;
+}*/
+
+uint32_t chksum_calc(uint8_t *buf, int size)
+{
+	uint32_t ret = 0;
+	uint32_t *data = (uint32_t*)buf;
+	int i;
+
+	for (i = 0; i < size / 4; i++) {
+		ret ^= buf[i];
+	}
+	return(ret);
+}
+
+static uint32_t slotHash(const uint8_t *slot) {
+    uint32_t hash=2166136261u;
+    for(int i=FLASHHEADERSIZE; i<SLOTSIZE; i++)
+        hash=(hash^slot[i])*16777619u;
+    return hash? hash: 1;
+}
+
+//Build the flash image of one disk side:  header (name on the first side, checksum, lead-in) + bin.
+static bool makeSlot(uint8_t *outbuf, const uint8_t *src, int side, const char *filename) {
+    enum { FILENAMELENGTH=120, };   //number of characters including null
+
+    if(!fds_to_bin(outbuf+FLASHHEADERSIZE, src, SLOTSIZE-FLASHHEADERSIZE))
+        return false;
+    memset(outbuf,0,FLASHHEADERSIZE);
+			uint32_t chksum = chksum_calc(outbuf + FLASHHEADERSIZE, SLOTSIZE - FLASHHEADERSIZE);
+			outbuf[240] = (uint8_t)(chksum >> 0);
+			outbuf[241] = (uint8_t)(chksum >> 8);
+			outbuf[242] = (uint8_t)(chksum >> 16);
+			outbuf[243] = (uint8_t)(chksum >> 24);
+			outbuf[244] = DEFAULT_LEAD_IN & 0xff;
+    outbuf[245] = DEFAULT_LEAD_IN / 256;
+    uint32_t hash=slotHash(outbuf);
+    outbuf[HEADER_HASH+0]=(uint8_t)(hash >> 0);
+    outbuf[HEADER_HASH+1]=(uint8_t)(hash >> 8);
+    outbuf[HEADER_HASH+2]=(uint8_t)(hash >> 16);
+    outbuf[HEADER_HASH+3]=(uint8_t)(hash >> 24);
+
+    if(side==0) {
+        //strip path from filename
+        const char *shortName=strrchr(filename,'/');      // ...dir/file.fds
+#ifdef _WIN32
+        if(!shortName)
+            shortName=strrchr(filename,'\\');        // ...dir\file.fds
+        if(!shortName)
+            shortName=strchr(filename,':');         // C:file.fds
+#endif
+        if(!shortName)
+            shortName=filename;
+        else
+            shortName++;
+//        utf8_to_utf16((uint16_t*)outbuf, shortName, FILENAMELENGTH*2);
+//        ((uint16_t*)outbuf)[FILENAMELENGTH-1]=0;
+			 strncpy((char*)outbuf, shortName, 240);
+    }
+    return true;
+}
+
+//Append the slot images of one game to *buf (slots so far), returns the new slot count or -1
+static int appendGame(const char *filename, uint8_t **buf, int slots) {
+    mappedFile in;
+
+    if(!os_mapFile(filename, &in)) {
+        printf("Can't read %s\n", filename);
+        return -1;
+    }
+    int pos=0, side=0;
+    int filesize=(int)in.size;
+    if(in.data[0]=='F')
+        pos=16;      //skip fwNES header
+    filesize -= (filesize-pos)%FDSSIZE;  //truncate down to whole disks
+
+    for(; pos<filesize && in.data[pos]==0x01; pos+=FDSSIZE, side++) {
+        *buf=(uint8_t*)realloc(*buf, (slots+1)*SLOTSIZE);
+        if(!makeSlot(*buf+slots*SLOTSIZE, in.data+pos, side, filename)) {
+            printf("%s: side %d doesn't convert\n", filename, side+1);
+            os_unmapFile(&in);
+            return -1;
+        }
+        slots++;
+    }
+    os_unmapFile(&in);
+    if(!side) {
+        printf("%s isn't a disk image\n", filename);
+        return -1;
+    }
+    return slots;
+}
+
+//slot 1..n.  All sides go out as one journaled write, so an interrupted one can be resumed.
+bool FDS_writeFlash(char *filename, int slot, bool resume) {
+    uint8_t *image=NULL;
+    int slots;
+    bool result;
+
+    if((slots=appendGame(filename, &image, 0))<0) {
+        free(image);
+        return false;
+    }
+    if(slot+slots>dev_slots) {
+        printf("%d side(s) at slot %d don't fit\n", slots, slot);
+        free(image);
+        return false;
+    }
+    printf("Writing %d side(s)\n", slots);
+    result=spi_writeJournaled(image, slot*SLOTSIZE, slots*SLOTSIZE, resume);
+    free(image);
+    return result;
+}
+
+//Slot images for a list of games, back to back from slot 1, same as writing each with FDS_writeFlash.
+//Returns the number of slots (0 on error), *image is malloc'd.
+int FDS_makeImage(char **files, int count, uint8_t **image) {
+    uint8_t *buf=NULL;
+    int slots=0;
+
+    for(int i=0; i<count; i++) {
+        if((slots=appendGame(files[i], &buf, slots))<0) {
+            free(buf);
+            return 0;
+        }
+    }
+    *image=buf;
+    return slots;
+}
+
+//Compare flash against what FDS_writeFlash would write.  slot 1..n
+bool FDS_verifyFlash(char *filename, int slot) {
+    mappedFile in;
+    const uint8_t *inbuf;
+    uint8_t *expect, *actual;
+    int filesize;
+    bool result=true;
+
+    if(!os_mapFile(filename, &in))
+        { printf("Can't read %s\n",filename); return false; }
+    inbuf=in.data;
+    filesize=(int)in.size;
+
+    expect=(uint8_t*)malloc(SLOTSIZE);
+    actual=(uint8_t*)malloc(SLOTSIZE);
+
+    int pos=0, side=0;
+    if(inbuf[0]=='F')
+        pos=16;      //skip fwNES header
+
+    filesize -= (filesize-pos)%FDSSIZE;  //truncate down to whole disks
+
+    while(pos<filesize && inbuf[pos]==0x01) {
+        if(slot+side>=dev_slots) {
+            printf("Side %d: past end of flash\n", side+1);
+            result=false;
+            break;
+        }
+        if(makeSlot(expect, inbuf+pos, side, filename)) {
+            if(!spi_readFlash((slot+side)*SLOTSIZE, actual, SLOTSIZE)) {
+                result=false;
+                break;
+            }
+            int i;
+            for(i=0; i<SLOTSIZE && expect[i]==actual[i]; i++)
+                { }
+            if(i<SLOTSIZE) {
+                printf("Side %d: differs at %X\n", side+1, (slot+side)*SLOTSIZE+i);
+                result=false;
+            } else {
+                printf("Side %d: ok\n", side+1);
+            }
+        } else {
+            printf("Side %d: doesn't convert\n", side+1);
+            result=false;
+        }
+        pos+=FDSSIZE;
+        side++;
+    }
+    os_unmapFile(&in);
+    free(actual);
+    free(expect);
+    return result;
+}
+
+//---- sync
+
+struct fileList {
+    const char *dir;
+    char **names;
+    int count;
+};
+
+static void addDiskFile(const char *name, void *arg) {
+    fileList *list=(fileList*)arg;
+    const char *ext=strrchr(name, '.');
+    if(!ext || tolower(ext[1])!='f' || tolower(ext[2])!='d' || tolower(ext[3])!='s' || ext[4])
+        return;
+    char *path=(char*)malloc(strlen(list->dir)+strlen(name)+2);
+    sprintf(path, "%s/%s", list->dir, name);
+    list->names=(char**)realloc(list->names, (list->count+1)*sizeof(char*));
+    list->names[list->count++]=path;
+}
+
+static int compareNames(const void *a, const void *b) {
+    return strcmp(*(char**)a, *(char**)b);
+}
+
+struct syncGame {
+    uint8_t *image;
+    int sides;
+    int slot;       //where it ends up, 0=not placed yet
+    int oldSlot;    //a game by the same name is already here
+};
+
+static void prepareGames(const fileList *files, syncGame *games) {
+    for(int i=0; i<files->count; i++) {
+        games[i].sides=appendGame(files->names[i], &games[i].image, 0);
+        if(games[i].sides<0)
+            break;
+    }
+}
+
+//Does the slot already hold this image?  The header hash stands for the data, so slots written before
+//it existed never match and get rewritten once, with the hash.
+static bool slotMatches(const uint8_t *header, const uint8_t *image) {
+    return !memcmp(header, image, FLASHHEADERSIZE);
+}
+
+struct layoutCounts {
+    int wrote, skipped, erased;
+};
+
+//Write the sides that differ from what the flash holds (games[].slot says where), then erase the
+//occupied slots no game uses
+static bool applyLayout(const syncGame *games, char **names, int count, uint8_t (*headers)[FLASHHEADERSIZE],
+                        const uint8_t *used, bool dryRun, layoutCounts *n) {
+    bool ok=true;
+    for(int i=0; i<count && ok; i++) {
+        const syncGame *g=&games[i];
+        for(int side=0; side<g->sides && ok; side++) {
+            int slot=g->slot+side;
+            if(slotMatches(headers[slot], g->image+side*SLOTSIZE)) {
+                n->skipped++;
+                continue;
+            }
+            if(side)
+                printf("%d:    Side %d\n", slot, side+1);
+            else
+                printf("%d: %s\n", slot, names[i]);
+            n->wrote++;
+            if(!dryRun)
+                ok=spi_writeFlash(g->image+side*SLOTSIZE, slot*SLOTSIZE, SLOTSIZE);
+        }
+    }
+    for(int slot=1; slot<dev_slots && ok; slot++) {
+        if(used[slot] || headers[slot][0]==0xff)
+            continue;
+        printf("%d: erase\n", slot);
+        n->erased++;
+        if(!dryRun)
+            ok=spi_erasePage(slot*SLOTSIZE);
+    }
+    return ok;
+}
+
+/*
+Make the flash hold exactly the .fds files in dir.  Games already on the stick stay where they are,
+slots of games that are gone get erased, new or changed games go into the first free run that fits
+(their old place first), and a side that already holds the right data isn't rewritten.
+An empty dir would erase everything, so that takes force.
+*/
+bool FDS_syncFlash(char *dir, bool dryRun, bool force) {
+    fileList files={dir, NULL, 0};
+    syncGame *games=NULL;
+    uint8_t (*headers)[FLASHHEADERSIZE]=NULL;
+    uint8_t *used=NULL;
+    layoutCounts counts={0, 0, 0};
+    int kept=0;
+    bool ok=false;
+    uint32_t start=getTicks();
+
+    do {
+        if(!os_listDir(dir, addDiskFile, &files))
+            { printf("Can't read %s\n", dir); break; }
+        qsort(files.names, files.count, sizeof(char*), compareNames);
+        if(!files.count && !force)
+            { printf("No .fds files in %s, use --force to erase every game\n", dir); break; }
+
+        //Build what should be there on a helper thread while the device reads what is there.
+        //Images for a big library take a while to map and convert, the header scan hides it.
+        games=(syncGame*)calloc(files.count+1, sizeof(syncGame));
+        std::thread prep(prepareGames, &files, games);
+
+        headers=(uint8_t(*)[FLASHHEADERSIZE])malloc(dev_slots*FLASHHEADERSIZE);
+        used=(uint8_t*)calloc(dev_slots, 1);
+        int i;
+        for(i=1; i<dev_slots; i++) {
+            if(!spi_readFlash(i*SLOTSIZE, headers[i], FLASHHEADERSIZE))
+                break;
+        }
+        prep.join();
+        if(i<dev_slots)
+            break;
+
+        int total=0;
+        for(i=0; i<files.count && games[i].sides>=0; i++)
+            total+=games[i].sides;
+        if(i<files.count)
+            break;
+        if(total>dev_slots-1)
+            { printf("%d sides don't fit in %d slots\n", total, dev_slots-1); break; }
+
+        //keep games that are already in place
+        for(i=0; i<files.count; i++) {
+            syncGame *g=&games[i];
+            for(int slot=1; slot+g->sides<=dev_slots; slot++) {
+                if(headers[slot][0]==0 || headers[slot][0]==0xff || strncmp((char*)headers[slot], (char*)g->image, 240))
+                    continue;
+                g->oldSlot=slot;
+                int side;
+                for(side=0; side<g->sides && !used[slot+side]; side++) {
+                    if(!slotMatches(headers[slot+side], g->image+side*SLOTSIZE))
+                        break;
+                }
+                bool moreSides=(slot+side<dev_slots && headers[slot+side][0]==0);
+                if(side==g->sides && !moreSides) {
+                    g->slot=slot;
+                    memset(used+slot, 1, g->sides);
+                    kept++;
+                    break;
+                }
+            }
+        }
+
+        //place the rest, biggest first
+        int maxSides=0;
+        for(i=0; i<files.count; i++) {
+            if(games[i].sides>maxSides)
+                maxSides=games[i].sides;
+        }
+        bool placed=true;
+        for(int sides=maxSides; sides>0 && placed; sides--) {
+            for(i=0; i<files.count && placed; i++) {
+                syncGame *g=&games[i];
+                if(g->slot || g->sides!=sides)
+                    continue;
+                int slot=g->oldSlot;
+                if(slot && (slot+g->sides>dev_slots || memchr(used+slot, 1, g->sides)))
+                    slot=0;
+                for(int s=1; !slot && s+g->sides<=dev_slots; s++) {
+                    if(!memchr(used+s, 1, g->sides))
+                        slot=s;
+                }
+                if(!slot) {
+                    printf("No room for %s (%d sides), defragment first\n", files.names[i], g->sides);
+                    placed=false;
+                    break;
+                }
+                g->slot=slot;
+                memset(used+slot, 1, g->sides);
+            }
+        }
+        if(!placed)
+            break;
+
+        ok=applyLayout(games, files.names, files.count, headers, used, dryRun, &counts);
+    } while(0);
+
+    if(counts.wrote || counts.skipped || counts.erased) {
+        printf("%d game(s) kept in place, %d slot(s) %swritten, %d unchanged, %d erased, %u ms\n",
+            kept, counts.wrote, dryRun? "to be ": "", counts.skipped, counts.erased, getTicks()-start);
+    }
+    for(int i=0; i<files.count; i++) {
+        free(files.names[i]);
+        if(games)
+            free(games[i].image);
+    }
+    free(files.names);
+    free(games);
+    free(headers);
+    free(used);
+    return ok;
+}
+
+//---- defragment
+
+enum {
+    MAXSLOTS=256,               //16MB flash
+    ERASE_MS=400,               //64K block erase, typical
+};
+
+//One slot copy (or erase when src<0).  The journal holds the plan, the step in progress and the
+//slot being copied, so an interrupted defragment can pick up where it was.
+struct defragStep {
+    int16_t src, dst;
+};
+
+struct defragJournal {
+    char magic[4];              //"FDJ1"
+    int32_t flashSize;
+    int32_t steps, current;
+    defragStep step[MAXSLOTS*2];
+};
+
+static void journalPath(char *path, size_t size) {
+    char name[96];
+    sprintf(name, "defrag-%s.jnl", dev_serial[0]? dev_serial: "default");
+    if(!os_dataPath(name, path, size))
+        strcpy(path, "defrag.jnl");
+}
+
+static bool saveJournal(const defragJournal *j, const uint8_t *slot) {
+    char path[1024], tmp[1040];
+    journalPath(path, sizeof(path));
+    sprintf(tmp, "%s.tmp", path);
+    FILE *f=fopen(tmp, "wb");
+    if(!f)
+        return false;
+    bool ok=fwrite(j, sizeof(*j), 1, f)==1 && fwrite(slot, 1, SLOTSIZE, f)==SLOTSIZE;
+    ok&=!fclose(f);
+    remove(path);               //rename won't replace on Windows
+    return ok && !rename(tmp, path);
+}
+
+static bool loadJournal(defragJournal *j, uint8_t *slot) {
+    char path[1024];
+    journalPath(path, sizeof(path));
+    FILE *f=fopen(path, "rb");
+    if(!f)
+        return false;
+    bool ok=fread(j, sizeof(*j), 1, f)==1 && fread(slot, 1, SLOTSIZE, f)==SLOTSIZE;
+    fclose(f);
+    return ok && !memcmp(j->magic, "FDJ1", 4) && j->flashSize==dev_flashSize && j->current<j->steps;
+}
+
+static void removeJournal() {
+    char path[1024];
+    journalPath(path, sizeof(path));
+    remove(path);
+}
+
+struct defragGame {
+    int slot, sides;
+};
+
+/*
+Plan moves that pack the games from slot 1 up.  Games already inside the packed area stay put and
+the ones past it fill its holes, biggest first, so each moved slot is erased once and the sources
+survive until the tail is erased at the end.  A game's slots stay reserved until its copy is planned
+(one that straddles the end of the packed area has sources inside it), so nothing is written over
+before it's read.  When the holes are too fragmented for that, everything slides down in order instead.
+*/
+static int planDefrag(defragGame *games, int count, const uint8_t *occupied, defragStep *step) {
+    uint8_t used[MAXSLOTS];
+    int total=0, steps=0;
+
+    for(int i=0; i<count; i++)
+        total+=games[i].sides;
+
+    memset(used, 0, sizeof(used));
+    bool fits=true;
+    int maxSides=0;
+    for(int i=0; i<count; i++) {
+        memset(used+games[i].slot, 1, games[i].sides);
+        if(games[i].sides>maxSides)
+            maxSides=games[i].sides;
+    }
+    for(int sides=maxSides; sides>0 && fits; sides--) {
+        for(int i=0; i<count && fits; i++) {
+            defragGame *g=&games[i];
+            if(g->slot+g->sides-1<=total || g->sides!=sides)
+                continue;
+            int dst=0;
+            for(int s=1; !dst && s+g->sides-1<=total; s++) {
+                if(!memchr(used+s, 1, g->sides))
+                    dst=s;
+            }
+            if(!dst) {
+                fits=false;
+                break;
+            }
+            memset(used+dst, 1, g->sides);
+            for(int side=0; side<g->sides; side++) {
+                step[steps].src=g->slot+side;
+                step[steps++].dst=dst+side;
+            }
+            memset(used+g->slot, 0, g->sides);      //read by now, later copies can land there
+        }
+    }
+    if(!fits) {
+        //slide down:  copying in ascending order never overwrites a slot that's still to be read
+        steps=0;
+        int dst=1;
+        for(int i=0; i<count; i++) {
+            for(int side=0; side<games[i].sides; side++, dst++) {
+                if(games[i].slot+side!=dst) {
+                    step[steps].src=games[i].slot+side;
+                    step[steps++].dst=dst;
+                }
+            }
+        }
+    }
+    for(int slot=total+1; slot<dev_slots; slot++) {
+        if(occupied[slot]) {
+            step[steps].src=-1;
+            step[steps++].dst=slot;
+        }
+    }
+    return steps;
+}
+
+static void printPlan(const defragJournal *j) {
+    for(int i=j->current; i<j->steps; i++) {
+        if(j->step[i].src<0)
+            printf("  erase %d\n", j->step[i].dst);
+        else
+            printf("  %d -> %d\n", j->step[i].src, j->step[i].dst);
+    }
+}
+
+bool FDS_defragFlash(bool dryRun) {
+    static defragJournal journal;
+    defragGame games[MAXSLOTS];
+    uint8_t occupied[MAXSLOTS];
+    uint8_t header[FLASHHEADERSIZE];
+    uint8_t *buf;
+    int count=0, copies=0, erases=0;
+    bool resume, ok=true;
+
+    if(dev_slots>MAXSLOTS)
+        { printf("Flash too big\n"); return false; }
+    buf=(uint8_t*)malloc(SLOTSIZE);
+
+    resume=loadJournal(&journal, buf);
+    if(resume && dryRun) {
+        printf("Interrupted defragment, stopped at step %d of %d.  Still to do:\n", journal.current+1, journal.steps);
+        printPlan(&journal);
+        free(buf);
+        return true;
+    } else if(resume) {
+        printf("Resuming interrupted defragment at step %d of %d\n", journal.current+1, journal.steps);
+    } else {
+        //scan headers, timing it to estimate the copies
+        uint32_t start=getTicks();
+        memset(occupied, 0, sizeof(occupied));
+        for(int slot=1; slot<dev_slots; slot++) {
+            if(!spi_readFlash(slot*SLOTSIZE, header, FLASHHEADERSIZE))
+                { free(buf); return false; }
+            occupied[slot]=(header[0]!=0xff);
+            if(header[0]!=0 && header[0]!=0xff) {
+                games[count].slot=slot;
+                games[count++].sides=1;
+            } else if(header[0]==0 && count && games[count-1].slot+games[count-1].sides==slot) {
+                games[count-1].sides++;
+            }
+        }
+        uint32_t scanMs=getTicks()-start;
+
+        memcpy(journal.magic, "FDJ1", 4);
+        journal.flashSize=dev_flashSize;
+        journal.current=0;
+        journal.steps=planDefrag(games, count, occupied, journal.step);
+
+        for(int i=0; i<journal.steps; i++) {
+            if(journal.step[i].src<0)
+                erases++;
+            else
+                copies++;
+        }
+        //a copy reads and writes a whole slot, the scan read FLASHHEADERSIZE per slot
+        uint32_t estimate=(uint32_t)((uint64_t)scanMs*copies*2*SLOTSIZE/FLASHHEADERSIZE/(dev_slots-1)) + (copies+erases)*ERASE_MS;
+        if(!journal.steps) {
+            printf("Nothing to do.\n");
+            free(buf);
+            return true;
+        }
+        printPlan(&journal);
+        printf("%d slot(s) to copy, %d to erase, about %u seconds\n", copies, erases, (estimate+999)/1000);
+        if(dryRun) {
+            free(buf);
+            return true;
+        }
+    }
+
+    uint32_t start=getTicks();
+    for(; journal.current<journal.steps; journal.current++) {
+        defragStep *step=&journal.step[journal.current];
+        if(step->src<0) {
+            if(!(ok=saveJournal(&journal, buf)))
+                break;
+            ok=spi_erasePage(step->dst*SLOTSIZE);
+        } else {
+            if(!resume && !(ok=spi_readFlash(step->src*SLOTSIZE, buf, SLOTSIZE)))
+                break;
+            if(!resume && !(ok=saveJournal(&journal, buf)))
+                break;
+            printf("%d -> %d ", step->src, step->dst);
+            ok=spi_writeFlash(buf, step->dst*SLOTSIZE, SLOTSIZE);
+        }
+        resume=false;           //only the step that was interrupted comes from the journal
+        if(!ok)
+            break;
+    }
+    if(ok) {
+        removeJournal();
+        printf("Defragmented in %u ms\n", getTicks()-start);
+    } else {
+        printf("Defragment stopped at step %d, run it again to finish\n", journal.current+1);
+    }
+    free(buf);
+    return ok;
+}
+
+void hexdump(char *desc, void *addr, int len)
+{
+	int i;
+	unsigned char buff[17];
+	unsigned char *pc = (unsigned char *)addr;
+
+	// Output description if given.
+	if (desc != NULL)
+		printf("%s:\r\n", desc);
+
+	// Process every byte in the data.
+	for (i = 0; i < len; i++) {
+		// Multiple of 16 means new line (with line offset).
+
+		if ((i % 16) == 0) {
+			// Just don't print ASCII for the zeroth line.
+			if (i != 0)
+				printf("  %s\r\n", buff);
+
+			// Output the offset.
+			printf("  %04x ", i);
+		}
+		// Now the hex code for the specific character.
+		printf(" %02x", pc[i]);
+
+		// And store a printable ASCII character for later.
+		if ((pc[i] < 0x20) || (pc[i] > 0x7e))
+			buff[i % 16] = '.';
+		else
+			buff[i % 16] = pc[i];
+		buff[(i % 16) + 1] = '\0';
+	}
+
+	// Pad out last line if not exactly 16 characters.
+	while ((i % 16) != 0) {
+		printf("   ");
+		i++;
+	}
+
+	// And print the final ASCII bit.
+	printf("  %s\r\n", buff);
+}
+
+bool FDS_list() {
+    uint8_t buf[256];
+    int side=0;
+	 printf("\n");
+    for(int slot=1;slot<dev_slots;slot++) {
+        if(!spi_readFlash((slot)*SLOTSIZE,buf,256))
+            return false;
+
+        if(buf[0]==0xff) {          //empty
+            printf("%d:\n",slot);
+            side=0;
+        } else if(buf[0]!=0) {      //filename present
+            printf("%d: %s\n", slot, buf);
+            side=1;
+        } else if(!side) {          //first side is missing
+            printf("%d: ?\n", slot);
+        } else {                    //next side
+            printf("%d:    Side %d\n", slot, ++side);
+        }
+    }
+    return true;
+}
+
+//===============================
+
+//check for gap at EOF
+bool looks_like_file_end(uint8_t *raw, int start, int rawSize) {
+    enum {
+        MIN_GAP=976-100,
+        MAX_GAP=976+100,
+    };
+    int zeros=0;
+    int in=start;
+    for(; in<start+MAX_GAP && in<rawSize; in++) {
+        if(raw[in]==1 && zeros>MIN_GAP) {
+            return true;
+        } else if(raw[in]==0) {
+            zeros++;
+        }
+        if(raw[in]!=0)
+            zeros=0;
+    }
+    return in>=rawSize;  //end of disk = end of file!
+}
+
+//detect EOF by looking for good CRC.  in=start of file
+//returns 0 if nothing found
+int crc_detect(uint8_t *raw, int in, int rawSize) {
+    static uint32_t crc;
+    static uint8_t bitval;
+    static int out;
+    static bool match;
+
+    //local function ;)
+    struct { void shift(uint8_t bit) {
+        crc|=bit<<16;
+        if(crc & 1) crc ^= 0x10810;
+        crc>>=1;
+        bitval=bit;
+        out++;
+        if(crc==0 && !(out&7))  //on a byte bounary and CRC is valid
+            match=true;
+    }} f;
+
+    crc=0x8000;
+    bitval=1;
+    out=0;
+    do {
+        match=false;
+        switch(raw[in]|(bitval<<4)) {
+            case 0x11:
+                f.shift(0);
+            case 0x00:
+                f.shift(0);
+                break;
+            case 0x12:
+                f.shift(0);
+            case 0x01:
+            case 0x10:
+                f.shift(1);
+                break;
+            default:    //garbage / bad encoding
+                return 0;
+        }
+        in++;
+    } while(in<rawSize && !(match && looks_like_file_end(raw,in,rawSize)));
+    return match? in: 0;
+}
+
+//gap end is known, backtrack and mark the start.  !! this assumes junk data exists between EOF and gap start
+static void mark_gap_start(uint8_t *raw, int gapEnd) {
+    int i;
+    for(i=gapEnd-1; i>=0 && raw[i]==0; --i)
+        { }
+    raw[i+1]=3;
+    printf("mark gap %X-%X\n", i+1, gapEnd);
+}
+
+//For information only for now.  This checks for standard file format
+static void verify_block(uint8_t *bin, int start, int *reverse) {
+    enum { MAX_GAP=(976+100)/8, MIN_GAP=(976-100)/8 };
+    static const uint8_t next[]={0,2,3,4,3};
+    static int last = 0;
+    static int lastLen = 0;
+    static int blockCount = 0;
+
+    int len=0;
+    uint8_t type=bin[start];
+
+    printf("%d:%X", ++blockCount, type);
+
+    switch(type) {
+        case 1:
+            len=0x38;
+            break;
+        case 2:
+            len=2;
+            break;
+        case 3:
+            len=16;
+            break;
+        case 4:
+            len=1+(bin[last+13] | (bin[last+14]<<8));
+            break;
+        default:
+            printf(" bad block (%X)\n",start);
+            return;
+    }
+    printf(" %X-%X / %X-%X(%X)", reverse[start], reverse[start+len], start, start+len, len);
+
+    if((!last && type!=1) || (last && type!=next[bin[last]]))
+        printf(", wrong filetype");
+    if(calc_crc(bin+start, len+2)!=0)
+        printf(", bad CRC");
+    if(last && (last+lastLen+MAX_GAP)<start)
+        printf(", lost block?");
+    if(last+lastLen+MIN_GAP>start)
+        printf(", block overlap?");
+    //if(type==3 && ...)    //check other fields in file header?
+
+    printf("\n");
+    last=start;
+    lastLen=len;
+}
+
+//find gap + gap end.  returns bit following gap end, >=rawSize if not found.
+int nextGapEnd(uint8_t *raw, int in, int rawSize) {
+    enum { MIN_GAP=976-100, };
+    int zeros=0;
+    for(; (raw[in]!=1 || zeros<MIN_GAP) && in<rawSize; in++) {
+        if(raw[in]==0) {
+            zeros++;
+        } else {
+            zeros=0;
+        }
+    }
+    return in+1;
+}
+
+/*
+Try to create byte-for-byte, unadulterated representation of disk.  Use hints from the disk structure, given
+that it's probably a standard FDS game image but this should still make a best attempt regardless of the disk content.  
+
+_bin and _binSize are updated on exit.  alloc'd buffer is returned in _bin, caller is responsible for freeing it.
+*/
+static void raw03_to_bin(uint8_t *raw, int rawSize, uint8_t **_bin, int *_binSize) {
+    enum {
+        BINSIZE=0xa0000,
+        POST_GLITCH_GARBAGE=16,
+        LONG_POST_GLITCH_GARBAGE=64,
+        LONG_GAP=900,   //976 typ.
+        SHORT_GAP=16,
+    };
+    int in, out;
+    uint8_t *bin;
+    int *reverse;
+    int glitch;
+    int zeros;
+
+    bin=(uint8_t*)malloc(BINSIZE);
+    reverse=(int*)malloc(BINSIZE*sizeof(int));
+    memset(bin,0,BINSIZE);
+
+    //--- assume any glitch is OOB, mark a run of zeros near a glitch as a gap start.
+
+    int junk=0;
+    glitch=0;
+    zeros=0;
+    junk=0;
+    for(in=0; in<rawSize; in++) {
+        if(raw[in]==3) {
+            glitch=in;
+            junk=0;
+        } else if(raw[in]==1 || raw[in]==2) {
+            junk=in;
+        } else if(raw[in]==0) {
+            zeros++;
+            if(glitch && junk && zeros>SHORT_GAP && (junk-glitch)<POST_GLITCH_GARBAGE) {
+                mark_gap_start(raw,in);
+                glitch=0;
+            }
+        }
+        if(raw[in]!=0)
+            zeros=0;
+    }
+
+    //--- Walk filesystem, mark blocks where something looks like a valid file
+
+    in=findFirstBlock(raw, rawSize);
+    if(in>0) {
+        printf("header at %X\n",in);
+        mark_gap_start(raw, in-1);
+    }
+/*
+    do {
+        if(block_decode(..)) {
+            raw[head]=0xff;
+            raw[tail]=3;
+        }
+        next_gap(..);
+    } while(..);
+*/
+    //--- Identify files by CRC. If data looks like it's surrounded by gaps and it has a valid CRC where we
+    //    expect one to be, assume it's a file and mark its start/end.
+
+    in=findFirstBlock(raw, rawSize)+1;
+    if(in>0) do {
+        out=crc_detect(raw,in,rawSize);
+        if(out) {
+            printf("crc found %X-%X\n",in,out);
+            raw[out]=3;     //mark glitch (gap start)
+            //raw[in-1]=0xff;   //mark gap end 
+        }
+        in=nextGapEnd(raw, out? out: in, rawSize);
+    } while(in<rawSize);
+
+    //--- mark gap start/end using glitches to find gap start
+
+    for(glitch=0, zeros=0, in=0; in<rawSize; in++) {
+        if(raw[in]==3) {
+            glitch=in;
+        } else if(raw[in]==1) {
+            if(zeros>LONG_GAP && (in-zeros-LONG_POST_GLITCH_GARBAGE)<glitch) {
+                mark_gap_start(raw,in);
+                raw[in]=0xff;
+            }
+        } else if(raw[in]==0) {
+            zeros++;
+        }
+        if(raw[in]!=0)
+            zeros=0;
+    }
+
+    //--- output
+
+    /*
+    FILE *f=fopen("raw03.bin","wb");
+    fwrite(raw,1,rawSize,f);
+    fclose(f);
+    */
+
+    char bitval=0;
+    int lastBlockStart=0;
+    for(in=0, out=0; in<rawSize; in++) {
+        switch(raw[in]|(bitval<<4)) {
+            case 0x11:
+                out++;
+            case 0x00:
+                out++;
+                bitval=0;
+                break;
+            case 0x12:
+                out++;
+            case 0x01:
+            case 0x10:
+                bin[out/8] |= 1<<(out&7);
+                out++;
+                bitval=1;
+                break;
+            case 0xff:  //block end
+                if(lastBlockStart)
+                    verify_block(bin, lastBlockStart, reverse);
+                bin[out/8] = 0x80;
+                out=(out|7)+1;      //byte-align for readability
+                lastBlockStart=out/8;
+                bitval=1;
+                break;
+            case 0x02:
+                //printf("Encoding error @ %X(%X)\n",in,out/8);
+            default: //anything else (glitch)
+                out++;
+                bitval=0;
+                break;
+        }
+        reverse[out/8]=in;
+    }
+    //last block
+    verify_block(bin, lastBlockStart, reverse);
+
+    *_bin=bin;
+    *_binSize=out/8+1;
+    free(reverse);
+}
+
+/*
+bool FDS_rawToBin(char *filename_raw, char *filename_bin) {
+    FILE *f;
+    uint8_t *rawBuf=NULL;
+    uint8_t *binBuf=NULL;
+    int rawSize=0;
+    int binSize=0;
+
+    if(!loadFile(filename_raw, &rawBuf, &rawSize))
+        return false;
+    raw_to_raw03(rawBuf, rawSize);
+    raw03_to_bin(rawBuf, rawSize, &binBuf, &binSize);
+
+    f=fopen(filename_bin, "wb");
+    fwrite(binBuf, 1, binSize, f);
+    fclose(f);
+    printf("Wrote %s\n", filename_bin);
+
+    free(binBuf);
+    free(rawBuf);
+    return true;
+}
+*/
+
+// =========================================
+
+//make raw0-3 from flash image (sans header)
+static void bin_to_raw03(const uint8_t *bin, uint8_t *raw, int binSize, int rawSize) {
+    int in, out;
+    uint8_t bit, data;
+
+    memset(raw,0xff,rawSize);
+    for(bit=1, out=0, in=0; in<binSize*8; in++) {
+		 if ((in & 7) == 0) {
+			 data = *bin;
+			 bin++;
+		 }
+		 bit = (bit << 7) | (1 & (data >> (in & 7)));   //LSB first
+//     bit = (bit<<7) | (1 & (bin[in/8]>>(in%8)));   //LSB first
+        switch(bit) {
+            case 0x00:  //10 10
+					 out++;
+                raw[out]++;
+                break;
+            case 0x01:  //10 01
+            case 0x81:  //01 01
+                raw[out]++;
+					 out++;
+                break;
+            case 0x80:  //01 10
+                raw[out] += 2;
+                break;
+        }
+    }
+    memset(raw+out,3,rawSize-out);  //fill remainder with (undefined)
+}
+
+//Going directly to .FDS is messy, flash image isn't byte aligned and has gaps+CRCs.
+//Just convert to raw and use disk dumping functions.  bin = slot from flash, header gets cleared.
+static bool slotToFDS(uint8_t *bin, uint8_t *raw, uint8_t *fds) {
+    memset(bin,0,FLASHHEADERSIZE);  //clear header, use it as lead-in
+    bin_to_raw03(bin, raw, SLOTSIZE, SLOTSIZE*8);
+    return raw03_to_fds(raw, fds, SLOTSIZE*8);
+}
+
+bool FDS_readFlashToFDS(char *filename_fds, int slot) {  //slot 1..N
+    enum {
+		 RAWSIZE = SLOTSIZE * 8,
+	 };
+
+    static uint8_t fwnesHdr[16]={0x46, 0x44, 0x53, 0x1a, };
+
+    FILE *f;
+    uint8_t *bin, *raw, *fds;
+    bool result=true;
+    int side, sides;
+
+    bin=(uint8_t*)malloc(SLOTSIZE);     //single side from flash
+
+    //count sides first so the header can go out before the data (output may be a pipe)
+    for(sides=0; sides+slot<dev_slots; sides++) {
+        if(!spi_readFlash((slot+sides)*SLOTSIZE, bin, FLASHHEADERSIZE)) {
+            free(bin);
+            return false;
+        }
+        if(bin[0]==0xff || (bin[0]!=0 && sides!=0))     //stop on empty slot or next game
+            break;
+    }
+    if(!sides) {
+        printf("Slot %d is empty\n", slot);
+        free(bin);
+        return false;
+    }
+
+    f=os_openOutput(filename_fds);
+    if(!f) {
+        printf("Can't create %s\n",filename_fds);
+        free(bin);
+        return false;
+    }
+
+    printf("Writing %s\n",filename_fds);
+    fwnesHdr[4]=sides;
+    fwrite(fwnesHdr,1,sizeof(fwnesHdr),f);
+
+	 raw=(uint8_t*)malloc(RAWSIZE);      //..to raw03
+	 fds=(uint8_t*)malloc(FDSSIZE);      //..to FDS
+
+    //the next side is read while this one is decoded
+    uint32_t start=getTicks(), decodeMs=0, readMs;
+    spi_streamStart(slot*SLOTSIZE, SLOTSIZE, sides);
+    for(side=0; side<sides; side++) {
+        const uint8_t *slotData=spi_streamNext();
+        if(!slotData) {
+            result=false;
+            break;
+        }
+        uint32_t decodeStart=getTicks();
+        memcpy(bin, slotData, SLOTSIZE);
+        spi_streamRelease();
+        if(bin[0]==0 && side==0) {
+            printf("Warning! Not first side of game\n");
+        }
+
+        printf("Side %d\n",side+1);
+        if(!slotToFDS(bin, raw, fds)) {
+            result=false;
+            break;
+        }
+        fwrite(fds,1,FDSSIZE,f);
+        decodeMs+=getTicks()-decodeStart;
+    }
+    result&=spi_streamStop(&readMs);
+    printf("read %u ms, decode %u ms, %u ms total\n", readMs, decodeMs, getTicks()-start);
+
+    free(fds);
+    free(raw);
+    free(bin);
+    os_closeOutput(f);
+    return result;
+}
+
+//---- backup / restore
+
+/*
+Backup streams the whole flash once, splits it into games by the same header rules as FDS_list
+and decodes the games on a pool of threads while the rest is still being read.  Each game becomes
+dir/name.fds, manifest.txt lists slot, sides, hash of the .fds file and its name.  A game that doesn't
+decode is only listed as a comment, so restore won't take the damaged file.  Restore puts the games
+back in the same slots, writing only the sides that differ.
+*/
+struct backupGame {
+    int slot, sides;
+    uint8_t *data;          //raw slots
+    char name[256];
+    uint32_t hash;
+    bool ok;
+};
+
+static uint32_t fileHash(const uint8_t *buf, size_t size) {
+    uint32_t hash=2166136261u;
+    while(size--)
+        hash=(hash^*buf++)*16777619u;
+    return hash;
+}
+
+static std::mutex backupLock;
+static std::condition_variable backupSignal;
+static std::vector<backupGame*> backupQueue;
+static bool backupDone;
+
+static void decodeGame(const char *dir, backupGame *g) {
+    static const uint8_t fwnesHdr[16]={0x46, 0x44, 0x53, 0x1a, };
+    uint8_t *bin=(uint8_t*)malloc(SLOTSIZE);
+    uint8_t *raw=(uint8_t*)malloc(SLOTSIZE*8);
+    size_t size=sizeof(fwnesHdr)+g->sides*FDSSIZE;
+    uint8_t *out=(uint8_t*)malloc(size);
+    char path[1024];
+
+    g->ok=true;
+    memcpy(out, fwnesHdr, sizeof(fwnesHdr));
+    out[4]=g->sides;
+    for(int side=0; side<g->sides; side++) {
+        memcpy(bin, g->data+side*SLOTSIZE, SLOTSIZE);
+        if(!slotToFDS(bin, raw, out+sizeof(fwnesHdr)+side*FDSSIZE)) {
+            printf("%d: %s side %d doesn't decode\n", g->slot, g->name, side+1);
+            g->ok=false;
+        }
+    }
+    g->hash=fileHash(out, size);
+    snprintf(path, sizeof(path), "%s/%s", dir, g->name);
+    FILE *f=fopen(path, "wb");
+    if(!f || fwrite(out, 1, size, f)!=size) {
+        printf("Can't write %s\n", path);
+        g->ok=false;
+    }
+    if(f)
+        fclose(f);
+    free(out);
+    free(raw);
+    free(bin);
+    free(g->data);
+    g->data=NULL;
+}
+
+static void backupWorker(const char *dir) {
+    for(;;) {
+        backupGame *g;
+        {
+            std::unique_lock<std::mutex> lock(backupLock);
+            backupSignal.wait(lock, [] { return !backupQueue.empty() || backupDone; });
+            if(backupQueue.empty())
+                return;
+            g=backupQueue.back();
+            backupQueue.pop_back();
+        }
+        decodeGame(dir, g);
+    }
+}
+
+//file name from the slot header, made safe and unique
+static void backupName(backupGame *g, backupGame **games, int count, const uint8_t *header) {
+    char name[241];
+    memcpy(name, header, 240);
+    name[240]=0;
+    for(char *p=name; *p; p++) {
+        if(strchr("/\\:*?\"<>|", *p) || (uint8_t)*p<0x20)
+            *p='_';
+    }
+    const char *ext=strrchr(name, '.');
+    bool hasExt=ext && (!strcmp(ext, ".fds") || !strcmp(ext, ".FDS"));
+    snprintf(g->name, sizeof(g->name), "%s%s", name, hasExt? "": ".fds");
+    for(int i=0; i<count; i++) {
+        if(!strcmp(games[i]->name, g->name)) {
+            snprintf(g->name, sizeof(g->name), "%.*s-%d%s", (int)(hasExt? ext-name: strlen(name)), name, g->slot, hasExt? ext: ".fds");
+            break;
+        }
+    }
+}
+
+bool FDS_backupFlash(char *dir) {
+    std::vector<backupGame*> games;
+    backupGame *cur=NULL;
+    std::vector<std::thread> workers;
+    uint32_t start=getTicks(), readMs;
+    int count=0, slots=dev_slots-1;
+    bool ok=true;
+
+    if(!os_makeDir(dir)) {
+        printf("Can't create %s\n", dir);
+        return false;
+    }
+    int threads=std::thread::hardware_concurrency();
+    if(threads<1)
+        threads=1;
+    backupDone=false;
+    for(int i=0; i<threads; i++)
+        workers.push_back(std::thread(backupWorker, dir));
+
+    //a finished game goes to the decoders right away
+    auto finish=[&]() {
+        if(!cur)
+            return;
+        std::lock_guard<std::mutex> lock(backupLock);
+        backupQueue.push_back(cur);
+        backupSignal.notify_one();
+        cur=NULL;
+    };
+
+    printf("Reading %d slots", slots);
+    spi_streamStart(SLOTSIZE, SLOTSIZE, slots);
+    for(int slot=1; slot<=slots; slot++) {
+        const uint8_t *data=spi_streamNext();
+        if(!data) {
+            ok=false;
+            break;
+        }
+        if(data[0]!=0 && data[0]!=0xff) {                   //first side
+            finish();
+            cur=(backupGame*)calloc(1, sizeof(backupGame));
+            cur->slot=slot;
+            backupName(cur, games.data(), count, data);
+            games.push_back(cur);
+            count++;
+        } else if(data[0]!=0 || !cur) {                     //empty, or a side with no game
+            finish();
+        }
+        if(cur) {
+            cur->data=(uint8_t*)realloc(cur->data, (cur->sides+1)*SLOTSIZE);
+            memcpy(cur->data+cur->sides*SLOTSIZE, data, SLOTSIZE);
+            cur->sides++;
+        }
+        spi_streamRelease();
+        if(!(slot%4))
+            printf(".");
+    }
+    printf("\n");
+    ok&=spi_streamStop(&readMs);
+    finish();
+    {
+        std::lock_guard<std::mutex> lock(backupLock);
+        backupDone=true;
+        backupSignal.notify_all();
+    }
+    for(size_t i=0; i<workers.size(); i++)
+        workers[i].join();
+    backupQueue.clear();
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/manifest.txt", dir);
+    FILE *f=fopen(path, "w");
+    if(!f) {
+        printf("Can't write %s\n", path);
+        ok=false;
+    } else {
+        fprintf(f, "# slot sides hash name\n");
+        for(int i=0; i<count; i++) {
+            if(games[i]->ok)
+                fprintf(f, "%d %d %08X %s\n", games[i]->slot, games[i]->sides, games[i]->hash, games[i]->name);
+            else
+                fprintf(f, "# failed, not restorable: %d %d %s\n", games[i]->slot, games[i]->sides, games[i]->name);
+        }
+        fclose(f);
+    }
+    int good=0;
+    for(int i=0; i<count; i++) {
+        good+=games[i]->ok;
+        ok&=games[i]->ok;
+        free(games[i]);
+    }
+    printf("%d of %d game(s) saved to %s, read %u ms, %u ms total\n", good, count, dir, readMs, getTicks()-start);
+    return ok;
+}
+
+bool FDS_restoreFlash(char *dir, bool dryRun) {
+    enum { MAXGAMES=256 };
+    char path[1024], line[512];
+    char *names[MAXGAMES];
+    syncGame games[MAXGAMES];
+    uint8_t (*headers)[FLASHHEADERSIZE]=NULL;
+    uint8_t *used=NULL;
+    layoutCounts counts={0, 0, 0};
+    int count=0;
+    bool ok=false;
+    uint32_t start=getTicks();
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/manifest.txt", dir);
+    if(!(f=fopen(path, "r"))) {
+        printf("Can't read %s\n", path);
+        return false;
+    }
+    memset(games, 0, sizeof(games));
+    used=(uint8_t*)calloc(dev_slots, 1);
+    do {
+        //the manifest says where everything goes, the files have to be what was backed up
+        bool valid=true;
+        while(valid && count<MAXGAMES && fgets(line, sizeof(line), f)) {
+            int slot, sides, nameAt=0;
+            unsigned int hash;
+            if(line[0]=='#')
+                continue;
+            line[strcspn(line, "\r\n")]=0;
+            if(sscanf(line, "%d %d %X %n", &slot, &sides, &hash, &nameAt)<3 || !nameAt) {
+                printf("Bad manifest line: %s\n", line);
+                valid=false;
+                break;
+            }
+            snprintf(path, sizeof(path), "%s/%s", dir, line+nameAt);
+            names[count]=strdup(path);
+            syncGame *g=&games[count++];
+            mappedFile in;
+            bool mapped=os_mapFile(path, &in);
+            bool same=mapped && fileHash(in.data, in.size)==hash;
+            if(mapped)
+                os_unmapFile(&in);
+            if(!same) {
+                printf("%s is missing or changed since the backup\n", path);
+                valid=false;
+                break;
+            }
+            g->sides=appendGame(path, &g->image, 0);
+            g->slot=slot;
+            if(g->sides!=sides || slot<1 || slot+sides>dev_slots || memchr(used+slot, 1, sides)) {
+                printf("%s doesn't fit slot %d\n", path, slot);
+                valid=false;
+                break;
+            }
+            memset(used+slot, 1, sides);
+        }
+        if(!valid)
+            break;
+
+        headers=(uint8_t(*)[FLASHHEADERSIZE])malloc(dev_slots*FLASHHEADERSIZE);
+        int i;
+        for(i=1; i<dev_slots; i++) {
+            if(!spi_readFlash(i*SLOTSIZE, headers[i], FLASHHEADERSIZE))
+                break;
+        }
+        if(i<dev_slots)
+            break;
+        ok=applyLayout(games, names, count, headers, used, dryRun, &counts);
+        printf("%d game(s), %d slot(s) %swritten, %d unchanged, %d erased, %u ms\n",
+            count, counts.wrote, dryRun? "to be ": "", counts.skipped, counts.erased, getTicks()-start);
+    } while(0);
+
+    fclose(f);
+    for(int i=0; i<count; i++) {
+        free(names[i]);
+        free(games[i].image);
+    }
+    free(headers);
+    free(used);
+    return ok;
+}
+
+bool FDS_convertDiskraw03(char *filename, char *out) {
+	enum {
+		LEAD_IN = DEFAULT_LEAD_IN / 8,
+		DISKSIZE = 0x11000,               //whole disk contents including lead-in
+		RAWSIZE = SLOTSIZE * 8,
+	};
+
+	mappedFile in;
+	const uint8_t *inbuf;     //.FDS file
+	uint8_t *bin = 0;         //.FDS with gaps/CRC
+	uint8_t *raw = 0;         //.FDS with gaps/CRC
+	int filesize;
+	int binSize;
+
+	if (!os_mapFile(filename, &in))
+	{
+		printf("Can't read %s\n", filename); return false;
+	}
+	inbuf = in.data;
+	filesize = (int)in.size;
+
+	bin = (uint8_t*)malloc(DISKSIZE);
+	raw = (uint8_t*)malloc(RAWSIZE);      //..to raw03
+
+
+	int inpos = 0, side = 0;
+	if (inbuf[0] == 'F')
+		inpos = 16;      //skip fwNES header
+
+	filesize -= (filesize - inpos) % FDSSIZE;  //truncate down to whole disk
+	if (filesize <= inpos) {
+		printf("%s is too small for a disk side\n", filename);
+		free(raw);
+		free(bin);
+		os_unmapFile(&in);
+		return false;
+	}
+
+	FILE *f = os_openOutput(out);
+	if (!f) {
+		printf("Can't create %s\n", out);
+		free(raw);
+		free(bin);
+		os_unmapFile(&in);
+		return false;
+	}
+
+	//sides are appended as they're converted
+	do {
+		printf("Side %d\n", side + 1);
+
+		memset(bin, 0, LEAD_IN);
+		binSize = fds_to_bin(bin + LEAD_IN, inbuf + inpos, DISKSIZE - LEAD_IN);
+		if (!binSize)
+			break;
+		printf("writing output\n");
+		bin_to_raw03(bin, raw, SLOTSIZE, RAWSIZE);
+		if (raw03_isPacked(out)) {
+			if (!raw03_write(f, raw, RAWSIZE, NULL, 0, 0, true))
+				break;
+		}
+		else if (fwrite(raw, 1, RAWSIZE, f) != RAWSIZE)
+			break;
+		inpos += FDSSIZE;
+		side++;
+	} while (inpos<filesize && inbuf[inpos] == 0x01);      //all sides, no disk to change
+
+	printf("done\n");
+
+	os_closeOutput(f);
+	free(raw);
+	free(bin);
+	os_unmapFile(&in);
+	return true;
+}
+
+bool FDS_convertDisk(char *filename, char *out) {
+	enum {
+		LEAD_IN = DEFAULT_LEAD_IN / 8,
+		DISKSIZE = 0x11000,               //whole disk contents including lead-in
+	};
+
+	mappedFile in;
+	const uint8_t *inbuf;     //.FDS file
+	uint8_t *bin = 0;         //.FDS with gaps/CRC
+	int filesize;
+	int binSize;
+
+	if (!os_mapFile(filename, &in))
+	{
+		printf("Can't read %s\n", filename); return false;
+	}
+	inbuf = in.data;
+	filesize = (int)in.size;
+
+	bin = (uint8_t*)malloc(DISKSIZE);
+
+	int inpos = 0, side = 0;
+	if (inbuf[0] == 'F')
+		inpos = 16;      //skip fwNES header
+
+	filesize -= (filesize - inpos) % FDSSIZE;  //truncate down to whole disk
+	if (filesize <= inpos) {
+		printf("%s is too small for a disk side\n", filename);
+		free(bin);
+		os_unmapFile(&in);
+		return false;
+	}
+
+	FILE *f = os_openOutput(out);
+	if (!f) {
+		printf("Can't create %s\n", out);
+		free(bin);
+		os_unmapFile(&in);
+		return false;
+	}
+
+	//sides are appended as they're converted
+	do {
+		printf("Side %d\n", side + 1);
+
+		memset(bin, 0, LEAD_IN);
+		binSize = fds_to_bin(bin + LEAD_IN, inbuf + inpos, DISKSIZE - LEAD_IN);
+		if (!binSize)
+			break;
+		printf("writing output\n");
+		if (fwrite(bin, 1, binSize + LEAD_IN, f) != (size_t)(binSize + LEAD_IN))
+			break;
+		inpos += FDSSIZE;
+		side++;
+	} while (inpos<filesize && inbuf[inpos] == 0x01);      //all sides, no disk to change
+
+	printf("done\n");
+
+	os_closeOutput(f);
+	free(bin);
+	os_unmapFile(&in);
+	return true;
+}
+
+
+bool FDS_bintofds(char *filename, char *out)
+{
+	enum {
+		RAWSIZE = SLOTSIZE * 8,
+	};
+
+	static uint8_t fwnesHdr[16] = { 0x46, 0x44, 0x53, 0x1a, };
+
+	FILE *f;
+	mappedFile in;
+	const uint8_t *bin;
+	uint8_t *padded = 0, *raw, *fds;
+	bool result = true;
+
+	if (!os_mapFile(filename, &in))
+	{
+		printf("Can't read %s\n", filename);
+		return false;
+	}
+	bin = in.data;
+	if (in.size < SLOTSIZE) {	//short image, decoder wants a whole slot
+		padded = (uint8_t*)malloc(SLOTSIZE);
+		memset(padded, 0, SLOTSIZE);
+		memcpy(padded, in.data, in.size);
+		bin = padded;
+	}
+
+	f = os_openOutput(out);
+	if (!f) {
+		printf("Can't create %s\n", out);
+		free(padded);
+		os_unmapFile(&in);
+		return false;
+	}
+
+	printf("Writing %s\n", out);
+	fwnesHdr[4] = 1;	//one side per .bin
+	fwrite(fwnesHdr, 1, sizeof(fwnesHdr), f);
+
+	raw = (uint8_t*)malloc(RAWSIZE);      //..to raw03
+	fds = (uint8_t*)malloc(FDSSIZE);      //..to FDS
+
+	bin_to_raw03(bin, raw, SLOTSIZE, RAWSIZE);
+	if (!raw03_to_fds(raw, fds, RAWSIZE)) {
+		result = false;
+	}
+
+	fwrite(fds, 1, FDSSIZE, f);
+
+	free(fds);
+	free(raw);
+	free(padded);
+	os_unmapFile(&in);
+	os_closeOutput(f);
+	return result;
+}
+
+//Decode a packed raw03 capture (.r03).  .fds output is decoded straight from the packed pulses,
+//anything else gets the byte-per-pulse treatment of raw03_to_bin.
+bool FDS_packedToFDS(char *filename, char *out)
+{
+	enum { MAXGAPS = 64 };
+
+	captureGap gaps[MAXGAPS];
+	mappedFile in;
+	const uint8_t *pos, *packed;
+	uint8_t *alloc;
+	int pulses, gapCount, side;
+	bool result = true;
+	bool toBin = !!strstr(out, ".bin");
+	FILE *f;
+
+	if (!os_mapFile(filename, &in)) {
+		printf("Can't read %s\n", filename);
+		return false;
+	}
+	if (!(f = os_openOutput(out))) {
+		printf("Can't create %s\n", out);
+		os_unmapFile(&in);
+		return false;
+	}
+
+	//one record per side, decoded sides are appended
+	pos = in.data;
+	for (side = 0; pos < in.data + in.size; side++) {
+		if (!raw03_read(&pos, in.data + in.size, &packed, &alloc, &pulses, gaps, MAXGAPS, &gapCount)) {
+			result = false;
+			break;
+		}
+		printf("Side %d\n", side + 1);
+		if (toBin) {
+			uint8_t *raw = (uint8_t*)malloc(pulses);
+			uint8_t *bin;
+			int binSize;
+
+			raw03_unpack(packed, raw, pulses);
+			raw03_to_bin(raw, pulses, &bin, &binSize);
+			fwrite(bin, 1, binSize, f);
+			free(bin);
+			free(raw);
+			if (gapCount) {		//no per-block check for .bin
+				printf("Side has %d hole(s) of lost data.\n", gapCount);
+				result = false;
+			}
+		}
+		else {
+			packedRaw03 raw = { packed };
+			int badBlocks = 0;
+			uint8_t *fds = (uint8_t*)malloc(FDSSIZE + 16);
+
+			if (!raw03_to_fds(raw, fds, pulses, gaps, gapCount, &badBlocks))
+				result = false;
+			if (badBlocks) {
+				printf("%d block(s) overlap lost data.\n", badBlocks);
+				result = false;
+			}
+			fwrite(fds, 1, FDSSIZE, f);
+			free(fds);
+		}
+		free(alloc);
+	}
+	if (side)
+		printf("Wrote %s\n", out);
+
+	os_closeOutput(f);
+	os_unmapFile(&in);
+	return result;
+}
@@ -1,15 +1,20 @@
-#pragma once
-
-bool loadFile(char *filename, uint8_t **buf, int *filesize);
-
-//void FDStest(char *name);
-bool FDS_readDisk(char *filename_raw, char *filename_bin, char *filename_fds);
-bool FDS_writeDisk(char *name);
-bool FDS_writeFlash(char *name, int slot);
-bool FDS_list();
-bool FDS_rawToBin(char *filename_raw, char *filename_bin);
-bool FDS_readFlashToFDS(char *filename_fds, int slot);
-
-int fds_to_bin(uint8_t *dst, uint8_t *src, int dstSize);
-bool FDS_convertDisk(char *filename, char *out);
-bool FDS_convertDiskraw03(char *filename, char *out);
+#pragma once
+
+//void FDStest(char *name);
+bool FDS_readDisk(char *filename_raw, char *filename_bin, char *filename_fds);
+bool FDS_writeDisk(char *name, bool autoSwap, bool verify);
+bool FDS_writeFlash(char *name, int slot, bool resume);
+bool FDS_verifyFlash(char *name, int slot);
+int FDS_makeImage(char **files, int count, uint8_t **image);
+bool FDS_syncFlash(char *dir, bool dryRun, bool force);
+bool FDS_defragFlash(bool dryRun);
+bool FDS_backupFlash(char *dir);
+bool FDS_restoreFlash(char *dir, bool dryRun);
+bool FDS_list();
+bool FDS_rawToBin(char *filename_raw, char *filename_bin);
+bool FDS_readFlashToFDS(char *filename_fds, int slot);
+
+int fds_to_bin(uint8_t *dst, const uint8_t *src, int dstSize);
+bool FDS_convertDisk(char *filename, char *out);
+bool FDS_convertDiskraw03(char *filename, char *out);
+bool FDS_packedToFDS(char *filename, char *out);
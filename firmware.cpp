@@ -1,34 +1,44 @@
-#include <stdio.h>
-#include <stdint.h>
-#include "device.h"
-#include "spi.h"
-#include "os.h"
-
-#include "firmware.inc"
-#define FW_VER (firmware[5])
-
-//Update old firmware
-bool firmware_update() {
-    if(dev_fwVersion < FW_VER) {
-        printf("Updating firmware (V%d -> V%d)\n", dev_fwVersion, FW_VER);
-
-        //TODO - back up flash
-
-        if(!spi_writeFlash(firmware, 0xff0000, sizeof(firmware))) {
-            printf("Write failed.\n");
-            return false;
-        }
-
-        dev_updateFirmware();   //start update, device will reset itself
-        sleep_ms(2000);
-
-        if(!dev_open()) {
-            printf("Open failed.\n");
-            return false;
-        } else if(dev_fwVersion < FW_VER) {
-            printf("Update failed.\n");
-            return false;
-        }
-    }
-    return true;
-}
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "device.h"
+#include "spi.h"
+#include "os.h"
+#include "firmware.h"
+
+#include "firmware.inc"
+#define FW_VER (firmware[5])
+
+//Update old firmware
+bool firmware_update() {
+    if(dev_fwVersion < FW_VER) {
+        printf("Updating firmware (V%d -> V%d)\n", dev_fwVersion, FW_VER);
+
+        //TODO - back up flash
+
+        //whole sectors, blank past the image (same as the block erase + program this used to be)
+        int size=(sizeof(firmware)+SECTORSIZE-1) & ~(SECTORSIZE-1);
+        uint8_t *buf=(uint8_t*)malloc(size);
+        int changed;
+        memset(buf, 0xff, size);
+        memcpy(buf, firmware, sizeof(firmware));
+        bool written=spi_updateFlash(buf, 0xff0000, size, &changed);
+        free(buf);
+        if(!written) {          //never start the update from an image that didn't read back right
+            printf("Write failed, firmware not updated.\n");
+            return false;
+        }
+
+        dev_updateFirmware();   //start update, device will reset itself
+
+        if(!dev_reopen(FW_REBOOT_MS, true)) {
+            printf("Open failed.\n");
+            return false;
+        } else if(dev_fwVersion != FW_VER) {
+            printf("Update failed (running build %d, expected %d).\n", dev_fwVersion, FW_VER);
+            return false;
+        }
+    }
+    return true;
+}
@@ -1,3 +1,5 @@
-#pragma once
-
+#pragma once
+
+enum { FW_REBOOT_MS=15000 };        //longest an update+reboot should take
+
 bool firmware_update();
\ No newline at end of file
@@ -0,0 +1,420 @@
+/*******************************************************
+ HIDAPI - Multi-Platform library for
+ communication with HID devices.
+
+ Linux hidraw backend:  talks to the kernel HID driver through
+ /dev/hidrawN instead of detaching it and going through libusb.
+ Feature reports are single HIDIOCSFEATURE/HIDIOCGFEATURE ioctls,
+ there's no read thread.  Enumeration reads sysfs directly, so
+ libudev isn't needed either.
+
+ Build with "make HIDAPI=hidraw".  Same API and licensing as the
+ other HIDAPI backends (see LICENSE-orig.txt).
+********************************************************/
+
+#define _GNU_SOURCE /* needed for wcsdup() before glibc 2.10 */
+
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <locale.h>
+#include <errno.h>
+#include <limits.h>
+
+/* Unix */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <wchar.h>
+
+/* Linux */
+#include <linux/hidraw.h>
+
+#include "hidapi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SYSFS_HIDRAW "/sys/class/hidraw"
+#ifndef BUS_USB
+#define BUS_USB 0x03
+#endif
+
+struct hid_device_ {
+	int fd;
+	int blocking;
+	char *path;
+};
+
+int HID_API_EXPORT hid_init(void)
+{
+	const char *locale;
+
+	/* Set the locale if it's not set. */
+	locale = setlocale(LC_CTYPE, NULL);
+	if (!locale)
+		setlocale(LC_CTYPE, "");
+	return 0;
+}
+
+int HID_API_EXPORT hid_exit(void)
+{
+	return 0;
+}
+
+/* One line sysfs attribute, trailing newline removed.  Returns 0 if it's missing. */
+static int read_attr(const char *dir, const char *name, char *buf, size_t size)
+{
+	char path[PATH_MAX];
+	int fd;
+	ssize_t len;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len <= 0)
+		return 0;
+	while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\r'))
+		len--;
+	buf[len] = 0;
+	return 1;
+}
+
+static wchar_t *to_wchar(const char *utf8)
+{
+	size_t len = mbstowcs(NULL, utf8, 0);
+	wchar_t *ret;
+
+	if (len == (size_t)-1) {
+		/* not valid in this locale, keep the ASCII part */
+		size_t i;
+		len = strlen(utf8);
+		ret = (wchar_t*)calloc(len + 1, sizeof(wchar_t));
+		for (i = 0; i < len; i++)
+			ret[i] = (utf8[i] & 0x80) ? L'?' : (wchar_t)utf8[i];
+		return ret;
+	}
+	ret = (wchar_t*)calloc(len + 1, sizeof(wchar_t));
+	mbstowcs(ret, utf8, len + 1);
+	return ret;
+}
+
+static wchar_t *attr_string(const char *dir, const char *name)
+{
+	char buf[256];
+	if (!read_attr(dir, name, buf, sizeof(buf)))
+		return NULL;
+	return to_wchar(buf);
+}
+
+/* Directory that holds an attribute, cut back from the end of path one level at a time */
+static char *parent_dir(char *path)
+{
+	char *slash = strrchr(path, '/');
+	if (slash && slash != path)
+		*slash = 0;
+	return path;
+}
+
+/* Fill in info from /sys/class/hidraw/<name>.  Returns 0 if it isn't a USB device we want. */
+static int read_device(const char *name, unsigned short vendor_id, unsigned short product_id, struct hid_device_info *info)
+{
+	char link[PATH_MAX], hid_dir[PATH_MAX], intf_dir[PATH_MAX], usb_dir[PATH_MAX];
+	char uevent[1024], buf[64];
+	unsigned int bus, vid, pid;
+	const char *id;
+
+	snprintf(link, sizeof(link), SYSFS_HIDRAW "/%s/device", name);
+	if (!realpath(link, hid_dir))
+		return 0;
+
+	/* HID_ID=bus:vendor:product */
+	if (!read_attr(hid_dir, "uevent", uevent, sizeof(uevent)))
+		return 0;
+	id = strstr(uevent, "HID_ID=");
+	if (!id || sscanf(id, "HID_ID=%x:%x:%x", &bus, &vid, &pid) != 3)
+		return 0;
+	if (bus != BUS_USB)
+		return 0;
+	if ((vendor_id && vendor_id != vid) || (product_id && product_id != pid))
+		return 0;
+
+	/* .../<usb device>/<interface>/<hid device> */
+	strcpy(intf_dir, hid_dir);
+	parent_dir(intf_dir);
+	strcpy(usb_dir, intf_dir);
+	parent_dir(usb_dir);
+
+	memset(info, 0, sizeof(*info));
+	snprintf(buf, sizeof(buf), "/dev/%s", name);
+	info->path = strdup(buf);
+	info->vendor_id = vid;
+	info->product_id = pid;
+	info->serial_number = attr_string(usb_dir, "serial");
+	info->manufacturer_string = attr_string(usb_dir, "manufacturer");
+	info->product_string = attr_string(usb_dir, "product");
+	if (read_attr(usb_dir, "bcdDevice", buf, sizeof(buf)))
+		info->release_number = (unsigned short)strtoul(buf, NULL, 16);
+	info->interface_number = -1;
+	if (read_attr(intf_dir, "bInterfaceNumber", buf, sizeof(buf)))
+		info->interface_number = (int)strtol(buf, NULL, 16);
+	return 1;
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+	struct hid_device_info *root = NULL, *cur_dev = NULL, info;
+	struct dirent *entry;
+	DIR *dir;
+
+	hid_init();
+	dir = opendir(SYSFS_HIDRAW);
+	if (!dir)
+		return NULL;
+	while ((entry = readdir(dir))) {
+		struct hid_device_info *tmp;
+
+		if (strncmp(entry->d_name, "hidraw", 6))
+			continue;
+		if (!read_device(entry->d_name, vendor_id, product_id, &info))
+			continue;
+		tmp = (struct hid_device_info*)malloc(sizeof(struct hid_device_info));
+		*tmp = info;
+		if (cur_dev)
+			cur_dev->next = tmp;
+		else
+			root = tmp;
+		cur_dev = tmp;
+	}
+	closedir(dir);
+	return root;
+}
+
+void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
+{
+	struct hid_device_info *d = devs;
+	while (d) {
+		struct hid_device_info *next = d->next;
+		free(d->path);
+		free(d->serial_number);
+		free(d->manufacturer_string);
+		free(d->product_string);
+		free(d);
+		d = next;
+	}
+}
+
+hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+	struct hid_device_info *devs, *cur_dev;
+	const char *path_to_open = NULL;
+	hid_device *handle = NULL;
+
+	devs = hid_enumerate(vendor_id, product_id);
+	for (cur_dev = devs; cur_dev; cur_dev = cur_dev->next) {
+		if (serial_number) {
+			if (cur_dev->serial_number && wcscmp(serial_number, cur_dev->serial_number) == 0) {
+				path_to_open = cur_dev->path;
+				break;
+			}
+		}
+		else {
+			path_to_open = cur_dev->path;
+			break;
+		}
+	}
+	if (path_to_open)
+		handle = hid_open_path(path_to_open);
+	hid_free_enumeration(devs);
+	return handle;
+}
+
+hid_device * HID_API_EXPORT hid_open_path(const char *path)
+{
+	hid_device *dev;
+	int fd;
+
+	hid_init();
+	fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	dev = (hid_device*)calloc(1, sizeof(hid_device));
+	dev->fd = fd;
+	dev->blocking = 1;
+	dev->path = strdup(path);
+	return dev;
+}
+
+int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
+{
+	/* hidraw always takes the report ID first, 0 for unnumbered reports */
+	return (int)write(dev->fd, data, length);
+}
+
+int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+	struct pollfd fds;
+	ssize_t bytes_read;
+	int ret;
+
+	if (milliseconds != 0) {
+		fds.fd = dev->fd;
+		fds.events = POLLIN;
+		fds.revents = 0;
+		ret = poll(&fds, 1, milliseconds);
+		if (ret <= 0)
+			return ret;     /* timeout (0) or error */
+		if (fds.revents & (POLLERR | POLLHUP | POLLNVAL))
+			return -1;      /* unplugged */
+	}
+
+	bytes_read = read(dev->fd, data, length);
+	if (bytes_read < 0 && (errno == EAGAIN || errno == EINPROGRESS))
+		bytes_read = 0;
+	return (int)bytes_read;
+}
+
+int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
+{
+	return hid_read_timeout(dev, data, length, dev->blocking ? -1 : 0);
+}
+
+int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
+{
+	int flags = fcntl(dev->fd, F_GETFL, 0);
+	if (flags < 0)
+		return -1;
+	if (fcntl(dev->fd, F_SETFL, nonblock ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK)) < 0)
+		return -1;
+	dev->blocking = !nonblock;
+	return 0;
+}
+
+int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
+{
+	return ioctl(dev->fd, HIDIOCSFEATURE(length), data);
+}
+
+int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data, size_t length)
+{
+	/* returns the report ID too, same as the libusb backend */
+	return ioctl(dev->fd, HIDIOCGFEATURE(length), data);
+}
+
+void HID_API_EXPORT hid_close(hid_device *dev)
+{
+	if (!dev)
+		return;
+	close(dev->fd);
+	free(dev->path);
+	free(dev);
+}
+
+/* Strings come from the USB device above the hidraw node */
+static int device_string(hid_device *dev, const char *attr, wchar_t *string, size_t maxlen)
+{
+	struct hid_device_info *devs, *cur_dev;
+	int ret = -1;
+
+	devs = hid_enumerate(0, 0);
+	for (cur_dev = devs; cur_dev; cur_dev = cur_dev->next) {
+		const wchar_t *str;
+		if (strcmp(cur_dev->path, dev->path))
+			continue;
+		if (!strcmp(attr, "serial"))
+			str = cur_dev->serial_number;
+		else if (!strcmp(attr, "manufacturer"))
+			str = cur_dev->manufacturer_string;
+		else
+			str = cur_dev->product_string;
+		if (str && maxlen) {
+			wcsncpy(string, str, maxlen);
+			string[maxlen - 1] = L'\0';
+			ret = 0;
+		}
+		break;
+	}
+	hid_free_enumeration(devs);
+	return ret;
+}
+
+int HID_API_EXPORT_CALL hid_get_manufacturer_string(hid_device *dev, wchar_t *string, size_t maxlen)
+{
+	return device_string(dev, "manufacturer", string, maxlen);
+}
+
+int HID_API_EXPORT_CALL hid_get_product_string(hid_device *dev, wchar_t *string, size_t maxlen)
+{
+	return device_string(dev, "product", string, maxlen);
+}
+
+int HID_API_EXPORT_CALL hid_get_serial_number_string(hid_device *dev, wchar_t *string, size_t maxlen)
+{
+	return device_string(dev, "serial", string, maxlen);
+}
+
+int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index, wchar_t *string, size_t maxlen)
+{
+	(void)dev; (void)string_index; (void)string; (void)maxlen;
+	return -1;      /* hidraw has no access to arbitrary string descriptors */
+}
+
+int HID_API_EXPORT_CALL hid_get_report_descriptor(hid_device *dev, unsigned char *buf, size_t buf_size)
+{
+	struct hidraw_report_descriptor rpt_desc;
+	int desc_size = 0;
+
+	if (ioctl(dev->fd, HIDIOCGRDESCSIZE, &desc_size) < 0)
+		return -1;
+	memset(&rpt_desc, 0, sizeof(rpt_desc));
+	rpt_desc.size = desc_size;
+	if (ioctl(dev->fd, HIDIOCGRDESC, &rpt_desc) < 0)
+		return -1;
+	if ((size_t)desc_size > buf_size)
+		desc_size = (int)buf_size;
+	memcpy(buf, rpt_desc.value, desc_size);
+	return desc_size;
+}
+
+int HID_API_EXPORT_CALL hid_set_transfer_timeout(hid_device *dev, int milliseconds)
+{
+	/* the feature ioctls use the kernel's fixed control timeout */
+	(void)dev; (void)milliseconds;
+	return -1;
+}
+
+int HID_API_EXPORT_CALL hid_get_release_number(hid_device *dev)
+{
+	struct hid_device_info *devs, *cur_dev;
+	int ret = -1;
+
+	/* bcdDevice is only in the usb parent's sysfs node, which enumeration already finds */
+	devs = hid_enumerate(0, 0);
+	for (cur_dev = devs; cur_dev; cur_dev = cur_dev->next) {
+		if (!strcmp(cur_dev->path, dev->path)) {
+			ret = cur_dev->release_number;
+			break;
+		}
+	}
+	hid_free_enumeration(devs);
+	return ret;
+}
+
+HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
+{
+	(void)dev;
+	return NULL;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -71,12 +71,9 @@ libusb HIDAPI programs are encouraged to use the interface number
 instead to differentiate between interfaces on a composite HID device. */
 /*#define INVASIVE_GET_USAGE*/
 
-/* Linked List of input reports received from the device. */
-struct input_report {
-	uint8_t *data;
-	size_t len;
-	struct input_report *next;
-};
+/* Input reports received from the device are kept in a ring, allocated once when
+   the read thread starts.  When it's full the oldest report is dropped. */
+#define INPUT_RING_SIZE 32
 
 
 struct hid_device_ {
@@ -99,17 +96,25 @@ struct hid_device_ {
 	/* Whether blocking reads are used */
 	int blocking; /* boolean */
 
-	/* Read thread objects */
+	/* Control and output transfer timeout, milliseconds */
+	int transfer_timeout;
+
+	/* Read thread objects.  The thread (and its interrupt transfer) is only
+	   started by the first hid_read(), feature reports don't need it. */
+	int thread_started;
 	pthread_t thread;
-	pthread_mutex_t mutex; /* Protects input_reports */
+	pthread_mutex_t mutex; /* Protects the input report ring */
 	pthread_cond_t condition;
 	pthread_barrier_t barrier; /* Ensures correct startup sequence */
 	int shutdown_thread;
 	int cancelled;
 	struct libusb_transfer *transfer;
 
-	/* List of received input reports. */
-	struct input_report *input_reports;
+	/* Ring of received input reports (input_ep_max_packet_size bytes each) */
+	unsigned char *ring_data;
+	size_t ring_len[INPUT_RING_SIZE];
+	int ring_head;  /* oldest report */
+	int ring_count;
 };
 
 static libusb_context *usb_context = NULL;
@@ -121,6 +126,7 @@ static hid_device *new_hid_device(void)
 {
 	hid_device *dev = calloc(1, sizeof(hid_device));
 	dev->blocking = 1;
+	dev->transfer_timeout = 1000;
 
 	pthread_mutex_init(&dev->mutex, NULL);
 	pthread_cond_init(&dev->condition, NULL);
@@ -648,38 +654,22 @@ static void read_callback(struct libusb_transfer *transfer)
 	int res;
 
 	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
-
-		struct input_report *rpt = malloc(sizeof(*rpt));
-		rpt->data = malloc(transfer->actual_length);
-		memcpy(rpt->data, transfer->buffer, transfer->actual_length);
-		rpt->len = transfer->actual_length;
-		rpt->next = NULL;
+		int slot;
 
 		pthread_mutex_lock(&dev->mutex);
 
-		/* Attach the new report object to the end of the list. */
-		if (dev->input_reports == NULL) {
-			/* The list is empty. Put it at the root. */
-			dev->input_reports = rpt;
+		/* Drop the oldest report if the ring is full. This
+		   way we don't grow forever if the user never reads
+		   anything from the device. */
+		if (dev->ring_count == INPUT_RING_SIZE)
+			return_data(dev, NULL, 0);
+
+		slot = (dev->ring_head + dev->ring_count) % INPUT_RING_SIZE;
+		memcpy(dev->ring_data + slot * dev->input_ep_max_packet_size, transfer->buffer, transfer->actual_length);
+		dev->ring_len[slot] = transfer->actual_length;
+		if (dev->ring_count++ == 0)
 			pthread_cond_signal(&dev->condition);
-		}
-		else {
-			/* Find the end of the list and attach. */
-			struct input_report *cur = dev->input_reports;
-			int num_queued = 0;
-			while (cur->next != NULL) {
-				cur = cur->next;
-				num_queued++;
-			}
-			cur->next = rpt;
 
-			/* Pop one off if we've reached 30 in the queue. This
-			   way we don't grow forever if the user never reads
-			   anything from the device. */
-			if (num_queued > 30) {
-				return_data(dev, NULL, 0);
-			}
-		}
 		pthread_mutex_unlock(&dev->mutex);
 	}
 	else if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
@@ -717,6 +707,7 @@ static void *read_thread(void *param)
 
 	/* Set up the transfer object. */
 	buf = malloc(length);
+	dev->ring_data = malloc(INPUT_RING_SIZE * length);
 	dev->transfer = libusb_alloc_transfer(0);
 	libusb_fill_interrupt_transfer(dev->transfer,
 		dev->device_handle,
@@ -780,6 +771,16 @@ static void *read_thread(void *param)
 }
 
 
+/* Start listening for input reports.  Called with dev->mutex locked. */
+static void start_read_thread(hid_device *dev)
+{
+	dev->thread_started = 1;
+	pthread_create(&dev->thread, NULL, read_thread, dev);
+
+	/* Wait here for the read thread to be initialized. */
+	pthread_barrier_wait(&dev->barrier);
+}
+
 hid_device * HID_API_EXPORT hid_open_path(const char *path)
 {
 	hid_device *dev = NULL;
@@ -885,11 +886,6 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 							}
 						}
 
-						pthread_create(&dev->thread, NULL, read_thread, dev);
-
-						/* Wait here for the read thread to be initialized. */
-						pthread_barrier_wait(&dev->barrier);
-
 					}
 					free(dev_path);
 				}
@@ -934,7 +930,7 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 			(2/*HID output*/ << 8) | report_number,
 			dev->interface,
 			(unsigned char *)data, length,
-			1000/*timeout millis*/);
+			dev->transfer_timeout);
 
 		if (res < 0)
 			return -1;
@@ -951,7 +947,7 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 			dev->output_endpoint,
 			(unsigned char*)data,
 			length,
-			&actual_length, 1000);
+			&actual_length, dev->transfer_timeout);
 
 		if (res < 0)
 			return -1;
@@ -967,15 +963,14 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
    This should be called with dev->mutex locked. */
 static int return_data(hid_device *dev, unsigned char *data, size_t length)
 {
-	/* Copy the data out of the linked list item (rpt) into the
-	   return buffer (data), and delete the liked list item. */
-	struct input_report *rpt = dev->input_reports;
-	size_t len = (length < rpt->len)? length: rpt->len;
+	/* Copy the oldest report out of the ring into the
+	   return buffer (data), and free its slot. */
+	int slot = dev->ring_head;
+	size_t len = (length < dev->ring_len[slot])? length: dev->ring_len[slot];
 	if (len > 0)
-		memcpy(data, rpt->data, len);
-	dev->input_reports = rpt->next;
-	free(rpt->data);
-	free(rpt);
+		memcpy(data, dev->ring_data + slot * dev->input_ep_max_packet_size, len);
+	dev->ring_head = (slot + 1) % INPUT_RING_SIZE;
+	dev->ring_count--;
 	return len;
 }
 
@@ -1000,8 +995,11 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 	pthread_mutex_lock(&dev->mutex);
 	pthread_cleanup_push(&cleanup_mutex, dev);
 
+	if (!dev->thread_started)
+		start_read_thread(dev);
+
 	/* There's an input report queued up. Return it. */
-	if (dev->input_reports) {
+	if (dev->ring_count) {
 		/* Return the first one */
 		bytes_read = return_data(dev, data, length);
 		goto ret;
@@ -1016,10 +1014,10 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 
 	if (milliseconds == -1) {
 		/* Blocking */
-		while (!dev->input_reports && !dev->shutdown_thread) {
+		while (!dev->ring_count && !dev->shutdown_thread) {
 			pthread_cond_wait(&dev->condition, &dev->mutex);
 		}
-		if (dev->input_reports) {
+		if (dev->ring_count) {
 			bytes_read = return_data(dev, data, length);
 		}
 	}
@@ -1035,10 +1033,10 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 			ts.tv_nsec -= 1000000000L;
 		}
 
-		while (!dev->input_reports && !dev->shutdown_thread) {
+		while (!dev->ring_count && !dev->shutdown_thread) {
 			res = pthread_cond_timedwait(&dev->condition, &dev->mutex, &ts);
 			if (res == 0) {
-				if (dev->input_reports) {
+				if (dev->ring_count) {
 					bytes_read = return_data(dev, data, length);
 					break;
 				}
@@ -1102,7 +1100,7 @@ int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char
 		(3/*HID feature*/ << 8) | report_number,
 		dev->interface,
 		(unsigned char *)data, length,
-		1000/*timeout millis*/);
+		dev->transfer_timeout);
 
 	if (res < 0)
 		return -1;
@@ -1133,7 +1131,7 @@ int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data,
 		(3/*HID feature*/ << 8) | report_number,
 		dev->interface,
 		(unsigned char *)data, length,
-		1000/*timeout millis*/);
+		dev->transfer_timeout);
 
 	if (res < 0)
 		return -1;
@@ -1150,16 +1148,19 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	if (!dev)
 		return;
 
-	/* Cause read_thread() to stop. */
-	dev->shutdown_thread = 1;
-	libusb_cancel_transfer(dev->transfer);
+	if (dev->thread_started) {
+		/* Cause read_thread() to stop. */
+		dev->shutdown_thread = 1;
+		libusb_cancel_transfer(dev->transfer);
 
-	/* Wait for read_thread() to end. */
-	pthread_join(dev->thread, NULL);
+		/* Wait for read_thread() to end. */
+		pthread_join(dev->thread, NULL);
 
-	/* Clean up the Transfer objects allocated in read_thread(). */
-	free(dev->transfer->buffer);
-	libusb_free_transfer(dev->transfer);
+		/* Clean up the Transfer objects allocated in read_thread(). */
+		free(dev->transfer->buffer);
+		libusb_free_transfer(dev->transfer);
+		free(dev->ring_data);
+	}
 
 	/* release the interface */
 	libusb_release_interface(dev->device_handle, dev->interface);
@@ -1167,13 +1168,6 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	/* Close the handle */
 	libusb_close(dev->device_handle);
 
-	/* Clear out the queue of received reports. */
-	pthread_mutex_lock(&dev->mutex);
-	while (dev->input_reports) {
-		return_data(dev, NULL, 0);
-	}
-	pthread_mutex_unlock(&dev->mutex);
-
 	free_hid_device(dev);
 }
 
@@ -1209,6 +1203,34 @@ int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index
 }
 
 
+int HID_API_EXPORT_CALL hid_get_report_descriptor(hid_device *dev, unsigned char *buf, size_t buf_size)
+{
+	int res = libusb_control_transfer(dev->device_handle,
+		LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE,
+		LIBUSB_REQUEST_GET_DESCRIPTOR,
+		(LIBUSB_DT_REPORT << 8),
+		dev->interface,
+		buf, buf_size,
+		dev->transfer_timeout);
+
+	return res < 0 ? -1 : res;
+}
+
+int HID_API_EXPORT_CALL hid_set_transfer_timeout(hid_device *dev, int milliseconds)
+{
+	dev->transfer_timeout = milliseconds;
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_get_release_number(hid_device *dev)
+{
+	struct libusb_device_descriptor desc;
+
+	if (libusb_get_device_descriptor(libusb_get_device(dev->device_handle), &desc) < 0)
+		return -1;
+	return desc.bcdDevice;
+}
+
 HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
 {
 	return NULL;
@@ -1035,6 +1035,36 @@ int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index
 }
 
 
+int HID_API_EXPORT_CALL hid_get_report_descriptor(hid_device *dev, unsigned char *buf, size_t buf_size)
+{
+	CFTypeRef ref = IOHIDDeviceGetProperty(dev->device_handle, CFSTR(kIOHIDReportDescriptorKey));
+	CFIndex len;
+
+	if (!ref || CFGetTypeID(ref) != CFDataGetTypeID())
+		return -1;
+	len = CFDataGetLength((CFDataRef)ref);
+	if ((size_t)len > buf_size)
+		len = buf_size;
+	CFDataGetBytes((CFDataRef)ref, CFRangeMake(0, len), buf);
+	return (int)len;
+}
+
+int HID_API_EXPORT_CALL hid_set_transfer_timeout(hid_device *dev, int milliseconds)
+{
+	/* IOHIDDeviceSetReport/GetReport block with the system's own timeout */
+	(void)dev; (void)milliseconds;
+	return -1;
+}
+
+int HID_API_EXPORT_CALL hid_get_release_number(hid_device *dev)
+{
+	CFTypeRef ref = IOHIDDeviceGetProperty(dev->device_handle, CFSTR(kIOHIDVersionNumberKey));
+
+	if (!ref || CFGetTypeID(ref) != CFNumberGetTypeID())
+		return -1;
+	return get_int_property(dev->device_handle, CFSTR(kIOHIDVersionNumberKey));
+}
+
 HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
 {
 	/* TODO: */
@@ -847,6 +847,30 @@ int HID_API_EXPORT_CALL HID_API_CALL hid_get_indexed_string(hid_device *dev, int
 }
 
 
+int HID_API_EXPORT_CALL hid_get_report_descriptor(hid_device *dev, unsigned char *buf, size_t buf_size)
+{
+	/* Windows only hands out the parsed form (HidD_GetPreparsedData), callers fall back to their defaults */
+	(void)dev; (void)buf; (void)buf_size;
+	return -1;
+}
+
+int HID_API_EXPORT_CALL hid_set_transfer_timeout(hid_device *dev, int milliseconds)
+{
+	/* feature reports go through HidD_ / DeviceIoControl, which don't take a timeout */
+	(void)dev; (void)milliseconds;
+	return -1;
+}
+
+int HID_API_EXPORT_CALL hid_get_release_number(hid_device *dev)
+{
+	HIDD_ATTRIBUTES attrib;
+
+	attrib.Size = sizeof(HIDD_ATTRIBUTES);
+	if (!HidD_GetAttributes(dev->device_handle, &attrib))
+		return -1;
+	return attrib.VersionNumber;
+}
+
 HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
 {
 
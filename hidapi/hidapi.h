@@ -377,6 +377,42 @@ extern "C" {
 		*/
 		HID_API_EXPORT const wchar_t* HID_API_CALL hid_error(hid_device *device);
 
+		/** @brief Get the device's HID report descriptor (FDSemu addition).
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param buf The buffer to copy the descriptor into.
+			@param buf_size The size of the buffer in bytes.
+
+			@returns
+				This function returns the number of bytes copied, or
+				-1 if the backend can't get the descriptor.
+		*/
+		int HID_API_EXPORT_CALL hid_get_report_descriptor(hid_device *device, unsigned char *buf, size_t buf_size);
+
+		/** @brief Set the timeout for control and output transfers (FDSemu addition).
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param milliseconds Timeout for each transfer (default 1000).
+
+			@returns
+				This function returns 0 on success and -1 if the
+				backend has no timeout to set.
+		*/
+		int HID_API_EXPORT_CALL hid_set_transfer_timeout(hid_device *device, int milliseconds);
+
+		/** @brief Get the device's release number, bcdDevice (FDSemu addition).
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+
+			@returns
+				This function returns the release number, or -1 if
+				the backend can't read it.
+		*/
+		int HID_API_EXPORT_CALL hid_get_release_number(hid_device *device);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,315 +1,611 @@
-#include <stdio.h>
-#include <string.h>
-#include <stdlib.h>
-#include <stdint.h>
-#include "device.h"
-#include "spi.h"
-#include "fds.h"
-#include "firmware.h"
-#include "os.h"
-
-bool FW_writeFlash(char *filename)
-{
-	FILE *fp;
-	uint8_t *buf = 0;
-	uint32_t *buf32, chksum;
-	int i, filesize;
-
-	if ((fp = fopen(filename, "rb")) == 0) {
-		printf("unable to open firmware '%s'\n", filename);
-		return(false);
-	}
-	fseek(fp, 0, SEEK_END);
-	filesize = ftell(fp);
-	fseek(fp, 0, SEEK_SET);
-	if (filesize > (0x8000 - 8)) {
-		printf("firmware image too large\n");
-		fclose(fp);
-		return(false);
-	}
-	buf = (uint8_t*)malloc(0x8000);
-	buf32 = (uint32_t*)buf;
-	memset(buf, 0, 0x8000);
-	fread(buf, 1, filesize, fp);
-	fclose(fp);
-
-	buf32[(0x8000 - 8) / 4] = 0xDEADBEEF;
-
-	chksum = 0;
-	for (i = 0; i<(0x8000 - 4); i += 4) {
-		chksum ^= buf32[i / 4];
-	}
-
-	printf("firmware is %d bytes, checksum is $%08X\n", filesize, chksum);
-
-	buf32[(0x8000 - 4) / 4] = chksum;
-
-	printf("uploading new firmware");
-	if (!spi_writeFlash2(buf, 0x8000, 0x8000)) {
-		printf("Write failed.\n");
-		return false;
-	}
-	free(buf);
-
-	printf("waiting for device to reboot\n");
-
-	dev_updateFirmware();   //start update, device will reset itself
-	sleep_ms(5000);
-
-	if (!dev_open()) {
-		printf("Open failed.\n");
-		return false;
-	}
-	printf("Updated to build %d\n", dev_fwVersion);
-
-	return true;
-}
-
-char loaderid[] = "]|<=--LOADER.FDS--=>|[";
-
-bool DetectLoader(uint8_t *buf)
-{
-	int pos, len, count;
-	uint8_t byte;
-
-	for (pos = 0; pos<65500;) {
-
-		//read a byte
-		byte = buf[pos++];
-
-		//first byte matches
-		if (byte == loaderid[0]) {
-			len = strlen(loaderid);
-			for (count = 0; byte == loaderid[count] && count < len; count++) {
-				byte = buf[pos + count];
-			}
-			if (count == len) {
-				len = buf[pos + count];
-				printf("Valid loader image found, version %d.%02d\n", len / 100, len % 100);
-				return(true);
-			}
-		}
-	}
-	return(false);
-}
-
-bool WriteLoader(char *fn)
-{
-	bool ret = false;
-	uint8_t *buf;
-	int len;
-
-	if (loadFile(fn, &buf, &len) == false) {
-		printf("Error loading file '%s'\n", fn);
-		return(false);
-	}
-	if (DetectLoader(buf) == false) {
-		printf("Specified image doesnt appear to be the loader.\n");
-	}
-	else {
-		ret = FDS_writeFlash(fn, 0);
-	}
-	free(buf);
-	return(ret);
-}
-
-
-void app_exit(int exitcode) {
-	dev_close();
-	//	 system("pause");
-	exit(exitcode);
-};
-
-void help() {
-	printf(
-		"\n"
-		"    -f file.fds [1..n]          write to flash (disk slot# 1..n)\n"
-		"    -s file.fds [1..n]          read from flash\n"
-
-		"    -r file.fds                 read disk\n"
-		"    -R file.raw [file.bin]      read disk (raw)\n"
-		"    -w file.fds                 write disk\n"
-
-		"    -l                          list flash contents\n"
-
-		"    -L file.fds                 update the loader in slot 0\n"
-		"    -U file.bin                 update the firmware\n"
-
-		"    -e [1..8 | all]             erase flash\n"
-		"    -D file [addr] [size]       dump flash\n"
-		"    -W file [addr]              write flash\n"
-
-		"    -c file.fds file.bin        convert fds format to bin format\n"
-		"    -C file.fds file.raw        convert fds format to raw03 format\n"
-		"    -F file.bin file.fds        convert bin format to fds format\n"
-		);
-	app_exit(1);
-}
-
-bool FDS_bintofds(char *filename, char *out);
-
-int main(int argc, char** argv) {
-	setbuf(stdout, NULL);
-	printf("FDSemu console app (" __DATE__ "), based on code by loopy\n");
-
-	if (!dev_open() || argc<2 || argv[1][0] != '-') {
-		help();
-	}
-	/*
-	if(!firmware_update())  //auto-update old firmware
-	app_exit(1);
-	*/
-	bool success = false;
-	switch (argv[1][1]) {
-
-	case 'F': //convert file.bin file.fds
-		success = FDS_bintofds(argv[2], argv[3]);
-		break;
-
-	case 'c': //convert file.fds file.bin
-		success = FDS_convertDisk(argv[2], argv[3]);
-		break;
-
-	case 'C': //convert file.fds file.bin
-		success = FDS_convertDiskraw03(argv[2], argv[3]);
-		break;
-
-	case 'f': //flash -f file.fds [slot]
-		if (argc<3)
-			help();
-		{
-			int slot = 1;
-			if (argc>3)
-				sscanf(argv[3], "%i", &slot);
-			success = FDS_writeFlash(argv[2], slot);
-		}
-		//		 app_exit(0);
-		break;
-
-	case 'L': //update the loader
-		if (argc<3)
-			help();
-		{
-			success = WriteLoader(argv[2]);
-		}
-		//		 app_exit(0);
-		break;
-
-	case 'U': //flash -f file.fds [slot]
-		if (argc<3)
-			help();
-		{
-			success = FW_writeFlash(argv[2]);
-		}
-		//		 app_exit(0);
-		break;
-
-	case 's': //save -s file.fds [slot]
-		if (argc<3)
-			help();
-		{
-			int slot = 1;
-			if (argc>3)
-				sscanf(argv[3], "%i", &slot);
-			//TODO - name should be optional, it's already in flash
-			success = FDS_readFlashToFDS(argv[2], slot);
-		}
-		break;
-
-	case 'w':
-		if (argc<3)
-			help();
-		success = FDS_writeDisk(argv[2]);
-		break;
-
-	case 'l':
-		success = FDS_list();
-		break;
-
-	case 'r':   //readDisk -r file.fds
-		if (argc<3)
-			help();
-		success = FDS_readDisk(NULL, NULL, argv[2]);
-		break;
-
-	case 'R':   //readRaw -R file.raw [file.bin]
-		if (argc<3)
-			help();
-		success = FDS_readDisk(argv[2], argc>3 ? argv[3] : NULL, NULL);
-		break;
-
-	case 'e':   //erase -e [1..N | all]
-		if (argc<3)
-			help();
-		{
-			if (!strcmp(argv[2], "all")) {
-				success = true;
-				for (int addr = 0; addr<dev_flashSize; addr += SLOTSIZE)
-					success &= spi_erasePage(addr);
-			}
-			else {
-				int slot = 1;
-				sscanf(argv[2], "%i", &slot);
-				printf("erasing slot %d\n", slot);
-				if (slot > 0) {
-					success = spi_erasePage(SLOTSIZE*(slot));
-				}
-				else if (slot == 0) {
-					printf("cannot erase the loader\n");
-				}
-				//TODO - erase all slots of a game
-			}
-		}
-		break;
-
-	case 'D':   //dump -D filename addr size
-		if (argc<3)
-			help();
-		{
-			int addr = 0, size = dev_flashSize;
-			if (argc>3)
-				sscanf(argv[3], "%i", &addr);
-			if (argc>4)
-				sscanf(argv[4], "%i", &size);
-			success = spi_dumpFlash(argv[2], addr, size);
-			break;
-		}
-
-	case 'W':   //write -W file [addr]
-		if (argc<3)
-			help();
-		{
-			int addr = 0;
-			if (argc>3)
-				sscanf(argv[3], "%i", &addr);
-			success = spi_writeFile(argv[2], addr);
-			break;
-		}
-
-		/*	case 'u': //update -u filename
-		if(argc<3)
-		help();
-		{
-		if(spi_writeFile(argv[2], 0xff0000))
-		success=dev_updateFirmware();
-		break;
-		}
-		*/
-	case 'T':   //mfgTest -T ...
-	{
-		dev_selfTest();
-		success = true;
-		break;
-	}
-
-
-	default:
-		help();
-	}
-
-	printf(success ? "Ok.\n" : "Failed.\n");
-	if (!success)
-		dev_printLastError();
-
-	app_exit(success ? 0 : 1);
-}
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "device.h"
+#include "spi.h"
+#include "fds.h"
+#include "firmware.h"
+#include "os.h"
+#include "daemon.h"
+#include "farm.h"
+
+static bool resumeWrites = false;		//--resume:  continue an interrupted -f/-W/-L from its journal
+static bool autoSwap = false;			//--auto:  -w changes disk sides by watching the drive, no prompts
+static bool verifyWrites = false;		//--verify:  -w reads each side back and compares
+
+//The image is staged at 0x8000 and the adapter copies it over its firmware on ID_UPDATEFIRMWARE.
+//Only sectors that differ are rewritten, and the adapter isn't told to update unless the staged image
+//reads back right.  If the staged copy already matches, nothing is done unless force is set.
+bool FW_writeFlash(char *filename, bool force)
+{
+	mappedFile in;
+	uint8_t *buf = 0;
+	uint32_t *buf32, chksum;
+	int i, filesize, changed;
+	uint16_t oldVersion = dev_fwVersion;
+
+	if (!os_mapFile(filename, &in)) {
+		printf("unable to open firmware '%s'\n", filename);
+		return(false);
+	}
+	filesize = (int)in.size;
+	if (filesize > (0x8000 - 8)) {
+		printf("firmware image too large\n");
+		os_unmapFile(&in);
+		return(false);
+	}
+	buf = (uint8_t*)malloc(0x8000);
+	buf32 = (uint32_t*)buf;
+	memset(buf, 0, 0x8000);
+	memcpy(buf, in.data, filesize);
+	os_unmapFile(&in);
+
+	buf32[(0x8000 - 8) / 4] = 0xDEADBEEF;
+
+	chksum = 0;
+	for (i = 0; i<(0x8000 - 4); i += 4) {
+		chksum ^= buf32[i / 4];
+	}
+
+	printf("firmware is %d bytes, checksum is $%08X\n", filesize, chksum);
+
+	buf32[(0x8000 - 4) / 4] = chksum;
+
+	printf("uploading new firmware");
+	uint32_t start = getTicks();
+	bool written = spi_updateFlash(buf, 0x8000, 0x8000, &changed);
+	free(buf);
+	if (!written) {
+		printf("Write failed, firmware not updated.\n");
+		return false;
+	}
+	printf("%d of 8 sector(s) rewritten and verified in %u ms\n", changed, getTicks() - start);
+	if (!changed && !force) {
+		printf("Staged firmware is already this image (running build %d), use --force to apply it again\n", dev_fwVersion);
+		return true;
+	}
+
+	printf("waiting for device to reboot\n");
+
+	dev_updateFirmware();   //start update, device will reset itself
+
+	if (!dev_reopen(FW_REBOOT_MS, changed != 0)) {
+		printf("Open failed.\n");
+		return false;
+	}
+	if (dev_fwVersion == oldVersion && changed) {
+		printf("Build number didn't change (still %d), update failed\n", dev_fwVersion);
+		return false;
+	}
+	printf("Updated build %d -> %d\n", oldVersion, dev_fwVersion);
+	return true;
+}
+
+char loaderid[] = "]|<=--LOADER.FDS--=>|[";
+
+bool DetectLoader(const uint8_t *buf, int size)
+{
+	int pos, len, count;
+	uint8_t byte;
+
+	len = strlen(loaderid);
+	if (size > 65500)
+		size = 65500;
+	for (pos = 0; pos<size - len - 1;) {
+
+		//read a byte
+		byte = buf[pos++];
+
+		//first byte matches
+		if (byte == loaderid[0]) {
+			len = strlen(loaderid);
+			for (count = 0; byte == loaderid[count] && count < len; count++) {
+				byte = buf[pos + count];
+			}
+			if (count == len) {
+				len = buf[pos + count];
+				printf("Valid loader image found, version %d.%02d\n", len / 100, len % 100);
+				return(true);
+			}
+		}
+	}
+	return(false);
+}
+
+bool WriteLoader(char *fn)
+{
+	bool ret = false;
+	mappedFile in;
+
+	if (os_mapFile(fn, &in) == false) {
+		printf("Error loading file '%s'\n", fn);
+		return(false);
+	}
+	if (DetectLoader(in.data, (int)in.size) == false) {
+		printf("Specified image doesnt appear to be the loader.\n");
+	}
+	else {
+		ret = FDS_writeFlash(fn, 0, resumeWrites);
+	}
+	os_unmapFile(&in);
+	return(ret);
+}
+
+
+void app_exit(int exitcode) {
+	dev_close();
+	//	 system("pause");
+	exit(exitcode);
+};
+
+static bool usage() {
+	printf(
+		"\n"
+		"    -f file.fds [1..n]          write to flash (disk slot# 1..n)\n"
+		"    -s file.fds [1..n]          read from flash\n"
+		"    -V file.fds [1..n]          verify flash against file\n"
+		"    -M file.fds [file.fds ...]  write games from slot 1 to every adapter at once\n"
+		"    -S dir [-n] [--force]       make flash match the .fds files in dir, rewriting only\n"
+		"                                what changed (-n = show what would be done,\n"
+		"                                --force = even if dir has no games)\n"
+		"    -d [-n]                     defragment, pack games from slot 1 (-n = show plan)\n"
+		"    -B dir                      back up every game to dir, with a manifest\n"
+		"    -Z dir [-n]                 restore a backup, rewriting only slots that differ\n"
+
+		"    -r file.fds                 read disk\n"
+		"    -R file.raw|.r03 [file.bin] read disk (raw, .r03 = packed raw03)\n"
+		"    -w file.fds                 write disk\n"
+
+		"    -l                          list flash contents\n"
+
+		"    -L file.fds                 update the loader in slot 0\n"
+		"    -U file.bin [--force]       update the firmware (--force = even if already staged)\n"
+
+		"    -e [1..8 | all]             erase flash\n"
+		"    -D file [addr] [size]       dump flash\n"
+		"    -W file [addr]              write flash\n"
+
+		"    -c file.fds file.bin        convert fds format to bin format\n"
+		"    -C file.fds file.raw|.r03   convert fds format to raw03 format (.r03 = packed)\n"
+		"    -p file.r03 file.fds|.bin   convert packed raw03 capture to fds or bin format\n"
+		"    -F file.bin file.fds        convert bin format to fds format\n"
+
+		"    -A [seconds]                wait until a device is plugged in (default no limit)\n"
+		"    -P [count]                  time device open (scan vs cached path) and report round trips\n"
+
+		"    -b script [-k]              run commands from script over one device open\n"
+		"                                (-k = keep going after a failed command)\n"
+		"    --daemon [socket]           keep the device open and run jobs sent to a local socket\n"
+		"    --resume                    continue an interrupted -f, -W or -L where it stopped\n"
+		"    --auto                      -w: wait for the drive and disk changes instead of ENTER\n"
+		"    --verify                    -w: read each side back and compare\n"
+		"    --verbose                   show the report sizes and drive line changes\n"
+		"    --timeout ms                time limit for each transfer (default 1000, libusb backend only)\n"
+		"    --retries n                 times to redo a failed flash/SRAM operation (default 3)\n"
+		"    --backoff ms                wait before the first retry, doubled after (default 50)\n"
+		"\n"
+		"    Use - as a file name to read from stdin or write to stdout.\n"
+		);
+	return false;
+}
+
+void help() {
+	usage();
+	app_exit(1);
+}
+
+bool FDS_bintofds(char *filename, char *out);
+
+//Device is opened on first use, so conversions work without one and a script shares one open.
+static bool needDevice() {
+	return dev_flashSize || dev_open();
+}
+
+static bool runScript(char *filename, bool keepGoing);
+
+//Is flag one of argv[from..]?
+static bool hasFlag(int argc, char **argv, int from, const char *flag) {
+	for (int i = from; i < argc; i++) {
+		if (!strcmp(argv[i], flag))
+			return true;
+	}
+	return false;
+}
+
+//argv[0] is the command (-f, -l, ...), same as the command line minus the program name
+static bool runCommand(int argc, char** argv) {
+	if (argc<1 || argv[0][0] != '-' || !argv[0][1])
+		return usage();
+
+	switch (argv[0][1]) {
+	case 'F': case 'c': case 'C': case 'p': case 'b': case 'M': case 'A':
+		break;
+	default:
+		if (!needDevice())
+			return false;
+	}
+
+	bool success = false;
+	switch (argv[0][1]) {
+
+	case 'F': //convert file.bin file.fds
+		if (argc<3)
+			return usage();
+		success = FDS_bintofds(argv[1], argv[2]);
+		break;
+
+	case 'c': //convert file.fds file.bin
+		if (argc<3)
+			return usage();
+		success = FDS_convertDisk(argv[1], argv[2]);
+		break;
+
+	case 'C': //convert file.fds file.bin
+		if (argc<3)
+			return usage();
+		success = FDS_convertDiskraw03(argv[1], argv[2]);
+		break;
+
+	case 'p': //convert file.r03 file.fds
+		if (argc<3)
+			return usage();
+		success = FDS_packedToFDS(argv[1], argv[2]);
+		break;
+
+	case 'f': //flash -f file.fds [slot]
+		if (argc<2)
+			return usage();
+		{
+			int slot = 1;
+			if (argc>2)
+				sscanf(argv[2], "%i", &slot);
+			success = FDS_writeFlash(argv[1], slot, resumeWrites);
+		}
+		break;
+
+	case 'V': //verify -V file.fds [slot]
+		if (argc<2)
+			return usage();
+		{
+			int slot = 1;
+			if (argc>2)
+				sscanf(argv[2], "%i", &slot);
+			success = FDS_verifyFlash(argv[1], slot);
+		}
+		break;
+
+	case 'M': //farm -M file.fds [file.fds ...]
+		if (argc<2)
+			return usage();
+		success = farm_flash(argv + 1, argc - 1);
+		break;
+
+	case 'S': //sync -S dir [-n] [--force]
+		if (argc<2)
+			return usage();
+		success = FDS_syncFlash(argv[1], hasFlag(argc, argv, 2, "-n"), hasFlag(argc, argv, 2, "--force"));
+		break;
+
+	case 'd': //defragment -d [-n]
+		success = FDS_defragFlash(argc>1 && !strcmp(argv[1], "-n"));
+		break;
+
+	case 'B': //backup -B dir
+		if (argc<2)
+			return usage();
+		success = FDS_backupFlash(argv[1]);
+		break;
+
+	case 'Z': //restore -Z dir [-n]
+		if (argc<2)
+			return usage();
+		success = FDS_restoreFlash(argv[1], argc>2 && !strcmp(argv[2], "-n"));
+		break;
+
+	case 'L': //update the loader
+		if (argc<2)
+			return usage();
+		success = WriteLoader(argv[1]);
+		break;
+
+	case 'U': //update the firmware
+		if (argc<2)
+			return usage();
+		success = FW_writeFlash(argv[1], argc>2 && !strcmp(argv[2], "--force"));
+		break;
+
+	case 's': //save -s file.fds [slot]
+		if (argc<2)
+			return usage();
+		{
+			int slot = 1;
+			if (argc>2)
+				sscanf(argv[2], "%i", &slot);
+			//TODO - name should be optional, it's already in flash
+			success = FDS_readFlashToFDS(argv[1], slot);
+		}
+		break;
+
+	case 'w':
+		if (argc<2)
+			return usage();
+		//script lines and daemon jobs don't go through main()'s prepass, so look for them here too
+		success = FDS_writeDisk(argv[1], autoSwap || hasFlag(argc, argv, 2, "--auto"),
+			verifyWrites || hasFlag(argc, argv, 2, "--verify"));
+		break;
+
+	case 'l':
+		success = FDS_list();
+		break;
+
+	case 'r':   //readDisk -r file.fds
+		if (argc<2)
+			return usage();
+		success = FDS_readDisk(NULL, NULL, argv[1]);
+		break;
+
+	case 'R':   //readRaw -R file.raw [file.bin]
+		if (argc<2)
+			return usage();
+		success = FDS_readDisk(argv[1], argc>2 ? argv[2] : NULL, NULL);
+		break;
+
+	case 'e':   //erase -e [1..N | all]
+		if (argc<2)
+			return usage();
+		{
+			if (!strcmp(argv[1], "all")) {
+				success = true;
+				for (int addr = 0; addr<dev_flashSize; addr += SLOTSIZE)
+					success &= spi_erasePage(addr);
+			}
+			else {
+				int slot = 1;
+				sscanf(argv[1], "%i", &slot);
+				printf("erasing slot %d\n", slot);
+				if (slot > 0) {
+					success = spi_erasePage(SLOTSIZE*(slot));
+				}
+				else if (slot == 0) {
+					printf("cannot erase the loader\n");
+				}
+				//TODO - erase all slots of a game
+			}
+		}
+		break;
+
+	case 'D':   //dump -D filename addr size
+		if (argc<2)
+			return usage();
+		{
+			int addr = 0, size = dev_flashSize;
+			if (argc>2)
+				sscanf(argv[2], "%i", &addr);
+			if (argc>3)
+				sscanf(argv[3], "%i", &size);
+			success = spi_dumpFlash(argv[1], addr, size);
+			break;
+		}
+
+	case 'W':   //write -W file [addr]
+		if (argc<2)
+			return usage();
+		{
+			int addr = 0;
+			if (argc>2)
+				sscanf(argv[2], "%i", &addr);
+			success = spi_writeFile(argv[1], addr, resumeWrites);
+			break;
+		}
+
+		/*	case 'u': //update -u filename
+		if(argc<3)
+		help();
+		{
+		if(spi_writeFile(argv[2], 0xff0000))
+		success=dev_updateFirmware();
+		break;
+		}
+		*/
+	case 'T':   //mfgTest -T ...
+	{
+		dev_selfTest();
+		success = true;
+		break;
+	}
+
+	case 'A': { //wait for an adapter -A [seconds]
+		int seconds = 0;
+		if (argc>1)
+			sscanf(argv[1], "%i", &seconds);
+		printf("Waiting for device\n");
+		if (!dev_waitFor(true, seconds * 1000))
+			printf("Timed out\n");
+		else
+			success = needDevice();
+		break;
+	}
+
+	case 'P': { //benchmark -P [count]
+		int count = 1000;
+		if (argc>1)
+			sscanf(argv[1], "%i", &count);
+		success = dev_benchmark(count);
+		break;
+	}
+
+	case 'b':   //script -b file [-k]
+		if (argc<2)
+			return usage();
+		success = runScript(argv[1], argc>2 && !strcmp(argv[2], "-k"));
+		break;
+
+	default:
+		return usage();
+	}
+	return success;
+}
+
+//Script commands can use the long names below or the usual -x form
+static const struct { const char *name, *option; } scriptNames[] = {
+	{ "flash", "-f" }, { "save", "-s" }, { "verify", "-V" }, { "list", "-l" },
+	{ "erase", "-e" }, { "dump", "-D" }, { "write", "-W" }, { "loader", "-L" },
+	{ "readdisk", "-r" }, { "writedisk", "-w" }, { "farm", "-M" },
+	{ "sync", "-S" }, { "defrag", "-d" }, { "backup", "-B" }, { "restore", "-Z" },
+	{ "bench", "-P" }, { "wait", "-A" },
+};
+
+//Long name to -x, anything else is left alone
+static char *commandOption(char *name) {
+	for (size_t i = 0; i<sizeof(scriptNames) / sizeof(scriptNames[0]); i++) {
+		if (!strcmp(name, scriptNames[i].name))
+			return (char*)scriptNames[i].option;
+	}
+	return name;
+}
+
+//Daemon jobs name their command the same way scripts do
+static bool runJob(int argc, char **argv) {
+	argv[0] = commandOption(argv[0]);
+	//nobody at the console to press ENTER.  --auto trusts the drive status bits (see device.h), so a
+	//job has to ask for it (or the daemon be started with it) rather than getting it by default.
+	if (!strcmp(argv[0], "-w") && !autoSwap && !hasFlag(argc, argv, 2, "--auto")) {
+		printf("writedisk needs --auto in the daemon, there's no console to press ENTER\n");
+		return false;
+	}
+	return runCommand(argc, argv);
+}
+
+//Split a script line into arguments.  Whitespace separated, "double quotes" for names with spaces,
+//# starts a comment.  Modifies line.
+static int splitLine(char *line, char **args, int maxArgs) {
+	int count = 0;
+	char *p = line;
+	while (count<maxArgs) {
+		while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+			p++;
+		if (!*p || *p == '#')
+			break;
+		if (*p == '"') {
+			args[count++] = ++p;
+			while (*p && *p != '"')
+				p++;
+		}
+		else {
+			args[count++] = p;
+			while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+				p++;
+		}
+		if (*p)
+			*p++ = 0;
+	}
+	return count;
+}
+
+//Run each line of a script (or stdin) as a command, with timing.  Stops at the first failure
+//unless keepGoing is set.
+static bool runScript(char *filename, bool keepGoing) {
+	enum { MAXARGS = 16 };
+	char line[1024];
+	char *args[MAXARGS];
+	int lineNum = 0, commands = 0, failed = 0;
+	FILE *f;
+
+	if (!strcmp(filename, "-"))
+		f = stdin;
+	else if (!(f = fopen(filename, "r"))) {
+		printf("Can't read %s\n", filename);
+		return false;
+	}
+
+	uint32_t scriptStart = getTicks();
+	while (fgets(line, sizeof(line), f)) {
+		char text[sizeof(line)];
+		lineNum++;
+		strcpy(text, line);
+		text[strcspn(text, "\r\n")] = 0;
+
+		int count = splitLine(line, args, MAXARGS);
+		if (!count)
+			continue;
+		args[0] = commandOption(args[0]);
+		if (args[0][0] == '-' && args[0][1] == 'b') {
+			printf("%d: scripts can't be nested\n", lineNum);
+			failed++;
+			if (!keepGoing)
+				break;
+			continue;
+		}
+
+		printf("--- %d: %s\n", lineNum, text);
+		uint32_t start = getTicks();
+		bool ok = runCommand(count, args);
+		commands++;
+		printf("--- %d: %s (%u ms)\n", lineNum, ok ? "Ok" : "Failed", getTicks() - start);
+		if (!ok) {
+			failed++;
+			if (!keepGoing)
+				break;
+		}
+	}
+	if (f != stdin)
+		fclose(f);
+
+	printf("%d command(s), %d failed, %u ms total\n", commands, failed, getTicks() - scriptStart);
+	return !failed;
+}
+
+int main(int argc, char** argv) {
+	//long options that modify other commands, taken out before the command is parsed
+	int out = 1;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--resume"))
+			resumeWrites = true;
+		else if (!strcmp(argv[i], "--auto"))
+			autoSwap = true;
+		else if (!strcmp(argv[i], "--verify"))
+			verifyWrites = true;
+		else if (!strcmp(argv[i], "--verbose"))
+			dev_verbose = true;
+		else if (!strcmp(argv[i], "--timeout") && i + 1 < argc)
+			dev_policy.timeoutMs = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--retries") && i + 1 < argc)
+			dev_policy.retries = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--backoff") && i + 1 < argc)
+			dev_policy.backoffMs = atoi(argv[++i]);
+		else
+			argv[out++] = argv[i];
+	}
+	argc = out;
+
+	for (int i = 2; i < argc; i++) {
+		if (!strcmp(argv[i], "-"))
+			os_reserveStdout();		//data goes to stdout, keep messages out of it
+	}
+	setbuf(stdout, NULL);
+	printf("FDSemu console app (" __DATE__ "), based on code by loopy\n");
+
+	if (argc>1 && !strcmp(argv[1], "--daemon")) {
+		bool ok = daemon_run(argc>2 ? argv[2] : NULL, runJob);
+		app_exit(ok ? 0 : 1);
+	}
+
+	if (argc<2 || argv[1][0] != '-') {
+		help();
+	}
+	/*
+	if(!firmware_update())  //auto-update old firmware
+	app_exit(1);
+	*/
+	bool success = runCommand(argc - 1, argv + 1);
+
+	const devStats *stats = dev_stats();
+	if (stats->retries || stats->failures)
+		printf("%d transfer retries, %d operation(s) gave up\n", stats->retries, stats->failures);
+	printf(success ? "Ok.\n" : "Failed.\n");
+	if (!success)
+		dev_printLastError();
+
+	app_exit(success ? 0 : 1);
+}
@@ -1,67 +1,339 @@
-#include <stdint.h>
-
-//Some OS-specific stuff.
-
-#if defined(_WIN32)
-
-    #include <windows.h>
-    #include <conio.h>
-
-    uint32_t getTicks() {
-        return GetTickCount();
-    }
-
-    void utf8_to_utf16(uint16_t *dst, char *src, size_t dstSize) {
-        MultiByteToWideChar(CP_ACP, 0, src, -1, (wchar_t*)dst, dstSize/sizeof(wchar_t));
-    }
-
-    char readKb() {
-        return _getch();
-    }
-
-    void sleep_ms(int millisecs) {
-        Sleep(millisecs);
-    }
-
-#elif defined(__linux__) || defined(__APPLE__)
-
-    #include <sys/time.h>
-    #include <string.h>
-    #include <iconv.h>
-    #include <termios.h>
-    #include <unistd.h>
-    #include <stdio.h>
-
-    uint32_t getTicks() {
-       struct timeval tv;       
-       gettimeofday(&tv, 0);
-       return (unsigned long)((tv.tv_sec * 1000ul) + (tv.tv_usec / 1000ul));
-    }
-
-    void utf8_to_utf16(uint16_t *dst, char *src, size_t dstSize) {
-        size_t srcSize=strlen(src)+1;
-        iconv_t ic;
-        ic = iconv_open("UTF-16LE", "UTF-8");
-        if (ic == (iconv_t)-1)
-            return;
-        iconv(ic, &src, &srcSize, (char**)&dst, &dstSize);
-        iconv_close(ic);
-    }
-
-    int readKb() {
-        struct termios oldt, newt;
-        int ch;
-        tcgetattr(STDIN_FILENO, &oldt);
-        newt = oldt;
-        newt.c_lflag &= ~( ICANON | ECHO );
-        tcsetattr( STDIN_FILENO, TCSANOW, &newt );
-        ch = getchar();
-        tcsetattr( STDIN_FILENO, TCSANOW, &oldt );
-        return ch;
-    }
-
-    void sleep_ms(int millisecs) {
-        usleep(millisecs*1000);
-    }
-
-#endif
+#include <stdint.h>
+#include "os.h"
+
+//Some OS-specific stuff.
+
+#if defined(_WIN32)
+
+    #include <windows.h>
+    #include <conio.h>
+    #include <io.h>
+    #include <fcntl.h>
+    #include <stdio.h>
+    #include <string.h>
+    #include <stdlib.h>
+
+    #define dup _dup
+    #define dup2 _dup2
+    #define fdopen _fdopen
+    #define STDIN_FILENO 0
+    #define STDOUT_FILENO 1
+    #define STDERR_FILENO 2
+    static void setBinary(int fd) { _setmode(fd, _O_BINARY); }
+
+    uint32_t getTicks() {
+        return GetTickCount();
+    }
+
+    void utf8_to_utf16(uint16_t *dst, char *src, size_t dstSize) {
+        MultiByteToWideChar(CP_ACP, 0, src, -1, (wchar_t*)dst, dstSize/sizeof(wchar_t));
+    }
+
+    char readKb() {
+        return _getch();
+    }
+
+    void sleep_ms(int millisecs) {
+        Sleep(millisecs);
+    }
+
+    uint64_t getMicros() {
+        static LARGE_INTEGER freq;
+        LARGE_INTEGER now;
+        if(!freq.QuadPart)
+            QueryPerformanceFrequency(&freq);
+        QueryPerformanceCounter(&now);
+        return (uint64_t)(now.QuadPart * 1000000 / freq.QuadPart);
+    }
+
+    bool os_setRealtime() {
+        return !!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+    }
+
+    bool os_lockMemory(void *buf, size_t size) {
+        return !!VirtualLock(buf, size);
+    }
+
+    void os_unlockMemory(void *buf, size_t size) {
+        VirtualUnlock(buf, size);
+    }
+
+    static bool readPipe(mappedFile *map);
+
+    bool os_mapFile(const char *filename, mappedFile *map) {
+        HANDLE file, mapping;
+        LARGE_INTEGER size;
+
+        map->data=NULL;
+        map->size=0;
+        map->copied=false;
+        if(!strcmp(filename, "-"))
+            return readPipe(map);
+        file=CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if(file==INVALID_HANDLE_VALUE)
+            return false;
+        if(!GetFileSizeEx(file, &size) || !size.QuadPart) {
+            CloseHandle(file);
+            return false;
+        }
+        mapping=CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        CloseHandle(file);
+        if(!mapping)
+            return false;
+        map->data=(const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mapping);
+        if(!map->data)
+            return false;
+        map->size=(size_t)size.QuadPart;
+        return true;
+    }
+
+    void os_unmapFile(mappedFile *map) {
+        if(map->copied)
+            free((void*)map->data);
+        else if(map->data)
+            UnmapViewOfFile(map->data);
+        map->data=NULL;
+        map->size=0;
+    }
+
+    //%APPDATA%\fdsemu\name
+    bool os_dataPath(const char *name, char *path, size_t size) {
+        const char *base=getenv("APPDATA");
+        if(!base)
+            return false;
+        snprintf(path, size, "%s\\fdsemu", base);
+        CreateDirectoryA(path, NULL);
+        snprintf(path, size, "%s\\fdsemu\\%s", base, name);
+        return true;
+    }
+
+    bool os_makeDir(const char *dir) {
+        return CreateDirectoryA(dir, NULL) || GetLastError()==ERROR_ALREADY_EXISTS;
+    }
+
+    bool os_listDir(const char *dir, void (*found)(const char *name, void *arg), void *arg) {
+        WIN32_FIND_DATAA data;
+        char pattern[MAX_PATH];
+
+        snprintf(pattern, sizeof(pattern), "%s\\*", dir);
+        HANDLE h=FindFirstFileA(pattern, &data);
+        if(h==INVALID_HANDLE_VALUE)
+            return false;
+        do {
+            if(!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+                found(data.cFileName, arg);
+        } while(FindNextFileA(h, &data));
+        FindClose(h);
+        return true;
+    }
+
+#elif defined(__linux__) || defined(__APPLE__)
+
+    #include <sys/time.h>
+    #include <string.h>
+    #include <iconv.h>
+    #include <termios.h>
+    #include <unistd.h>
+    #include <stdio.h>
+    #include <pthread.h>
+    #include <sched.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <stdlib.h>
+    #include <dirent.h>
+
+    static void setBinary(int fd) { }
+
+    uint32_t getTicks() {
+       struct timeval tv;       
+       gettimeofday(&tv, 0);
+       return (unsigned long)((tv.tv_sec * 1000ul) + (tv.tv_usec / 1000ul));
+    }
+
+    void utf8_to_utf16(uint16_t *dst, char *src, size_t dstSize) {
+        size_t srcSize=strlen(src)+1;
+        iconv_t ic;
+        ic = iconv_open("UTF-16LE", "UTF-8");
+        if (ic == (iconv_t)-1)
+            return;
+        iconv(ic, &src, &srcSize, (char**)&dst, &dstSize);
+        iconv_close(ic);
+    }
+
+    char readKb() {
+        struct termios oldt, newt;
+        int ch;
+        tcgetattr(STDIN_FILENO, &oldt);
+        newt = oldt;
+        newt.c_lflag &= ~( ICANON | ECHO );
+        tcsetattr( STDIN_FILENO, TCSANOW, &newt );
+        ch = getchar();
+        tcsetattr( STDIN_FILENO, TCSANOW, &oldt );
+        return ch;
+    }
+
+    void sleep_ms(int millisecs) {
+        usleep(millisecs*1000);
+    }
+
+    uint64_t getMicros() {
+       struct timeval tv;
+       gettimeofday(&tv, 0);
+       return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    }
+
+    //SCHED_FIFO for the calling thread.  Needs root or CAP_SYS_NICE, fails quietly otherwise.
+    bool os_setRealtime() {
+        struct sched_param param;
+        param.sched_priority = sched_get_priority_max(SCHED_FIFO) - 1;
+        return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+    }
+
+    //limited by RLIMIT_MEMLOCK
+    bool os_lockMemory(void *buf, size_t size) {
+        return mlock(buf, size) == 0;
+    }
+
+    void os_unlockMemory(void *buf, size_t size) {
+        munlock(buf, size);
+    }
+
+    static bool readPipe(mappedFile *map);
+
+    bool os_mapFile(const char *filename, mappedFile *map) {
+        struct stat st;
+        int fd, flags=MAP_PRIVATE;
+        void *p;
+
+        map->data=NULL;
+        map->size=0;
+        map->copied=false;
+        if(!strcmp(filename, "-"))
+            return readPipe(map);
+        if((fd=open(filename, O_RDONLY))<0)
+            return false;
+        if(fstat(fd, &st)<0 || st.st_size<=0) {
+            close(fd);
+            return false;
+        }
+#ifdef MAP_POPULATE
+        flags|=MAP_POPULATE;    //prefault, we're going to read all of it
+#endif
+        p=mmap(NULL, st.st_size, PROT_READ, flags, fd, 0);
+        close(fd);
+        if(p==MAP_FAILED)
+            return false;
+        madvise(p, st.st_size, MADV_SEQUENTIAL);
+        map->data=(const uint8_t*)p;
+        map->size=st.st_size;
+        return true;
+    }
+
+    void os_unmapFile(mappedFile *map) {
+        if(map->copied)
+            free((void*)map->data);
+        else if(map->data)
+            munmap((void*)map->data, map->size);
+        map->data=NULL;
+        map->size=0;
+    }
+
+    //~/.fdsemu/name
+    bool os_dataPath(const char *name, char *path, size_t size) {
+        const char *base=getenv("HOME");
+        if(!base)
+            return false;
+        snprintf(path, size, "%s/.fdsemu", base);
+        mkdir(path, 0700);
+        snprintf(path, size, "%s/.fdsemu/%s", base, name);
+        return true;
+    }
+
+    bool os_makeDir(const char *dir) {
+        struct stat st;
+        return !mkdir(dir, 0755) || (!stat(dir, &st) && S_ISDIR(st.st_mode));
+    }
+
+    bool os_listDir(const char *dir, void (*found)(const char *name, void *arg), void *arg) {
+        DIR *d=opendir(dir);
+        struct dirent *ent;
+        struct stat st;
+        char path[4096];
+
+        if(!d)
+            return false;
+        while((ent=readdir(d))) {
+            snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+            if(!stat(path, &st) && S_ISREG(st.st_mode))
+                found(ent->d_name, arg);
+        }
+        closedir(d);
+        return true;
+    }
+
+#endif
+
+//---- common
+
+//stdin can't be mapped, read it all
+static bool readPipe(mappedFile *map) {
+    size_t alloc=0x10000, size=0, got;
+    uint8_t *buf=(uint8_t*)malloc(alloc);
+
+    setBinary(STDIN_FILENO);
+    while((got=fread(buf+size, 1, alloc-size, stdin))>0) {
+        size+=got;
+        if(size==alloc)
+            buf=(uint8_t*)realloc(buf, alloc*=2);
+    }
+    if(!size) {
+        free(buf);
+        return false;
+    }
+    map->data=buf;
+    map->size=size;
+    map->copied=true;
+    return true;
+}
+
+static int stdoutData=-1;
+
+//Keep the real stdout for data ("-" outputs), console messages go to stderr from here on.
+//Call before anything gets printed.
+void os_reserveStdout() {
+    if(stdoutData>=0)
+        return;
+    fflush(stdout);
+    stdoutData=dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+}
+
+//fopen(filename, "wb"), "-" writes to stdout
+FILE *os_openOutput(const char *filename) {
+    if(strcmp(filename, "-"))
+        return fopen(filename, "wb");
+    os_reserveStdout();
+    setBinary(stdoutData);
+    return fdopen(dup(stdoutData), "wb");
+}
+
+void os_closeOutput(FILE *f) {
+    if(f)
+        fclose(f);
+}
+
+//---- progress
+
+static progressFunc progressHook=NULL;
+
+//Long operations call os_progress() alongside their console dots, a hook (the daemon) can forward it
+void os_setProgress(progressFunc func) {
+    progressHook=func;
+}
+
+void os_progress(int done, int total) {
+    if(progressHook)
+        progressHook(done, total);
+}
@@ -1,6 +1,30 @@
-#pragma once
-
-uint32_t getTicks();
-void utf8_to_utf16(uint16_t *dst, char *src, size_t dstSize);
-char readKb();
-void sleep_ms(int millisecs);
\ No newline at end of file
+#pragma once
+#include <stddef.h>
+#include <stdio.h>
+
+//Read-only view of a whole file
+struct mappedFile {
+    const uint8_t *data;
+    size_t size;
+    bool copied;        //read from a pipe ("-"), data is malloc'd
+};
+
+uint32_t getTicks();
+void utf8_to_utf16(uint16_t *dst, char *src, size_t dstSize);
+char readKb();
+void sleep_ms(int millisecs);
+uint64_t getMicros();
+bool os_setRealtime();
+bool os_lockMemory(void *buf, size_t size);
+void os_unlockMemory(void *buf, size_t size);
+bool os_mapFile(const char *filename, mappedFile *map);
+void os_unmapFile(mappedFile *map);
+bool os_dataPath(const char *name, char *path, size_t size);      //per-user file (journals, cache)
+bool os_makeDir(const char *dir);       //ok if it exists
+bool os_listDir(const char *dir, void (*found)(const char *name, void *arg), void *arg);   //files only
+void os_reserveStdout();
+FILE *os_openOutput(const char *filename);
+void os_closeOutput(FILE *f);
+typedef void (*progressFunc)(int done, int total);
+void os_setProgress(progressFunc func);
+void os_progress(int done, int total);
@@ -0,0 +1,257 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "raw03.h"
+#include "os.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+    #include <emmintrin.h>
+    #define RAW03_SSE2
+#endif
+
+static const char magic[4]={'R','0','3','P'};
+
+//4 pulses (0..3) -> 1 byte, first pulse in bits 0-1
+void raw03_pack(const uint8_t *src, uint8_t *dst, int pulses) {
+    int i=0;
+#ifdef RAW03_SSE2
+    //64 pulses per pass.  Each 32-bit lane holds 4 pulses p0..p3, one per byte:
+    //  v|v>>6 puts p0|p1<<2 in byte 0 and p2|p3<<2 in byte 2, then |>>12 folds byte 2 into byte 0.
+    const __m128i three=_mm_set1_epi8(3);
+    const __m128i lowByte=_mm_set1_epi32(0xff);
+    for(; i+64<=pulses; i+=64) {
+        __m128i v[4];
+        for(int j=0; j<4; j++) {
+            __m128i x=_mm_and_si128(_mm_loadu_si128((const __m128i*)(src+i+j*16)), three);
+            x=_mm_or_si128(x, _mm_srli_epi32(x, 6));
+            x=_mm_or_si128(x, _mm_srli_epi32(x, 12));
+            v[j]=_mm_and_si128(x, lowByte);
+        }
+        __m128i out=_mm_packus_epi16(_mm_packs_epi32(v[0], v[1]), _mm_packs_epi32(v[2], v[3]));
+        _mm_storeu_si128((__m128i*)(dst+i/4), out);
+    }
+#endif
+    for(; i+4<=pulses; i+=4)
+        dst[i/4]=(src[i]&3) | (src[i+1]&3)<<2 | (src[i+2]&3)<<4 | (src[i+3]&3)<<6;
+    if(i<pulses) {
+        uint8_t last=0;
+        for(int j=0; i+j<pulses; j++)
+            last|=(src[i+j]&3)<<(j*2);
+        dst[i/4]=last;
+    }
+}
+
+void raw03_unpack(const uint8_t *src, uint8_t *dst, int pulses) {
+    int i=0;
+#ifdef RAW03_SSE2
+    //16 bytes -> 64 pulses.  Spread each byte across a 32-bit lane, then pick bits 2k..2k+1 for byte k.
+    const __m128i m0=_mm_set1_epi32(0x00000003);
+    const __m128i m1=_mm_set1_epi32(0x00000300);
+    const __m128i m2=_mm_set1_epi32(0x00030000);
+    const __m128i m3=_mm_set1_epi32(0x03000000);
+    for(; i+64<=pulses; i+=64) {
+        __m128i x=_mm_loadu_si128((const __m128i*)(src+i/4));
+        __m128i lo=_mm_unpacklo_epi8(x, x);
+        __m128i hi=_mm_unpackhi_epi8(x, x);
+        __m128i lanes[4]={ _mm_unpacklo_epi16(lo, lo), _mm_unpackhi_epi16(lo, lo), _mm_unpacklo_epi16(hi, hi), _mm_unpackhi_epi16(hi, hi) };
+        for(int j=0; j<4; j++) {
+            __m128i v=lanes[j];
+            __m128i r=_mm_and_si128(v, m0);
+            r=_mm_or_si128(r, _mm_and_si128(_mm_srli_epi32(v, 2), m1));
+            r=_mm_or_si128(r, _mm_and_si128(_mm_srli_epi32(v, 4), m2));
+            r=_mm_or_si128(r, _mm_and_si128(_mm_srli_epi32(v, 6), m3));
+            _mm_storeu_si128((__m128i*)(dst+i+j*16), r);
+        }
+    }
+#endif
+    for(; i<pulses; i++)
+        dst[i]=(src[i/4]>>((i&3)*2))&3;
+}
+
+//PackBits: n=0..127 -> n+1 literal bytes follow, n=-1..-127 -> next byte repeats 1-n times.
+//Returns compressed size.  dst needs size+size/128+1 bytes worst case.
+static int rle_encode(const uint8_t *src, int size, uint8_t *dst) {
+    int in=0, out=0;
+    while(in<size) {
+        int run=1;
+        while(in+run<size && run<128 && src[in+run]==src[in])
+            run++;
+        if(run>=3) {
+            dst[out++]=(uint8_t)(1-run);
+            dst[out++]=src[in];
+            in+=run;
+        } else {
+            //literals up to the next run of 3
+            int len=0;
+            while(in+len<size && len<128) {
+                if(in+len+2<size && src[in+len]==src[in+len+1] && src[in+len]==src[in+len+2])
+                    break;
+                len++;
+            }
+            dst[out++]=(uint8_t)(len-1);
+            memcpy(dst+out, src+in, len);
+            out+=len;
+            in+=len;
+        }
+    }
+    return out;
+}
+
+//Returns bytes written to dst, -1 on corrupt input
+static int rle_decode(const uint8_t *src, int size, uint8_t *dst, int dstSize) {
+    int in=0, out=0;
+    while(in<size) {
+        int n=(int8_t)src[in++];
+        if(n>=0) {
+            if(in+n+1>size || out+n+1>dstSize)
+                return -1;
+            memcpy(dst+out, src+in, n+1);
+            in+=n+1;
+            out+=n+1;
+        } else if(n!=-128) {
+            if(in>=size || out+1-n>dstSize)
+                return -1;
+            memset(dst+out, src[in++], 1-n);
+            out+=1-n;
+        }
+    }
+    return out;
+}
+
+static void put16(uint8_t *p, uint16_t v) { p[0]=v; p[1]=v>>8; }
+static void put32(uint8_t *p, uint32_t v) { p[0]=v; p[1]=v>>8; p[2]=v>>16; p[3]=v>>24; }
+static uint16_t get16(const uint8_t *p) { return p[0] | p[1]<<8; }
+static uint32_t get32(const uint8_t *p) { return p[0] | p[1]<<8 | p[2]<<16 | (uint32_t)p[3]<<24; }
+
+//true if filename ends in .r03
+bool raw03_isPacked(const char *filename) {
+    const char *ext=strrchr(filename, '.');
+    return ext && tolower(ext[1])=='r' && ext[2]=='0' && ext[3]=='3' && !ext[4];
+}
+
+//Appends one capture record to f.  Multi-side captures are stored as consecutive records.
+bool raw03_write(FILE *f, const uint8_t *raw03, int pulses, const captureGap *gaps, int gapCount, int dropped, bool rle) {
+    uint8_t hdr[RAW03_HEADERSIZE];
+    uint8_t *packed, *payload;
+    int packedSize=(pulses+3)/4;
+    int payloadSize;
+
+    packed=(uint8_t*)malloc(packedSize);
+    raw03_pack(raw03, packed, pulses);
+    payload=packed;
+    payloadSize=packedSize;
+    if(rle) {
+        payload=(uint8_t*)malloc(packedSize+packedSize/128+1);
+        payloadSize=rle_encode(packed, packedSize, payload);
+    }
+
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, magic, 4);
+    hdr[4]=RAW03_VERSION;
+    hdr[5]=rle? RAW03_RLE: 0;
+    hdr[6]=RAW03_T0;
+    hdr[7]=RAW03_T1;
+    hdr[8]=RAW03_T2;
+    hdr[9]=RAW03_T3;
+    put16(hdr+10, gapCount);
+    put32(hdr+12, pulses);
+    put32(hdr+16, payloadSize);
+    put32(hdr+20, (uint32_t)time(NULL));
+    put32(hdr+24, dropped);
+
+    fwrite(hdr, 1, sizeof(hdr), f);
+    for(int i=0; i<gapCount; i++) {
+        uint8_t gap[8];
+        put32(gap, gaps[i].pos);
+        put32(gap+4, gaps[i].size);
+        fwrite(gap, 1, 8, f);
+    }
+    bool ok=fwrite(payload, 1, payloadSize, f)==(size_t)payloadSize;
+    if(payload!=packed)
+        free(payload);
+    free(packed);
+    return ok;
+}
+
+bool raw03_save(const char *filename, const uint8_t *raw03, int pulses, const captureGap *gaps, int gapCount, int dropped, bool rle) {
+    FILE *f;
+    bool ok;
+
+    if(!(f=os_openOutput(filename))) {
+        printf("Can't create %s\n", filename);
+        return false;
+    }
+    ok=raw03_write(f, raw03, pulses, gaps, gapCount, dropped, rle);
+    os_closeOutput(f);
+    if(ok)
+        printf("Wrote %s (%d pulses)\n", filename, pulses);
+    return ok;
+}
+
+//Parse the record at *pos and advance past it.  RLE is undone but pulses stay packed:  *packed points
+//into the file when the record isn't compressed, otherwise to *alloc which the caller frees.
+bool raw03_read(const uint8_t **pos, const uint8_t *end, const uint8_t **packed, uint8_t **alloc, int *pulses,
+                captureGap *gaps, int maxGaps, int *gapCount) {
+    const uint8_t *hdr=*pos;
+
+    *alloc=NULL;
+    if(end-hdr<RAW03_HEADERSIZE || memcmp(hdr, magic, 4)) {
+        printf("Not a packed raw03 file.\n");
+        return false;
+    }
+    if(hdr[4]!=RAW03_VERSION) {
+        printf("Unsupported raw03 version %d\n", hdr[4]);
+        return false;
+    }
+    if(hdr[6]!=RAW03_T0 || hdr[7]!=RAW03_T1 || hdr[8]!=RAW03_T2 || hdr[9]!=RAW03_T3)
+        printf("Note: captured with thresholds %02X/%02X/%02X/%02X\n", hdr[6], hdr[7], hdr[8], hdr[9]);
+
+    int count=get16(hdr+10);
+    int payloadSize=get32(hdr+16);
+    const uint8_t *gapTable=hdr+RAW03_HEADERSIZE;
+    const uint8_t *payload=gapTable+count*8;
+    *pulses=get32(hdr+12);
+    int packedSize=(*pulses+3)/4;
+
+    //sizes come from the file, nothing past the end of it gets trusted
+    if(end-gapTable<count*8 || payloadSize<0 || end-payload<payloadSize) {
+        printf("Truncated raw03 file.\n");
+        return false;
+    }
+    if(*pulses<0 || packedSize/64>payloadSize) {        //PackBits expands 64x at most
+        printf("Corrupt raw03 file.\n");
+        return false;
+    }
+    *gapCount=0;
+    for(int i=0; i<count && i<maxGaps; i++) {
+        gaps[i].pos=get32(gapTable+i*8);
+        gaps[i].size=get32(gapTable+i*8+4);
+        if(gaps[i].pos<0 || gaps[i].size<0) {
+            printf("Corrupt raw03 file.\n");
+            return false;
+        }
+        (*gapCount)++;
+    }
+
+    if(hdr[5]&RAW03_RLE) {
+        *alloc=(uint8_t*)malloc(packedSize);
+        if(rle_decode(payload, payloadSize, *alloc, packedSize)!=packedSize) {
+            printf("Corrupt raw03 file.\n");
+            free(*alloc);
+            *alloc=NULL;
+            return false;
+        }
+        *packed=*alloc;
+    } else {
+        if(payloadSize<packedSize) {
+            printf("Truncated raw03 file.\n");
+            return false;
+        }
+        *packed=payload;
+    }
+    *pos=payload+payloadSize;
+    return true;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <stdio.h>
+#include "capture.h"
+
+/*
+Packed raw03 capture file (.r03)
+
+Pulse widths after classification (0..3) stored 4 to a byte, first pulse in the low bits.
+One record per disk side:
+struct {
+    char magic[4];          //"R03P"
+    uint8_t version;        //1
+    uint8_t flags;          //RAW03_RLE: payload is PackBits compressed
+    uint8_t thresholds[4];  //raw_to_raw03 classification thresholds
+    uint16_t gapCount;      //entries in gap table
+    uint32_t pulses;
+    uint32_t payloadSize;   //bytes following the gap table
+    uint32_t timestamp;     //capture time, seconds since 1970
+    uint32_t dropped;       //packets lost during capture
+    uint8_t reserved[4];
+    struct { uint32_t pos, size; } gaps[gapCount];
+    uint8_t payload[payloadSize];
+}
+All fields little endian.
+*/
+
+enum {
+    RAW03_HEADERSIZE=32,
+    RAW03_VERSION=1,
+    RAW03_RLE=1,
+
+    //input capture thresholds, see raw_to_raw03_byte()
+    RAW03_T0=0x48,
+    RAW03_T1=0x70,
+    RAW03_T2=0xA0,
+    RAW03_T3=0xD0,
+};
+
+//Random access to packed pulses, so the decoders can run on a .r03 without unpacking it
+struct packedRaw03 {
+    const uint8_t *data;
+    uint8_t operator[](int i) const { return (data[i>>2]>>((i&3)*2))&3; }
+};
+
+void raw03_pack(const uint8_t *src, uint8_t *dst, int pulses);
+void raw03_unpack(const uint8_t *src, uint8_t *dst, int pulses);
+bool raw03_write(FILE *f, const uint8_t *raw03, int pulses, const captureGap *gaps, int gapCount, int dropped, bool rle);
+bool raw03_save(const char *filename, const uint8_t *raw03, int pulses, const captureGap *gaps, int gapCount, int dropped, bool rle);
+bool raw03_read(const uint8_t **pos, const uint8_t *end, const uint8_t **packed, uint8_t **alloc, int *pulses,
+                captureGap *gaps, int maxGaps, int *gapCount);
+bool raw03_isPacked(const char *filename);
@@ -0,0 +1,77 @@
+#include <stdint.h>
+#include <string.h>
+#include "device.h"
+#include "report.h"
+
+/*
+Report sizes declared in a HID report descriptor, in bytes (report ID not included), per report ID.
+Only what's needed for that:  Report Size/Count/ID globals (with push/pop) and the Input, Output and
+Feature main items.  Long items are skipped.
+*/
+void report_parseSizes(const uint8_t *desc, int size, int (*bits)[256]) {
+    enum { STACKSIZE=4 };
+    struct { uint32_t reportSize, reportCount, reportId; } global={0}, stack[STACKSIZE];
+    int depth=0;
+
+    for(int pos=0; pos<size; ) {
+        uint8_t prefix=desc[pos];
+        if(prefix==0xfe) {      //long item
+            if(pos+1>=size)
+                break;
+            pos+=3+desc[pos+1];
+            continue;
+        }
+        int len=prefix&3;
+        if(len==3)
+            len=4;
+        if(pos+1+len>size)
+            break;
+        uint32_t value=0;
+        for(int i=0; i<len; i++)
+            value|=desc[pos+1+i]<<(i*8);
+        pos+=1+len;
+
+        switch(prefix&0xfc) {
+            case 0x74: global.reportSize=value; break;
+            case 0x94: global.reportCount=value; break;
+            case 0x84: global.reportId=value&0xff; break;
+            case 0xa4: if(depth<STACKSIZE) stack[depth++]=global; break;
+            case 0xb4: if(depth>0) global=stack[--depth]; break;
+            case 0x80: bits[REPORT_INPUT][global.reportId]+=global.reportSize*global.reportCount; break;
+            case 0x90: bits[REPORT_OUTPUT][global.reportId]+=global.reportSize*global.reportCount; break;
+            case 0xb0: bits[REPORT_FEATURE][global.reportId]+=global.reportSize*global.reportCount; break;
+        }
+    }
+}
+
+//Declared payload, less the header bytes the protocol puts in front of the data, or fallback if the
+//report isn't declared.  Capped to max.
+static int payload(int bits, int header, int fallback, int max) {
+    int bytes=bits/8-header;
+    if(bits<=0 || bytes<=0)
+        return fallback;
+    return bytes>max? max: bytes;
+}
+
+static int smaller(int a, int b) {
+    return a<b? a: b;
+}
+
+/*
+Transfer sizes from a report descriptor.  limits keeps its value for anything the descriptor doesn't
+declare.  SPI/SRAM writes carry their length in one byte (hidbuf[1]), so they stop at SPI_LENGTHMAX
+however big the report is.
+*/
+void report_limits(const uint8_t *desc, int size, devLimits *limits) {
+    static thread_local int bits[3][256];
+
+    memset(bits, 0, sizeof(bits));
+    report_parseSizes(desc, size, bits);
+    int *feature=bits[REPORT_FEATURE];
+    int writeMax=smaller(REPORT_MAX-3, SPI_LENGTHMAX);
+    //write:  size, initCS, holdCS, data.  disk read:  sequence, data
+    limits->spiWrite=smaller(payload(feature[ID_SPI_WRITE], 3, limits->spiWrite, writeMax), payload(feature[ID_SRAM_WRITE], 3, limits->spiWrite, writeMax));
+    limits->spiRead=smaller(payload(feature[ID_SPI_READ], 0, limits->spiRead, REPORT_MAX), payload(feature[ID_SRAM_READ], 0, limits->spiRead, REPORT_MAX));
+    limits->diskRead=payload(feature[ID_DISK_READ], 1, limits->diskRead, REPORT_MAX-1);
+    limits->diskWrite=payload(bits[REPORT_OUTPUT][ID_DISK_WRITE], 0, limits->diskWrite, REPORT_MAX);
+}
@@ -0,0 +1,8 @@
+#pragma once
+#include <stdint.h>
+#include "device.h"
+
+enum { REPORT_INPUT, REPORT_OUTPUT, REPORT_FEATURE };
+
+void report_parseSizes(const uint8_t *desc, int size, int (*bits)[256]);
+void report_limits(const uint8_t *desc, int size, devLimits *limits);
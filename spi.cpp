@@ -1,343 +1,797 @@
-#include <stdint.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <memory.h>
-#include "device.h"
-#include "os.h"
-
-
-enum {
-    PAGESIZE=256,
-    CMD_READSTATUS=0x05,
-    CMD_WRITEENABLE=0x06,
-    CMD_READID=0x9f,
-	CMD_READDATA = 0x03,
-	CMD_WRITEDATA = 0x02,
-	CMD_WRITESTATUS=0x01,
-	CMD_PAGEWRITE = 0x0a,
-	CMD_PAGEERASE = 0xdb,
-	CMD_PAGEPROGRAM = 0x02,
-	CMD_BLOCKERASE = 0xd8,
-	CMD_BLOCKERASE64 = CMD_BLOCKERASE,
-	CMD_BLOCKERASE32 = 0x52,
-	CMD_SECTORERASE = 0x20,
-};
-
-uint32_t spi_readID() {
-    static uint8_t readID[]={CMD_READID};
-    uint32_t id=0;
-	 if (!dev_spiWrite(readID, 1, 1, 1)) {
-		 printf("spi_readID: dev_spiWrite failed\n");
-		 return 0;
-	 }
-	 if (!dev_spiRead((uint8_t*)&id, 3, 0)) {
-		 printf("spi_readID: dev_spiRead failed\n");
-		 return 0;
-	 }
-    return id;
-}
-
-uint32_t spi_readFlashSize() {
-	uint32_t id=spi_readID();
-	printf("Flash ID is $%X\n", id);
-	switch(id) {
-		case 0x138020: // ST25PE40, M25PE40: 4Mbit (512kB)
-			return 0x80000;
-		case 0x158020: // M25PE80: 8Mbit (1024kB)
-			return 0x100000;
-		case 0x1440EF: // W25Q80DV (1mB)
-			return 0x100000;
-		case 0x1640EF: // W25Q32FV (4mB)
-			return 0x400000;
-		case 0x1740EF: // W25Q64FV (8mB)
-			return 0x800000;
-		case 0x174001: // S25FL164K (8mB)
-			return 0x800000;
-	}
-	return 0;
-}
-
-bool spi_readFlash(int addr, uint8_t *buf, int size) {
-    static uint8_t cmd[4]={CMD_READDATA,0,0,0};
-    cmd[1]=addr>>16;
-    cmd[2]=addr>>8;
-    cmd[3]=addr;
-    if(!dev_spiWrite(cmd,4,1,1))
-        return false;
-    for(;size>0;size-=SPI_READMAX) {
-        if(!dev_spiRead(buf, size>SPI_READMAX? SPI_READMAX: size, size>SPI_READMAX))
-            return false;
-        buf+=SPI_READMAX;
-    }
-    return true;
-}
-
-bool spi_dumpFlash(char *filename, int addr, int size) {
-    uint8_t *buf=NULL;
-    FILE *f=NULL;
-    bool ok=false;
-
-    do {
-        f=fopen(filename, "wb");
-        if(!f)
-            { printf("Can't open %s\n",filename); break; }
-        buf=(uint8_t*)malloc(size);
-        if(!spi_readFlash(addr, buf, size))
-            break;
-        fwrite(buf, 1, size, f);
-        printf("Dumped %s (0x%X-0x%X)\n",filename, addr, addr+size-1);
-        ok=true;
-    } while(0);
-
-    if(f)
-        fclose(f);
-    if(buf)
-        free(buf);
-    if(!ok)
-        printf("Read failed!\n");
-    return ok;
-}
-
-static bool readStatus(uint8_t *status) {
-    static uint8_t cmd[]={CMD_READSTATUS};
-	 bool ret;
-
-    if(!dev_spiWrite(cmd,1,1,1))
-        return false;
-    ret = dev_spiRead(status,1,0);
-	 printf("readStatus:  status = %X\n", *status);
-	 return ret;
-}
-
-static bool writeEnable() {
-    static uint8_t cmd[]={CMD_WRITEENABLE};
-//	 printf("enabling writes.\n");
-    return dev_spiWrite(cmd,1,1,0);
-}
-
-//wait for write-in-progress to end
-//fail on timeout or read failure
-static bool writeWait(uint32_t timeout_ms) {
-    static uint8_t cmd[]={CMD_READSTATUS};
-    uint8_t status;
-
-    if(!dev_spiWrite(cmd,1,1,1))
-        return false;
-
-    uint32_t start=getTicks();
-    do {
-        if(!dev_spiRead(&status,1,1))
-            return false;
-    } while((status&1) && (getTicks()-start < timeout_ms));
-    if(!dev_spiWrite(0,0,0,0)) // CS release
-        return false;
-    return !(status&1);
-}
-
-static bool unWriteProtect() {
-    static uint8_t cmd[]={CMD_WRITESTATUS,0};
-
-/*    uint8_t status;
-    if(!readStatus(&status))
-        return false;
-	 if (!(status & 0x1c)) {    //already unlocked
-		 printf("unWriteProtect: already unlocked\n");
-		 return true;
-	 }*/
-	 if (!writeEnable()) {
-		 printf("write enable failed.\n");
-		 return false;
-	 }
-//	 printf("write enable ok.\n");
-	 if(!dev_spiWrite(cmd,2,1,0))
-        return false;
-    return writeWait(50);
-}
-
-//write single page
-static bool pageWrite(uint32_t addr, const uint8_t *buf, int size) {
-	uint8_t cmd[PAGESIZE + 4];
-	if (((addr&(PAGESIZE - 1)) + size)>PAGESIZE)
-	{
-		printf("Page write overflow.\n"); return false;
-	}
-	if (!writeEnable())
-		return false;
-	cmd[0] = CMD_PAGEWRITE;
-	cmd[1] = addr >> 16;
-	cmd[2] = addr >> 8;
-	cmd[3] = addr;
-	memcpy(cmd + 4, buf, size);
-	size += 4;
-
-	uint8_t *p = cmd;
-	for (; size>0; size -= SPI_WRITEMAX) {
-		if (!dev_spiWrite(p, size>SPI_WRITEMAX ? SPI_WRITEMAX : size, p == cmd, size>SPI_WRITEMAX))
-			return false;
-		p += SPI_WRITEMAX;
-	}
-	return writeWait(50);
-}
-
-static bool blockErase(uint32_t addr)
-{
-	uint8_t cmd[] = { CMD_BLOCKERASE,0,0,0 };
-	if (!writeEnable())
-		return false;
-	cmd[1] = addr >> 16;
-	if (!dev_spiWrite(cmd, 4, 1, 0))
-		return false;
-	return writeWait(2000);
-}
-
-static bool blockErase32(uint32_t addr)
-{
-	uint8_t cmd[] = { CMD_BLOCKERASE32,0,0,0 };
-	if (!writeEnable())
-		return false;
-	cmd[1] = addr >> 16;
-	cmd[2] = addr >> 8;
-	if (!dev_spiWrite(cmd, 4, 1, 0))
-		return false;
-	return writeWait(1600);
-}
-
-static bool sectorErase(uint32_t addr)
-{
-	uint8_t cmd[] = { CMD_SECTORERASE,0,0,0 };
-	if (!writeEnable())
-		return false;
-	cmd[1] = addr >> 16;
-	cmd[2] = addr >> 8;
-	if (!dev_spiWrite(cmd, 4, 1, 0))
-		return false;
-	return writeWait(600);
-}
-
-static bool pageProgram(uint32_t addr, const uint8_t *buf, int size) {
-	uint8_t cmd[PAGESIZE + 4];
-	if (((addr&(PAGESIZE - 1)) + size)>PAGESIZE)
-	{
-		printf("Page write overflow.\n"); return false;
-	}
-	if (!writeEnable())
-		return false;
-	cmd[0] = CMD_PAGEPROGRAM;
-	cmd[1] = addr >> 16;
-	cmd[2] = addr >> 8;
-	cmd[3] = addr;
-	memcpy(cmd + 4, buf, size);
-	size += 4;
-
-	uint8_t *p = cmd;
-	for (; size>0; size -= SPI_WRITEMAX) {
-		if (!dev_spiWrite(p, size>SPI_WRITEMAX ? SPI_WRITEMAX : size, p == cmd, size>SPI_WRITEMAX))
-			return false;
-		p += SPI_WRITEMAX;
-	}
-	return writeWait(50);
-}
-
-bool spi_writeFlash(const uint8_t *buf, uint32_t addr, uint32_t size) {
-	uint32_t wrote, pageWriteSize;
-	bool ok = false;
-	do {
-		if (blockErase(addr) == 0) {
-			printf("spi_WriteFlash: blockErase failed\n");
-			break;
-		}
-		for (wrote = 0; wrote<size; wrote += pageWriteSize) {
-			pageWriteSize = PAGESIZE - (addr & (PAGESIZE - 1));   //bytes left in page
-			if (pageWriteSize>size - wrote)
-				pageWriteSize = size - wrote;
-			if (pageProgram(addr + wrote, buf + wrote, pageWriteSize) == 0) {
-				printf("spi_WriteFlash: pageErase failed\n");
-				break;
-			}
-			//				if (!pageWrite(addr + wrote, buf + wrote, pageWriteSize))
-			//					break;
-			if ((addr + wrote) % 0x800 == 0)
-				printf(".");
-		}
-		printf("\n");
-		ok = (wrote == size);
-	} while (0);
-	return ok;
-}
-
-//QUICK HACK :(
-bool spi_writeFlash2(const uint8_t *buf, uint32_t addr, uint32_t size) {
-	uint32_t wrote, pageWriteSize;
-	bool ok = false;
-	do {
-		if (blockErase32(addr) == 0) {
-			printf("spi_WriteFlash: blockErase32 failed\n");
-			break;
-		}
-		for (wrote = 0; wrote<size; wrote += pageWriteSize) {
-			pageWriteSize = PAGESIZE - (addr & (PAGESIZE - 1));   //bytes left in page
-			if (pageWriteSize>size - wrote)
-				pageWriteSize = size - wrote;
-			if (pageProgram(addr + wrote, buf + wrote, pageWriteSize) == 0) {
-				printf("spi_WriteFlash2: pageProgram failed\n");
-				break;
-			}
-			if ((addr + wrote) % 0x800 == 0)
-				printf(".");
-		}
-		printf("\n");
-		ok = (wrote == size);
-	} while (0);
-	return ok;
-}
-
-bool spi_writeFile(char *filename, uint32_t addr) {
-    uint8_t *filebuf;
-    uint32_t filesize;
-
-    FILE *f=fopen(filename, "rb");
-    if(!f) {
-        printf("Can't open %s\n",filename);
-        return false;
-    }
-
-    filebuf = (uint8_t*)malloc(dev_flashSize);
-    filesize=fread(filebuf, 1, dev_flashSize, f);
-    fclose(f);
-
-    bool result=spi_writeFlash(filebuf, addr, filesize);
-    free(filebuf);
-    return result;
-}
-
-bool spi_erasePage(int addr) {
-    uint8_t cmd[4];
-    if(!unWriteProtect())
-        { printf("Write protected.\n"); return false; }
-    if(!writeEnable())
-        return false;
-    cmd[0]=CMD_BLOCKERASE;
-    cmd[1]=addr>>16;
-    cmd[2]=0;
-    cmd[3]=0;
-    if(!dev_spiWrite(cmd, 4, 1, 0))
-        return false;
-    return writeWait(2000);
-}
-
-bool spi_writeSram(const uint8_t *buf, uint32_t addr, int size) {
-	static uint8_t cmd[4] = { CMD_WRITEDATA,0,0,0 };
-	cmd[2] = addr >> 8;
-	cmd[3] = addr;
-
-//	printf("outputting write command\n");
-	if (!dev_sramWrite(cmd, 3, 1, 1))
-		return false;
-
-	for (; size>0; size -= SPI_WRITEMAX) {
-		if (!dev_sramWrite((uint8_t*)buf, size>SPI_WRITEMAX ? SPI_WRITEMAX : size, 0, size>SPI_WRITEMAX))
-			return false;
-		buf += SPI_WRITEMAX;
-	}
-	return true;
-}
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <string.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "device.h"
+#include "os.h"
+#include "spi.h"
+
+
+enum {
+    PAGESIZE=256,
+    BLOCKSIZE=0x10000,
+    MAXBLOCKS=256,      //16MB
+    CMD_READSTATUS=0x05,
+    CMD_WRITEENABLE=0x06,
+    CMD_READID=0x9f,
+	CMD_READDATA = 0x03,
+	CMD_WRITEDATA = 0x02,
+	CMD_WRITESTATUS=0x01,
+	CMD_PAGEWRITE = 0x0a,
+	CMD_PAGEERASE = 0xdb,
+	CMD_PAGEPROGRAM = 0x02,
+	CMD_BLOCKERASE = 0xd8,
+	CMD_BLOCKERASE64 = CMD_BLOCKERASE,
+	CMD_BLOCKERASE32 = 0x52,
+	CMD_SECTORERASE = 0x20,
+};
+
+static bool pollStatus(uint32_t timeout_ms);
+
+/*
+Run a whole transaction under dev_policy, from the command on.  Reads are just redone, and so are SRAM
+writes.  Anything that changes the flash passes resyncMs:  a failed transfer may or may not have reached
+the chip, so before it's redone the status register is polled until any program/erase that did start
+is finished.  Redoing those is harmless (erasing twice, or programming the same bytes again, leaves the
+same data).
+*/
+template<typename Op> static bool retry(const char *what, bool sram, uint32_t resyncMs, Op op) {
+    for(int attempt=0; ; attempt++) {
+        if(op())
+            return true;
+        if(sram)            //CS release
+            dev_sramWrite(0,0,0,0);
+        else
+            dev_spiWrite(0,0,0,0);
+        if(!dev_retry(what, attempt))
+            return false;
+        if(resyncMs && !sram)
+            pollStatus(resyncMs);
+    }
+}
+
+static bool readID(uint32_t *id) {
+    uint8_t cmd[]={CMD_READID};
+    *id=0;
+	 if (!dev_spiWrite(cmd, 1, 1, 1)) {
+		 printf("spi_readID: dev_spiWrite failed\n");
+		 return false;
+	 }
+	 if (!dev_spiRead((uint8_t*)id, 3, 0)) {
+		 printf("spi_readID: dev_spiRead failed\n");
+		 return false;
+	 }
+    return true;
+}
+
+uint32_t spi_readID() {
+    uint32_t id=0;
+    if(!retry("flash ID", false, 0, [&] { return readID(&id); }))
+        return 0;
+    return id;
+}
+
+uint32_t spi_readFlashSize() {
+	uint32_t id=spi_readID();
+	printf("Flash ID is $%X\n", id);
+	switch(id) {
+		case 0x138020: // ST25PE40, M25PE40: 4Mbit (512kB)
+			return 0x80000;
+		case 0x158020: // M25PE80: 8Mbit (1024kB)
+			return 0x100000;
+		case 0x1440EF: // W25Q80DV (1mB)
+			return 0x100000;
+		case 0x1640EF: // W25Q32FV (4mB)
+			return 0x400000;
+		case 0x1740EF: // W25Q64FV (8mB)
+			return 0x800000;
+		case 0x174001: // S25FL164K (8mB)
+			return 0x800000;
+	}
+	return 0;
+}
+
+static bool readFlash(int addr, uint8_t *buf, int size) {
+    uint8_t cmd[4]={CMD_READDATA,0,0,0};
+    cmd[1]=addr>>16;
+    cmd[2]=addr>>8;
+    cmd[3]=addr;
+    if(!dev_spiWrite(cmd,4,1,1))
+        return false;
+    int max=dev_limits()->spiRead;
+    for(;size>0;size-=max) {
+        if(!dev_spiRead(buf, size>max? max: size, size>max))
+            return false;
+        buf+=max;
+    }
+    return true;
+}
+
+bool spi_readFlash(int addr, uint8_t *buf, int size) {
+    return retry("flash read", false, 0, [=] { return readFlash(addr, buf, size); });
+}
+
+//---- read-ahead stream
+
+/*
+Reads consecutive blocks on a helper thread with a single read command, into a small pool of
+buffers, so the caller can decode one block while the next one comes over USB.  Only the helper
+talks to the device until spi_streamStop().  A failed transfer restarts the read command at the
+start of the block it was in, under dev_policy.
+*/
+enum { STREAM_BUFFERS=4 };
+
+struct spiStream {
+    uint8_t *buf[STREAM_BUFFERS];
+    int blockSize, count;
+    int head, tail;             //blocks read, blocks released
+    bool done, error, quit;
+    uint64_t readUs;
+    std::mutex lock;
+    std::condition_variable signal;
+    std::thread thread;
+};
+
+//One per calling thread (each farm worker has its own adapter), shared with that thread's helper
+static thread_local spiStream stream;
+
+static bool streamCommand(uint32_t addr) {
+    uint8_t cmd[4]={CMD_READDATA, (uint8_t)(addr>>16), (uint8_t)(addr>>8), (uint8_t)addr};
+    return dev_spiWrite(cmd, 4, 1, 1);
+}
+
+static void streamRun(spiStream *st, devContext *owner, uint32_t addr) {
+    bool ok=true, held=false;
+
+    dev_attach(owner);
+    int max=dev_limits()->spiRead;
+    for(int block=0; ok && block<st->count; block++) {
+        {
+            std::unique_lock<std::mutex> lock(st->lock);
+            st->signal.wait(lock, [=] { return st->head-st->tail<STREAM_BUFFERS || st->quit; });
+            if(st->quit)
+                break;
+        }
+        uint8_t *buf=st->buf[block%STREAM_BUFFERS];
+        uint64_t start=getMicros();
+        for(int attempt=0; ; attempt++) {
+            ok=held=(held || streamCommand(addr+block*st->blockSize));
+            for(int pos=0; ok && pos<st->blockSize; pos+=max) {
+                int len=st->blockSize-pos<max? st->blockSize-pos: max;
+                held=(block<st->count-1 || pos+len<st->blockSize);
+                ok=dev_spiRead(buf+pos, len, held);
+            }
+            if(ok)
+                break;
+            dev_spiWrite(0, 0, 0, 0);   //CS release, the next attempt sends the command again
+            held=false;
+            if(!dev_retry("flash stream", attempt))
+                break;
+        }
+        st->readUs+=getMicros()-start;
+        std::lock_guard<std::mutex> lock(st->lock);
+        if(ok)
+            st->head++;
+        st->signal.notify_all();
+    }
+    if(held)
+        dev_spiWrite(0, 0, 0, 0);   //CS release
+    std::lock_guard<std::mutex> lock(st->lock);
+    st->error=!ok;
+    st->done=true;
+    st->signal.notify_all();
+}
+
+bool spi_streamStart(uint32_t addr, int blockSize, int count) {
+    for(int i=0; i<STREAM_BUFFERS; i++)
+        stream.buf[i]=(uint8_t*)malloc(blockSize);
+    stream.blockSize=blockSize;
+    stream.count=count;
+    stream.head=stream.tail=0;
+    stream.done=stream.error=stream.quit=false;
+    stream.readUs=0;
+    stream.thread=std::thread(streamRun, &stream, dev_current(), addr);
+    return true;
+}
+
+//Next block in order, NULL at the end or on a read error
+const uint8_t *spi_streamNext() {
+    std::unique_lock<std::mutex> lock(stream.lock);
+    stream.signal.wait(lock, [] { return stream.head>stream.tail || stream.done; });
+    if(stream.head>stream.tail)
+        return stream.buf[stream.tail%STREAM_BUFFERS];
+    return NULL;
+}
+
+void spi_streamRelease() {
+    std::lock_guard<std::mutex> lock(stream.lock);
+    stream.tail++;
+    stream.signal.notify_all();
+}
+
+//Returns false if there was a read error.  *readMs = time spent reading.
+bool spi_streamStop(uint32_t *readMs) {
+    {
+        std::lock_guard<std::mutex> lock(stream.lock);
+        stream.quit=true;
+        stream.signal.notify_all();
+    }
+    stream.thread.join();
+    for(int i=0; i<STREAM_BUFFERS; i++) {
+        free(stream.buf[i]);
+        stream.buf[i]=NULL;
+    }
+    if(readMs)
+        *readMs=(uint32_t)(stream.readUs/1000);
+    return !stream.error;
+}
+
+//streams to the file a slot at a time, "-" = stdout
+bool spi_dumpFlash(char *filename, int addr, int size) {
+    enum { CHUNK=0x10000 };
+    uint8_t *buf=NULL;
+    FILE *f=NULL;
+    bool ok=false;
+
+    do {
+        f=os_openOutput(filename);
+        if(!f)
+            { printf("Can't open %s\n",filename); break; }
+        buf=(uint8_t*)malloc(CHUNK);
+        int pos;
+        for(pos=0; pos<size; pos+=CHUNK) {
+            int len=size-pos<CHUNK? size-pos: CHUNK;
+            if(!spi_readFlash(addr+pos, buf, len))
+                break;
+            if(fwrite(buf, 1, len, f)!=(size_t)len)
+                break;
+            os_progress(pos+len, size);
+        }
+        if(pos<size)
+            break;
+        printf("Dumped %s (0x%X-0x%X)\n",filename, addr, addr+size-1);
+        ok=true;
+    } while(0);
+
+    if(f)
+        os_closeOutput(f);
+    if(buf)
+        free(buf);
+    if(!ok)
+        printf("Read failed!\n");
+    return ok;
+}
+
+static bool readStatus(uint8_t *status) {
+    uint8_t cmd[]={CMD_READSTATUS};
+	 bool ret;
+
+    if(!dev_spiWrite(cmd,1,1,1))
+        return false;
+    ret = dev_spiRead(status,1,0);
+	 printf("readStatus:  status = %X\n", *status);
+	 return ret;
+}
+
+static bool writeEnable() {
+    uint8_t cmd[]={CMD_WRITEENABLE};
+//	 printf("enabling writes.\n");
+    return dev_spiWrite(cmd,1,1,0);
+}
+
+//wait for write-in-progress to end
+//fail on timeout or read failure
+static bool pollStatus(uint32_t timeout_ms) {
+    uint8_t cmd[]={CMD_READSTATUS};
+    uint8_t status;
+
+    if(!dev_spiWrite(cmd,1,1,1))
+        return false;
+
+    uint32_t start=getTicks();
+    do {
+        if(!dev_spiRead(&status,1,1))
+            return false;
+    } while((status&1) && (getTicks()-start < timeout_ms));
+    if(!dev_spiWrite(0,0,0,0)) // CS release
+        return false;
+    return !(status&1);
+}
+
+static bool writeWait(uint32_t timeout_ms) {
+    return retry("status poll", false, 0, [=] { return pollStatus(timeout_ms); });
+}
+
+static bool unWriteProtect() {
+    uint8_t cmd[]={CMD_WRITESTATUS,0};
+
+/*    uint8_t status;
+    if(!readStatus(&status))
+        return false;
+	 if (!(status & 0x1c)) {    //already unlocked
+		 printf("unWriteProtect: already unlocked\n");
+		 return true;
+	 }*/
+	 if (!writeEnable()) {
+		 printf("write enable failed.\n");
+		 return false;
+	 }
+//	 printf("write enable ok.\n");
+	 if(!dev_spiWrite(cmd,2,1,0))
+        return false;
+    return writeWait(50);
+}
+
+//write single page
+static bool pageWrite(uint32_t addr, const uint8_t *buf, int size) {
+	uint8_t cmd[PAGESIZE + 4];
+	if (((addr&(PAGESIZE - 1)) + size)>PAGESIZE)
+	{
+		printf("Page write overflow.\n"); return false;
+	}
+	if (!writeEnable())
+		return false;
+	cmd[0] = CMD_PAGEWRITE;
+	cmd[1] = addr >> 16;
+	cmd[2] = addr >> 8;
+	cmd[3] = addr;
+	memcpy(cmd + 4, buf, size);
+	size += 4;
+
+	uint8_t *p = cmd;
+	int max = dev_limits()->spiWrite;
+	for (; size>0; size -= max) {
+		if (!dev_spiWrite(p, size>max ? max : size, p == cmd, size>max))
+			return false;
+		p += max;
+	}
+	return writeWait(50);
+}
+
+static bool blockEraseOnce(uint32_t addr)
+{
+	uint8_t cmd[] = { CMD_BLOCKERASE,0,0,0 };
+	if (!writeEnable())
+		return false;
+	cmd[1] = addr >> 16;
+	if (!dev_spiWrite(cmd, 4, 1, 0))
+		return false;
+	return pollStatus(2000);
+}
+
+static bool blockErase(uint32_t addr) {
+	return retry("block erase", false, 2000, [=] { return blockEraseOnce(addr); });
+}
+
+static bool blockErase32Once(uint32_t addr)
+{
+	uint8_t cmd[] = { CMD_BLOCKERASE32,0,0,0 };
+	if (!writeEnable())
+		return false;
+	cmd[1] = addr >> 16;
+	cmd[2] = addr >> 8;
+	if (!dev_spiWrite(cmd, 4, 1, 0))
+		return false;
+	return pollStatus(1600);
+}
+
+static bool blockErase32(uint32_t addr) {
+	return retry("block erase", false, 1600, [=] { return blockErase32Once(addr); });
+}
+
+static bool sectorEraseOnce(uint32_t addr)
+{
+	uint8_t cmd[] = { CMD_SECTORERASE,0,0,0 };
+	if (!writeEnable())
+		return false;
+	cmd[1] = addr >> 16;
+	cmd[2] = addr >> 8;
+	if (!dev_spiWrite(cmd, 4, 1, 0))
+		return false;
+	return pollStatus(600);
+}
+
+static bool sectorErase(uint32_t addr) {
+	return retry("sector erase", false, 600, [=] { return sectorEraseOnce(addr); });
+}
+
+static bool pageProgramOnce(uint32_t addr, const uint8_t *buf, int size) {
+	uint8_t cmd[PAGESIZE + 4];
+	if (((addr&(PAGESIZE - 1)) + size)>PAGESIZE)
+	{
+		printf("Page write overflow.\n"); return false;
+	}
+	if (!writeEnable())
+		return false;
+	cmd[0] = CMD_PAGEPROGRAM;
+	cmd[1] = addr >> 16;
+	cmd[2] = addr >> 8;
+	cmd[3] = addr;
+	memcpy(cmd + 4, buf, size);
+	size += 4;
+
+	uint8_t *p = cmd;
+	int max = dev_limits()->spiWrite;
+	for (; size>0; size -= max) {
+		if (!dev_spiWrite(p, size>max ? max : size, p == cmd, size>max))
+			return false;
+		p += max;
+	}
+	return pollStatus(50);
+}
+
+static bool pageProgram(uint32_t addr, const uint8_t *buf, int size) {
+	return retry("page program", false, 50, [=] { return pageProgramOnce(addr, buf, size); });
+}
+
+//Erases each 64K block as it gets to it
+bool spi_writeFlash(const uint8_t *buf, uint32_t addr, uint32_t size) {
+	uint32_t wrote, pageWriteSize;
+	bool ok = false;
+	do {
+		for (wrote = 0; wrote<size; wrote += pageWriteSize) {
+			if ((wrote == 0 || (addr + wrote) % BLOCKSIZE == 0) && blockErase(addr + wrote) == 0) {
+				printf("spi_WriteFlash: blockErase failed\n");
+				break;
+			}
+			pageWriteSize = PAGESIZE - ((addr + wrote) & (PAGESIZE - 1));   //bytes left in page
+			if (pageWriteSize>size - wrote)
+				pageWriteSize = size - wrote;
+			if (pageProgram(addr + wrote, buf + wrote, pageWriteSize) == 0) {
+				printf("spi_WriteFlash: pageErase failed\n");
+				break;
+			}
+			//				if (!pageWrite(addr + wrote, buf + wrote, pageWriteSize))
+			//					break;
+			if ((addr + wrote) % 0x800 == 0) {
+				printf(".");
+				os_progress(wrote, size);
+			}
+		}
+		printf("\n");
+		ok = (wrote == size);
+	} while (0);
+	return ok;
+}
+
+//QUICK HACK :(
+bool spi_writeFlash2(const uint8_t *buf, uint32_t addr, uint32_t size) {
+	uint32_t wrote, pageWriteSize;
+	bool ok = false;
+	do {
+		if (blockErase32(addr) == 0) {
+			printf("spi_WriteFlash: blockErase32 failed\n");
+			break;
+		}
+		for (wrote = 0; wrote<size; wrote += pageWriteSize) {
+			pageWriteSize = PAGESIZE - (addr & (PAGESIZE - 1));   //bytes left in page
+			if (pageWriteSize>size - wrote)
+				pageWriteSize = size - wrote;
+			if (pageProgram(addr + wrote, buf + wrote, pageWriteSize) == 0) {
+				printf("spi_WriteFlash2: pageProgram failed\n");
+				break;
+			}
+			if ((addr + wrote) % 0x800 == 0) {
+				printf(".");
+				os_progress(wrote, size);
+			}
+		}
+		printf("\n");
+		ok = (wrote == size);
+	} while (0);
+	return ok;
+}
+
+//Only the sectors of [addr, addr+size) that differ from buf are erased and programmed (pages that
+//stay blank are skipped), then the whole range is read back if anything changed.  addr and size are whole sectors.
+//*changed gets the number of sectors rewritten.
+bool spi_updateFlash(const uint8_t *buf, uint32_t addr, uint32_t size, int *changed) {
+	uint8_t *flash = (uint8_t*)malloc(size);
+	uint32_t pos, page;
+	bool ok = false;
+
+	*changed = 0;
+	do {
+		if ((addr | size) & (SECTORSIZE - 1)) {
+			printf("spi_updateFlash: not sector aligned\n");
+			break;
+		}
+		if (!spi_readFlash(addr, flash, size))
+			break;
+		for (pos = 0; pos < size; pos += SECTORSIZE) {
+			if (!memcmp(flash + pos, buf + pos, SECTORSIZE))
+				continue;
+			if (!sectorErase(addr + pos)) {
+				printf("spi_updateFlash: sectorErase failed\n");
+				break;
+			}
+			for (page = pos; page < pos + SECTORSIZE; page += PAGESIZE) {
+				const uint8_t *p = buf + page;
+				int i;
+				for (i = 0; i < PAGESIZE && p[i] == 0xff; i++)
+					;
+				if (i < PAGESIZE && !pageProgram(addr + page, p, PAGESIZE)) {
+					printf("spi_updateFlash: pageProgram failed\n");
+					break;
+				}
+			}
+			if (page < pos + SECTORSIZE)
+				break;
+			(*changed)++;
+			printf(".");
+			os_progress(pos, size);
+		}
+		if (pos < size)
+			break;
+		if (!*changed) {        //what was just read is the verify
+			ok = true;
+			break;
+		}
+		printf("\n");
+
+		//read back everything, including sectors that were already right
+		if (!spi_readFlash(addr, flash, size))
+			break;
+		for (pos = 0; pos < size && !memcmp(flash + pos, buf + pos, SECTORSIZE); pos += SECTORSIZE)
+			;
+		if (pos < size) {
+			printf("Verify failed at %X\n", addr + pos);
+			break;
+		}
+		ok = true;
+	} while (0);
+	free(flash);
+	return ok;
+}
+
+//---- write journal
+
+/*
+Long writes go a 64K block at a time and note each finished block (with a hash of what was written)
+in a journal under the user's data directory, one per adapter serial.  If the write is interrupted,
+running it again with resume set checks the last finished block and carries on from there.
+*/
+struct writeJournal {
+    char magic[4];              //"FWJ1"
+    char serial[64];
+    uint32_t addr, size, hash;  //what is being written
+    uint32_t done;              //finished blocks
+    uint32_t blockHash[MAXBLOCKS];
+};
+
+static uint32_t fnv1a(const uint8_t *buf, uint32_t size) {
+    uint32_t hash=2166136261u;
+    while(size--)
+        hash=(hash^*buf++)*16777619u;
+    return hash;
+}
+
+static void writeJournalPath(char *path, size_t size) {
+    char name[96];
+    sprintf(name, "write-%s.jnl", dev_serial[0]? dev_serial: "default");
+    if(!os_dataPath(name, path, size))
+        strcpy(path, "write.jnl");
+}
+
+static bool saveWriteJournal(const writeJournal *j) {
+    char path[1024], tmp[1040];
+    writeJournalPath(path, sizeof(path));
+    sprintf(tmp, "%s.tmp", path);
+    FILE *f=fopen(tmp, "wb");
+    if(!f)
+        return false;
+    bool ok=fwrite(j, sizeof(*j), 1, f)==1;
+    ok&=!fclose(f);
+    remove(path);               //rename won't replace on Windows
+    return ok && !rename(tmp, path);
+}
+
+static bool loadWriteJournal(writeJournal *j) {
+    char path[1024];
+    writeJournalPath(path, sizeof(path));
+    FILE *f=fopen(path, "rb");
+    if(!f)
+        return false;
+    bool ok=fread(j, sizeof(*j), 1, f)==1;
+    fclose(f);
+    return ok && !memcmp(j->magic, "FWJ1", 4) && !strcmp(j->serial, dev_serial) && j->done<=MAXBLOCKS;
+}
+
+static void removeWriteJournal() {
+    char path[1024];
+    writeJournalPath(path, sizeof(path));
+    remove(path);
+}
+
+//spi_writeFlash with a journal.  addr is block aligned.
+bool spi_writeJournaled(const uint8_t *buf, uint32_t addr, uint32_t size, bool resume) {
+    static thread_local writeJournal journal;       //too big for the stack, one per thread
+    uint8_t *check;
+    uint32_t blocks=(size+BLOCKSIZE-1)/BLOCKSIZE;
+    uint32_t hash=fnv1a(buf, size);
+    bool match;
+
+    if(addr%BLOCKSIZE || blocks>MAXBLOCKS)
+        return spi_writeFlash(buf, addr, size);
+
+    match=loadWriteJournal(&journal) && journal.addr==addr && journal.size==size && journal.hash==hash;
+    if(resume && !match) {
+        printf("Nothing to resume, writing everything\n");
+    } else if(!resume && match && journal.done) {
+        printf("(an interrupted write of this image can be continued with --resume)\n");
+    }
+    if(!resume || !match) {
+        memset(&journal, 0, sizeof(journal));
+        memcpy(journal.magic, "FWJ1", 4);
+        strcpy(journal.serial, dev_serial);
+        journal.addr=addr;
+        journal.size=size;
+        journal.hash=hash;
+    }
+
+    //the last block noted may not have made it, or the flash was changed since
+    check=(uint8_t*)malloc(BLOCKSIZE);
+    while(journal.done) {
+        uint32_t pos=(journal.done-1)*BLOCKSIZE;
+        uint32_t len=size-pos<BLOCKSIZE? size-pos: BLOCKSIZE;
+        if(spi_readFlash(addr+pos, check, len) && fnv1a(check, len)==journal.blockHash[journal.done-1])
+            break;
+        journal.done--;
+    }
+    free(check);
+    if(journal.done)
+        printf("Resuming at block %u of %u\n", journal.done+1, blocks);
+
+    for(; journal.done<blocks; journal.done++) {
+        uint32_t pos=journal.done*BLOCKSIZE;
+        uint32_t len=size-pos<BLOCKSIZE? size-pos: BLOCKSIZE;
+        if(!saveWriteJournal(&journal))
+            printf("Can't save write journal\n");
+        if(!spi_writeFlash(buf+pos, addr+pos, len)) {
+            printf("Write stopped at block %u of %u, use --resume to continue\n", journal.done+1, blocks);
+            return false;
+        }
+        journal.blockHash[journal.done]=fnv1a(buf+pos, len);
+    }
+    removeWriteJournal();
+    return true;
+}
+
+bool spi_writeFile(char *filename, uint32_t addr, bool resume) {
+    mappedFile in;
+    uint32_t filesize;
+
+    if(!os_mapFile(filename, &in)) {
+        printf("Can't open %s\n",filename);
+        return false;
+    }
+    filesize=(uint32_t)in.size;
+    if(filesize>(uint32_t)dev_flashSize)
+        filesize=dev_flashSize;
+
+    bool result=spi_writeJournaled(in.data, addr, filesize, resume);
+    os_unmapFile(&in);
+    return result;
+}
+
+bool spi_erasePage(int addr) {
+    if(!unWriteProtect())
+        { printf("Write protected.\n"); return false; }
+    return blockErase(addr);
+}
+
+static bool writeSram(const uint8_t *buf, uint32_t addr, int size) {
+	uint8_t cmd[4] = { CMD_WRITEDATA,0,0,0 };
+	cmd[1] = addr >> 8;      //16-bit address
+	cmd[2] = addr;
+
+//	printf("outputting write command\n");
+	if (!dev_sramWrite(cmd, 3, 1, 1))
+		return false;
+
+	int max = dev_limits()->spiWrite;
+	for (; size>0; size -= max) {
+		if (!dev_sramWrite((uint8_t*)buf, size>max ? max : size, 0, size>max))
+			return false;
+		buf += max;
+	}
+	return true;
+}
+
+static bool readSram(uint32_t addr, uint8_t *buf, int size) {
+	uint8_t cmd[4] = { CMD_READDATA,0,0,0 };
+	cmd[1] = addr >> 8;
+	cmd[2] = addr;
+
+	if (!dev_sramWrite(cmd, 3, 1, 1))
+		return false;
+	int max = dev_limits()->spiRead;
+	for (; size>0; size -= max) {
+		if (!dev_sramRead(buf, size>max ? max : size, size>max))
+			return false;
+		buf += max;
+	}
+	return true;
+}
+
+bool spi_writeSram(const uint8_t *buf, uint32_t addr, int size) {
+	return retry("SRAM write", true, 0, [=] { return writeSram(buf, addr, size); });
+}
+
+bool spi_readSram(uint32_t addr, uint8_t *buf, int size) {
+	return retry("SRAM read", true, 0, [=] { return readSram(addr, buf, size); });
+}
+
+//Read back SRAM [0, size) and compare, a bad transfer shows up here instead of on the disk
+static bool checkSram(const uint8_t *image, int size, uint8_t *check) {
+	if (!spi_readSram(0, check, size))
+		return false;
+	if (memcmp(check, image, size)) {
+		printf("SRAM verify failed (0000-%04X)\n", size - 1);
+		return false;
+	}
+	return true;
+}
+
+/*
+Put a disk side in SRAM:  buf followed by zeros up to SRAMSIZE.  The shadow holds what was staged last
+time, so only the ranges that changed go out.  Changes closer together than one report are sent as one
+run, a new run costs a command report anyway.  The first side (shadow not valid) goes out whole.
+Before the write can start, the staged side (and anything sent past it) is read back in one go, which
+also catches SRAM that changed since the shadow was taken;  if it doesn't match, the whole image is
+sent once more.
+*/
+bool spi_stageSram(sramShadow *shadow, const uint8_t *buf, int size, uint32_t *sent) {
+	enum { TRIES = 2 };
+	uint8_t *image = (uint8_t*)malloc(SRAMSIZE);
+	uint8_t *check = (uint8_t*)malloc(SRAMSIZE);
+	bool ok = true;
+
+	if (size > SRAMSIZE)
+		size = SRAMSIZE;
+	memcpy(image, buf, size);
+	memset(image + size, 0, SRAMSIZE - size);
+	*sent = 0;
+
+	for (int tries = 0; tries < TRIES; tries++) {
+		int pos = 0, end = size;
+		ok = true;
+		while (pos < SRAMSIZE) {
+			if (shadow->valid && image[pos] == shadow->data[pos]) {
+				pos++;
+				continue;
+			}
+			int start = pos, last = pos;
+			if (!shadow->valid) {
+				last = SRAMSIZE - 1;
+			}
+			else {
+				for (pos++; pos < SRAMSIZE && pos - last <= dev_limits()->spiWrite; pos++) {
+					if (image[pos] != shadow->data[pos])
+						last = pos;
+				}
+			}
+			*sent += 3 + last - start + 1;
+			if (!(ok = spi_writeSram(image + start, start, last - start + 1)))
+				break;
+			pos = last + 1;
+			if (pos > end)
+				end = pos;
+		}
+		if (ok)
+			ok = checkSram(image, end, check);
+		shadow->valid = ok;      //unknown contents after a failed upload, send everything next time
+		if (ok)
+			break;
+	}
+
+	if (ok)
+		memcpy(shadow->data, image, SRAMSIZE);
+	free(check);
+	free(image);
+	return ok;
+}
@@ -1,15 +1,30 @@
-#pragma once
-
-enum { 
-    SLOTSIZE=0x10000,
-};
-
-uint32_t spi_readID();
-uint32_t spi_readFlashSize();
-bool spi_dumpFlash(char *filename, int addr, int size);
-bool spi_writeFile(char *filename, uint32_t addr);
-bool spi_writeFlash(const uint8_t *buf, uint32_t addr, uint32_t size);
-bool spi_writeFlash2(const uint8_t *buf, uint32_t addr, uint32_t size);
-bool spi_erasePage(int addr);
-bool spi_readFlash(int addr, uint8_t *buf, int size);
-bool spi_writeSram(const uint8_t *buf, uint32_t addr, int size);
+#pragma once
+
+enum { 
+    SLOTSIZE=0x10000,
+    SRAMSIZE=0x10000,       //disk side staging
+    SECTORSIZE=0x1000,      //smallest flash erase (spi_updateFlash granularity)
+};
+
+struct sramShadow {
+    uint8_t data[SRAMSIZE];
+    bool valid;
+};
+
+uint32_t spi_readID();
+uint32_t spi_readFlashSize();
+bool spi_dumpFlash(char *filename, int addr, int size);
+bool spi_writeFile(char *filename, uint32_t addr, bool resume);
+bool spi_writeFlash(const uint8_t *buf, uint32_t addr, uint32_t size);
+bool spi_writeJournaled(const uint8_t *buf, uint32_t addr, uint32_t size, bool resume);
+bool spi_writeFlash2(const uint8_t *buf, uint32_t addr, uint32_t size);
+bool spi_updateFlash(const uint8_t *buf, uint32_t addr, uint32_t size, int *changed);
+bool spi_erasePage(int addr);
+bool spi_readFlash(int addr, uint8_t *buf, int size);
+bool spi_streamStart(uint32_t addr, int blockSize, int count);
+const uint8_t *spi_streamNext();
+void spi_streamRelease();
+bool spi_streamStop(uint32_t *readMs);
+bool spi_writeSram(const uint8_t *buf, uint32_t addr, int size);
+bool spi_readSram(uint32_t addr, uint8_t *buf, int size);
+bool spi_stageSram(sramShadow *shadow, const uint8_t *buf, int size, uint32_t *sent);
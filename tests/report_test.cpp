@@ -0,0 +1,80 @@
+//Report descriptor parsing and the transfer sizes picked from it.  Run with "make test".
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "../report.h"
+
+static int failures;
+
+static void check(const char *what, int got, int want) {
+    if(got!=want) {
+        printf("FAIL %s:  got %d, want %d\n", what, got, want);
+        failures++;
+    }
+}
+
+//Vendor page, one collection, 8-bit fields.  SPI write declares a 1027 byte report (two-byte
+//Report Count), SPI read is inside a push/pop that changes the report size.
+static const uint8_t bigReports[]={
+    0x06, 0x00, 0xff,           //Usage Page (vendor)
+    0x09, 0x01,                 //Usage
+    0xa1, 0x01,                 //Collection (application)
+    0x75, 0x08,                 //  Report Size 8
+    0x85, ID_SPI_WRITE,         //  Report ID
+    0x96, 0x03, 0x04,           //  Report Count 1027
+    0x09, 0x01, 0xb1, 0x02,     //  Feature
+    0x85, ID_SRAM_WRITE,
+    0x96, 0x03, 0x04,
+    0x09, 0x01, 0xb1, 0x02,
+    0xa4,                       //  Push
+    0x75, 0x10,                 //    Report Size 16
+    0x85, ID_SPI_READ,
+    0x95, 0x40,                 //    Report Count 64 (128 bytes)
+    0x09, 0x01, 0xb1, 0x02,
+    0xb4,                       //  Pop (back to 8 bits)
+    0x85, ID_SRAM_READ,
+    0x95, 0x80,                 //  Report Count 128
+    0x09, 0x01, 0xb1, 0x02,
+    0x85, ID_DISK_READ,
+    0x95, 0xff,
+    0x09, 0x01, 0xb1, 0x02,
+    0xfe, 0x02, 0x00, 0xaa, 0xbb,   //long item, skipped
+    0x85, ID_DISK_WRITE,
+    0x95, 0xff,
+    0x09, 0x01, 0x91, 0x02,     //  Output
+    0xc0,                       //End Collection
+};
+
+static const devLimits defaults={ SPI_WRITEMAX, SPI_READMAX, DISK_READMAX, DISK_WRITEMAX };
+
+int main() {
+    int bits[3][256];
+    devLimits limits;
+
+    memset(bits, 0, sizeof(bits));
+    report_parseSizes(bigReports, sizeof(bigReports), bits);
+    check("SPI write bits", bits[REPORT_FEATURE][ID_SPI_WRITE], 1027*8);
+    check("SPI read bits (pushed size)", bits[REPORT_FEATURE][ID_SPI_READ], 128*8);
+    check("SRAM read bits (popped size)", bits[REPORT_FEATURE][ID_SRAM_READ], 128*8);
+    check("disk write bits", bits[REPORT_OUTPUT][ID_DISK_WRITE], 255*8);
+    check("disk write isn't a feature", bits[REPORT_FEATURE][ID_DISK_WRITE], 0);
+
+    limits=defaults;
+    report_limits(bigReports, sizeof(bigReports), &limits);
+    check("SPI write capped to the length byte", limits.spiWrite, SPI_LENGTHMAX);
+    check("SPI read", limits.spiRead, 128);
+    check("disk read", limits.diskRead, 254);
+    check("disk write", limits.diskWrite, 255);
+
+    //truncated in the middle of an item:  whatever was complete counts, the rest keeps the defaults
+    limits=defaults;
+    report_limits(bigReports, 12, &limits);
+    check("truncated, SPI write", limits.spiWrite, defaults.spiWrite);
+    check("truncated, SPI read", limits.spiRead, defaults.spiRead);
+
+    if(failures)
+        printf("%d check(s) failed\n", failures);
+    else
+        printf("report descriptor tests passed\n");
+    return failures? 1: 0;
+}
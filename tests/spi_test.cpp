@@ -0,0 +1,233 @@
+//spi.cpp against an emulated adapter (SPI flash and SRAM behind the device layer) with injected
+//transfer failures:  retried page programs and erases, the read-ahead stream restarting a block,
+//and the SRAM readback catching a bad upload.  Run with "make test".
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "../device.h"
+#include "../spi.h"
+
+//---- emulated device layer, just what spi.cpp calls
+
+struct devContext {};
+thread_local int dev_flashSize=0x200000;
+thread_local char dev_serial[64]="TEST";
+
+static std::vector<uint8_t> flash(0x200000, 0xff), sram(SRAMSIZE, 0);
+static std::vector<uint8_t> txn;                //SPI bytes since CS went low
+static uint32_t readAddr;
+static uint8_t readCmd;
+static uint32_t sramAddr;
+static bool sramReading;
+static int retries, failures;
+
+//Injected faults:  fail the nth page program / erase / flash data read report, flip one SRAM byte
+static int programs, failProgramAt=-1;
+static int erases, failEraseAt=-1;
+static int reads, failReadAt=-1;
+static int corruptSramAt=-1;
+
+static devLimits limits={ SPI_WRITEMAX, SPI_READMAX, DISK_READMAX, DISK_WRITEMAX };
+devPolicy dev_policy={ 1000, 3, 0 };
+
+devContext *dev_current() { return NULL; }
+void dev_attach(devContext *ctx) { (void)ctx; }
+const devLimits *dev_limits() { return &limits; }
+
+bool dev_retry(const char *what, int attempt) {
+    (void)what;
+    if(attempt>=dev_policy.retries) {
+        failures++;
+        return false;
+    }
+    retries++;
+    return true;
+}
+
+static uint32_t txnAddr() {
+    return txn[1]<<16|txn[2]<<8|txn[3];
+}
+
+static void erase(uint32_t size) {
+    uint32_t addr=txnAddr()&~(size-1);
+    memset(&flash[addr], 0xff, size);
+}
+
+bool dev_spiWrite(uint8_t *buf, int size, bool initCS, bool holdCS) {
+    if(initCS)
+        txn.clear();
+    txn.insert(txn.end(), buf, buf+size);
+    if(txn.empty())         //CS release
+        return true;
+    if(holdCS) {            //a read follows
+        readCmd=txn[0];
+        if(txn.size()>=4)
+            readAddr=txnAddr();
+        return true;
+    }
+    switch(txn[0]) {
+        case 0x02:
+            if(programs++==failProgramAt)
+                return false;
+            for(size_t i=4; i<txn.size(); i++)
+                flash[txnAddr()+i-4]&=txn[i];
+            break;
+        case 0xd8:
+            if(erases++==failEraseAt)
+                return false;
+            erase(0x10000);
+            break;
+        case 0x52: erase(0x8000); break;
+        case 0x20: erase(0x1000); break;
+    }
+    return true;
+}
+
+bool dev_spiRead(uint8_t *buf, int size, bool holdCS) {
+    (void)holdCS;
+    if(readCmd==0x03) {
+        if(reads++==failReadAt) {       //the data went by, the report didn't make it
+            readAddr+=size;
+            return false;
+        }
+        memcpy(buf, &flash[readAddr], size);
+        readAddr+=size;
+    } else {
+        memset(buf, 0, size);           //status:  never busy
+    }
+    return true;
+}
+
+bool dev_sramWrite(uint8_t *buf, int size, bool initCS, bool holdCS) {
+    (void)holdCS;
+    if(!size)
+        return true;
+    if(initCS) {
+        sramReading=(buf[0]==0x03);
+        sramAddr=buf[1]<<8|buf[2];
+        return true;
+    }
+    memcpy(&sram[sramAddr], buf, size);
+    if(corruptSramAt>=0 && (int)sramAddr<=corruptSramAt && corruptSramAt<(int)sramAddr+size) {
+        sram[corruptSramAt]^=1;
+        corruptSramAt=-1;
+    }
+    sramAddr+=size;
+    return true;
+}
+
+bool dev_sramRead(uint8_t *buf, int size, bool holdCS) {
+    (void)holdCS;
+    memcpy(buf, &sram[sramAddr], size);
+    sramAddr+=size;
+    return true;
+}
+
+//---- tests
+
+static int failed;
+
+static void check(const char *what, bool ok) {
+    if(!ok) {
+        printf("FAIL %s\n", what);
+        failed++;
+    }
+}
+
+static void randomFill(std::vector<uint8_t> &buf) {
+    for(size_t i=0; i<buf.size(); i++)
+        buf[i]=rand();
+}
+
+static void testPageProgramRetry() {
+    std::vector<uint8_t> image(0x4000);
+    randomFill(image);
+    retries=0;
+    programs=0;
+    failProgramAt=7;
+    check("page program retry:  write", spi_writeFlash(image.data(), 0x10000, image.size()));
+    check("page program retry:  contents", !memcmp(&flash[0x10000], image.data(), image.size()));
+    check("page program retry:  one retry", retries==1);
+    failProgramAt=-1;
+}
+
+static void testEraseRetry() {
+    memset(&flash[0x30000], 0, 0x10000);
+    retries=0;
+    erases=0;
+    failEraseAt=0;
+    check("erase retry:  erase", spi_erasePage(0x30000));
+    check("erase retry:  blank", flash[0x30000]==0xff && flash[0x3ffff]==0xff);
+    check("erase retry:  one retry", retries==1);
+    failEraseAt=-1;
+}
+
+static void testGiveUp() {
+    std::vector<uint8_t> buf(0x100);
+    retries=failures=0;
+    reads=0;
+    failReadAt=0;
+    dev_policy.retries=0;
+    check("no retries:  read fails", !spi_readFlash(0, buf.data(), buf.size()));
+    check("no retries:  counted", failures==1 && retries==0);
+    dev_policy.retries=3;
+    failReadAt=-1;
+}
+
+static void testStreamRestart() {
+    enum { BLOCK=0x8000, COUNT=8, ADDR=0x80000 };
+    std::vector<uint8_t> image(BLOCK*COUNT);
+    const uint8_t *block;
+    int got=0, bad=0;
+    uint32_t ms;
+
+    randomFill(image);
+    memcpy(&flash[ADDR], image.data(), image.size());
+    retries=0;
+    reads=0;
+    failReadAt=BLOCK*3/SPI_READMAX;     //in the middle of block 3
+    spi_streamStart(ADDR, BLOCK, COUNT);
+    while((block=spi_streamNext())) {
+        bad+=!!memcmp(block, &image[got*BLOCK], BLOCK);
+        got++;
+        spi_streamRelease();
+    }
+    check("stream restart:  no error", spi_streamStop(&ms));
+    check("stream restart:  every block", got==COUNT);
+    check("stream restart:  contents", !bad);
+    check("stream restart:  one retry", retries==1);
+    failReadAt=-1;
+}
+
+static void testSramReadback() {
+    static sramShadow shadow;
+    std::vector<uint8_t> side(60000);
+    uint32_t sent;
+
+    randomFill(side);
+    shadow.valid=false;
+    check("SRAM stage", spi_stageSram(&shadow, side.data(), side.size(), &sent));
+    check("SRAM stage:  contents", !memcmp(sram.data(), side.data(), side.size()));
+
+    side[0x8000]^=0xff;                 //one changed byte, corrupted on the way
+    corruptSramAt=0x8000;
+    check("SRAM readback:  resent", spi_stageSram(&shadow, side.data(), side.size(), &sent));
+    check("SRAM readback:  contents", !memcmp(sram.data(), side.data(), side.size()));
+    check("SRAM readback:  corruption happened", corruptSramAt<0);
+}
+
+int main() {
+    setbuf(stdout, NULL);
+    testPageProgramRetry();
+    testEraseRetry();
+    testGiveUp();
+    testStreamRestart();
+    testSramReadback();
+    if(failed)
+        printf("%d check(s) failed\n", failed);
+    else
+        printf("spi tests passed\n");
+    return failed? 1: 0;
+}